@@ -0,0 +1,47 @@
+#include "accounts.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <cstdio>
+#include <filesystem>
+
+/*
+ * What a login costs, the first time for a user and every time after during a reconnect storm
+ */
+
+static std::string bench_account_file()
+{
+    return (std::filesystem::temp_directory_path() / "netbench_accounts.db").string();
+}
+
+static void BM_AccountVerifyCold(benchmark::State& state)
+{
+    const std::string path = bench_account_file();
+    std::remove(path.c_str());
+    AccountStore store;
+    store.open(path);
+    store.create("bench_user","correct horse",ROLE::USER);
+    ROLE role;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(store.verify("bench_user","wrong horse",role)); // Failures are never cached
+    state.SetItemsProcessed(state.iterations());
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_AccountVerifyCold)->Unit(benchmark::kMillisecond);
+
+static void BM_AccountVerifyCached(benchmark::State& state)
+{
+    const std::string path = bench_account_file();
+    std::remove(path.c_str());
+    AccountStore store;
+    store.open(path);
+    store.create("bench_user","correct horse",ROLE::USER);
+    ROLE role;
+    store.verify("bench_user","correct horse",role);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(store.verify("bench_user","correct horse",role));
+    state.SetItemsProcessed(state.iterations());
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_AccountVerifyCached)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,63 @@
+#ifndef NETWORK_BENCH_COMMON_HPP
+#define NETWORK_BENCH_COMMON_HPP
+
+#include "os_diff.hpp"
+#include "database.hpp"
+
+#include <string>
+#include <memory>
+#include <utility>
+
+// A connected TCP pair over loopback, works the same on Windows and Linux
+inline bool make_loopback_pair(SOCKET& sender, SOCKET& receiver)
+{
+    const SOCKET listener = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr_length length = sizeof(address);
+    if (0 > bind(listener,reinterpret_cast<sockaddr*>(&address),sizeof(address)) ||
+        0 > listen(listener,1) ||
+        0 > getsockname(listener,reinterpret_cast<sockaddr*>(&address),&length))
+    {
+        CLOSE_SOCKET(listener);
+        return false;
+    }
+
+    sender = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    if (0 > connect(sender,reinterpret_cast<sockaddr*>(&address),sizeof(address)))
+    {
+        CLOSE_SOCKET(sender);
+        CLOSE_SOCKET(listener);
+        return false;
+    }
+    receiver = accept(listener,nullptr,nullptr);
+    CLOSE_SOCKET(listener);
+
+    // Big enough that a whole message fits before anyone reads it
+    const int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sender,SOL_SOCKET,SO_SNDBUF,reinterpret_cast<const char*>(&buffer_size),sizeof(buffer_size));
+    setsockopt(receiver,SOL_SOCKET,SO_RCVBUF,reinterpret_cast<const char*>(&buffer_size),sizeof(buffer_size));
+    return true;
+}
+
+inline std::string bench_username(size_t index)
+{
+    return "user" + std::to_string(index);
+}
+
+// Fake sockets start high so they never look like anything real
+inline SOCKET bench_socket(size_t index)
+{
+    return static_cast<SOCKET>(100000 + index);
+}
+
+// Adds users straight into the Database, skipping the join announcements
+inline void populate(Database& database, size_t users)
+{
+    for (size_t i = 0; i < users; ++i)
+        database.add(std::make_shared<ClientData>(bench_username(i),STARTING_ROOM_NAME,bench_socket(i),sockaddr_in{}));
+}
+
+#endif //NETWORK_BENCH_COMMON_HPP
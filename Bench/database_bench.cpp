@@ -0,0 +1,57 @@
+#include "bench_common.hpp"
+#include "database.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+
+/*
+ * Each benchmark fills a Database with range(0) users and then times one
+ * operation against it, undoing it straight after so the size stays put
+ */
+
+static void BM_DatabaseAddRem(benchmark::State& state)
+{
+    Database database;
+    populate(database,state.range(0));
+    const ClientDataPtr extra = std::make_shared<ClientData>("extra",STARTING_ROOM_NAME,bench_socket(state.range(0)),sockaddr_in{});
+    for (auto _ : state)
+    {
+        database.add(extra);
+        database.rem(extra);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_DatabaseAddRem)->RangeMultiplier(10)->Range(1000,1000000)->Unit(benchmark::kMicrosecond);
+
+static void BM_DatabaseMove(benchmark::State& state)
+{
+    Database database;
+    populate(database,state.range(0));
+    const SOCKET mover = bench_socket(state.range(0) / 2);
+    for (auto _ : state)
+    {
+        database.move(mover,"lobby");
+        database.move(mover,STARTING_ROOM_NAME);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_DatabaseMove)->RangeMultiplier(10)->Range(1000,1000000)->Unit(benchmark::kMicrosecond);
+
+static void BM_DatabaseBefriend(benchmark::State& state)
+{
+    Database database;
+    populate(database,state.range(0));
+    const SOCKET first = bench_socket(0);
+    const SOCKET second = bench_socket(state.range(0) - 1);
+    const std::string first_name = bench_username(0);
+    const std::string second_name = bench_username(state.range(0) - 1);
+    for (auto _ : state)
+    {
+        database.befriend(first,second_name); // Request
+        database.befriend(second,first_name); // Accept
+        database.unfriend(first,second_name);
+    }
+    state.SetItemsProcessed(state.iterations() * 3);
+}
+BENCHMARK(BM_DatabaseBefriend)->RangeMultiplier(10)->Range(1000,1000000)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,93 @@
+#include "bench_common.hpp"
+#include "server_core.hpp"
+#include "transport.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Fan-out and batched receives through the real ServerCore with a loopback transport
+ * Frames are counted and dropped so only encode and dispatch cost is measured
+ */
+
+static void BM_AnnounceRoom(benchmark::State& state)
+{
+    LoopbackTransport transport;
+    transport.keep_frames = false;
+    ServerCore core{transport};
+    populate(core.m_users,state.range(0));
+    const std::string message = "[SERVER] | Somebody has joined HOMEROOM";
+    for (auto _ : state)
+        core.announce_room(STARTING_ROOM_NAME,message);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AnnounceRoom)->RangeMultiplier(10)->Range(10,100000)->Unit(benchmark::kMicrosecond);
+
+static void BM_AnnounceAll(benchmark::State& state)
+{
+    LoopbackTransport transport;
+    transport.keep_frames = false;
+    ServerCore core{transport};
+    populate(core.m_users,state.range(0));
+    const std::string message = "[SERVER] | The server will restart soon";
+    for (auto _ : state)
+        core.announce_all(message);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AnnounceAll)->RangeMultiplier(10)->Range(10,100000)->Unit(benchmark::kMicrosecond);
+
+// Same again with live sessions, every send also lands in a replay buffer
+static void BM_AnnounceAllSessions(benchmark::State& state)
+{
+    LoopbackTransport transport;
+    transport.keep_frames = false;
+    ServerCore core{transport};
+    populate(core.m_users,state.range(0));
+    for (const auto& user : core.m_users.by_socket)
+        core.m_sessions.open(user.first);
+    const std::string message = "[SERVER] | The server will restart soon";
+    for (auto _ : state)
+        core.announce_all(message);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AnnounceAllSessions)->RangeMultiplier(10)->Range(10,100000)->Unit(benchmark::kMicrosecond);
+
+// Live sessions again with range(1) fan-out threads helping the caller
+static void BM_AnnounceAllParallel(benchmark::State& state)
+{
+    LoopbackTransport transport;
+    transport.keep_frames = false;
+    ServerCore core{transport};
+    core.m_fanout.start(state.range(1));
+    populate(core.m_users,state.range(0));
+    for (const auto& user : core.m_users.by_socket)
+        core.m_sessions.open(user.first);
+    const std::string message = "[SERVER] | The server will restart soon";
+    for (auto _ : state)
+        core.announce_all(message);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AnnounceAllParallel)->ArgsProduct({{10000,100000},{0,1,3}})->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+// One pass of ROOM_LIST requests from range(0) users in rooms of 32, range(1) fan-out threads prepare them
+static void BM_ReceiveAllParallel(benchmark::State& state)
+{
+    LoopbackTransport transport;
+    transport.keep_frames = false;
+    ServerCore core{transport};
+    core.m_fanout.start(state.range(1));
+    const size_t users = state.range(0);
+    populate(core.m_users,users);
+    std::vector<Received> batch;
+    for (size_t i = 0; i < users; ++i)
+    {
+        core.m_users.move(bench_socket(i),"room" + std::to_string(i / 32));
+        batch.push_back(Received{bench_socket(i),std::string(2,static_cast<char>(ROOM_LIST))});
+    }
+    for (auto _ : state)
+        core.receive_all(batch);
+    state.SetItemsProcessed(state.iterations() * users);
+}
+BENCHMARK(BM_ReceiveAllParallel)->ArgsProduct({{1024,8192},{0,1,3}})->Unit(benchmark::kMicrosecond)->UseRealTime();
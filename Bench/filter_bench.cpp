@@ -0,0 +1,49 @@
+#include "filter.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+#include <random>
+
+/*
+ * One message through a word list of range(0) patterns, the cost the chat path pays per message
+ */
+
+static std::vector<std::string> word_list(size_t count)
+{
+    std::mt19937 generator(11);
+    std::vector<std::string> patterns;
+    patterns.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string pattern;
+        const size_t length = 4 + generator() % 8;
+        for (size_t c = 0; c < length; ++c)
+            pattern.push_back(static_cast<char>('a' + generator() % 26));
+        patterns.push_back(std::move(pattern));
+    }
+    return patterns;
+}
+
+static void BM_FilterApply(benchmark::State& state)
+{
+    const auto automaton = FilterAutomaton::build(word_list(state.range(0)));
+    const std::string message = "hey is anyone around for the release review tonight, the build is broken again after that merge";
+    for (auto _ : state)
+    {
+        std::string text = message;
+        benchmark::DoNotOptimize(automaton->apply(text));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(message.size()));
+    state.counters["table_mb"] = static_cast<double>(automaton->memory()) / (1024 * 1024);
+}
+BENCHMARK(BM_FilterApply)->Arg(1000)->Arg(20000)->Arg(50000);
+
+static void BM_FilterBuild(benchmark::State& state)
+{
+    const auto patterns = word_list(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(FilterAutomaton::build(patterns));
+}
+BENCHMARK(BM_FilterBuild)->Arg(20000)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,120 @@
+#include "bench_common.hpp"
+#include "packet_sender.hpp"
+#include "simd_scan.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+static std::string make_payload(size_t size)
+{
+    std::string payload(size,'a');
+    for (size_t i = 0; i < size; ++i)
+        payload[i] = static_cast<char>('a' + i % 26);
+    return payload;
+}
+
+static void BM_EncodeMessage(benchmark::State& state)
+{
+    const std::string payload = make_payload(state.range(0));
+    for (auto _ : state)
+    {
+        std::string frames = PACMAN::encode_message(MESSAGE,payload);
+        benchmark::DoNotOptimize(frames);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeMessage)->RangeMultiplier(4)->Range(16,64 << 10);
+
+static void BM_SendReceive(benchmark::State& state)
+{
+    SOCKET sender, receiver;
+    if (!make_loopback_pair(sender,receiver))
+    {
+        state.SkipWithError("Could not open a loopback pair");
+        return;
+    }
+    const std::string payload = make_payload(state.range(0));
+    std::string output;
+    for (auto _ : state)
+    {
+        PACMAN::send_message(sender,MESSAGE,payload);
+        PACMAN::receive_message(receiver,output);
+        benchmark::DoNotOptimize(output);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    PACMAN::forget(receiver);
+    CLOSE_SOCKET(sender);
+    CLOSE_SOCKET(receiver);
+}
+BENCHMARK(BM_SendReceive)->RangeMultiplier(4)->Range(16,64 << 10);
+
+// Bulk replies at the default frame size against a negotiated one
+static void BM_SendReceiveFramed(benchmark::State& state)
+{
+    SOCKET sender, receiver;
+    if (!make_loopback_pair(sender,receiver))
+    {
+        state.SkipWithError("Could not open a loopback pair");
+        return;
+    }
+    const std::string payload = make_payload(state.range(0));
+    const size_t frame = static_cast<size_t>(state.range(1));
+    std::string output;
+    for (auto _ : state)
+    {
+        PACMAN::send_message(sender,MESSAGE,payload,frame);
+        PACMAN::receive_message(receiver,output);
+        benchmark::DoNotOptimize(output);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    PACMAN::forget(receiver);
+    CLOSE_SOCKET(sender);
+    CLOSE_SOCKET(receiver);
+}
+BENCHMARK(BM_SendReceiveFramed)->ArgsProduct({{16 << 10,192 << 10},{PACMAN::packet_size,PACMAN::max_packet_size}});
+
+// Worst case for the cleaner, every so often a reserved byte has to come out
+static void BM_CleanString(benchmark::State& state)
+{
+    std::string dirty = make_payload(state.range(0));
+    for (size_t i = 0; i < dirty.size(); i += 64)
+        dirty[i] = static_cast<char>(TAIL_CODE_CONTINUE);
+    for (auto _ : state)
+    {
+        std::string input = dirty;
+        PACMAN::clean_string(input);
+        benchmark::DoNotOptimize(input);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(SCAN::kernel_name());
+}
+BENCHMARK(BM_CleanString)->RangeMultiplier(4)->Range(16,64 << 10);
+
+// Frame payload with the tail at the very end, the receiver's common case
+static void BM_FindTail(benchmark::State& state)
+{
+    std::string frame = make_payload(state.range(0));
+    frame.back() = static_cast<char>(TAIL_CODE_END);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(SCAN::find_tail(frame.data(),frame.size()));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(SCAN::kernel_name());
+}
+BENCHMARK(BM_FindTail)->RangeMultiplier(4)->Range(16,64 << 10);
+
+// Mostly ASCII with a two byte character every so often
+static void BM_ValidUtf8(benchmark::State& state)
+{
+    std::string text = make_payload(state.range(0));
+    for (size_t i = 0; i + 1 < text.size(); i += 48)
+    {
+        text[i] = static_cast<char>(0xC3);
+        text[i+1] = static_cast<char>(0xA9);
+    }
+    for (auto _ : state)
+        benchmark::DoNotOptimize(SCAN::valid_utf8(text.data(),text.size()));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.SetLabel(SCAN::kernel_name());
+}
+BENCHMARK(BM_ValidUtf8)->RangeMultiplier(4)->Range(16,64 << 10);
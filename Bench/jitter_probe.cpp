@@ -0,0 +1,150 @@
+#include "os_diff.hpp"
+#include "logging.hpp"
+#include "NETWORK_CODES.hpp"
+#include "packet_sender.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+/*
+ * Room message latency through a running server, for comparing it with and without --low-latency
+ * One connection sends numbered messages into HOMEROOM on a fixed schedule, a second one in the same room
+ * reads them back. Latency counts from when a message was due, not when it went out, so a stalled
+ * sender still shows up in the tail
+ * NETJITTER [ADDRESS] [PORT] [--rate PER_SECOND] [--seconds N]
+ */
+
+#define JITTER_DEFAULT_RATE 2000
+#define JITTER_DEFAULT_SECONDS 10
+#define JITTER_WARMUP 1000 // Left out of the numbers
+#define JITTER_TAG "jitter "
+
+typedef std::chrono::steady_clock probe_clock;
+
+static SOCKET open_connection(const sockaddr_in& server, std::string name)
+{
+    name += static_cast<char>(TAIL_CODE_END); // Ends the handshake
+    const SOCKET connection = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    if (INVALID_SOCKET == connection) return INVALID_SOCKET;
+    if (connect(connection,reinterpret_cast<const sockaddr*>(&server),sizeof(server)) < 0 ||
+        send(connection,name.c_str(),static_cast<int>(name.size()),0) < 0)
+    {
+        CLOSE_SOCKET(connection);
+        return INVALID_SOCKET;
+    }
+    const int on = 1;
+    setsockopt(connection,IPPROTO_TCP,TCP_NODELAY,reinterpret_cast<const char*>(&on),sizeof(on));
+    return connection;
+}
+
+static double percentile(const std::vector<double>& sorted, double fraction)
+{
+    if (sorted.empty()) return 0;
+    const size_t index = std::min(sorted.size() - 1,static_cast<size_t>(fraction * static_cast<double>(sorted.size())));
+    return sorted[index];
+}
+
+int main(const int argc, char* argv[])
+{
+    std::string address = "127.0.0.1";
+    int port = 25565;
+    long rate = JITTER_DEFAULT_RATE;
+    long seconds = JITTER_DEFAULT_SECONDS;
+    int positional = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        if (argument == "--rate" && i + 1 < argc) rate = std::max(1L,std::stol(argv[++i]));
+        else if (argument == "--seconds" && i + 1 < argc) seconds = std::max(1L,std::stol(argv[++i]));
+        else if (positional++ == 0) address = argument;
+        else port = std::stoi(argument);
+    }
+
+    int result{};
+    WINSOCK_LINK
+
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET,address.c_str(),&server.sin_addr) != 1)
+    {
+        LOG_ERROR("Not an IPv4 address | " << address);
+        return EXIT_FAILURE;
+    }
+
+    const std::string suffix = std::to_string(std::chrono::system_clock::now().time_since_epoch().count() % 100000);
+    const SOCKET receiver = open_connection(server,"jitter_rx" + suffix);
+    const SOCKET sender = open_connection(server,"jitter_tx" + suffix);
+    if (INVALID_SOCKET == receiver || INVALID_SOCKET == sender)
+    {
+        LOG_ERROR("Could not connect | " << address << ':' << port << " | " << GET_LAST_ERROR);
+        return EXIT_FAILURE;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200)); // Both in the room before anything is sent
+
+    const size_t total = static_cast<size_t>(rate * seconds) + JITTER_WARMUP;
+    const auto start = probe_clock::now() + std::chrono::milliseconds(100);
+    const auto interval = std::chrono::nanoseconds(1000000000L / rate);
+    std::vector<double> latencies(total,-1.0); // Microseconds, -1 never arrived
+    std::atomic<bool> done{false};
+
+    std::thread reading([&] {
+        std::string message;
+        size_t seen = 0;
+        while (seen < total && PACMAN::receive_message(receiver,message) == PACMAN::RECV_RETURN_CODE::RECV_GOOD)
+        {
+            const auto arrived = probe_clock::now();
+            const size_t tag = message.find(JITTER_TAG);
+            if (message[0] != MESSAGE || tag == std::string::npos) continue;
+            const size_t sequence = std::strtoull(message.c_str() + tag + sizeof(JITTER_TAG) - 1,nullptr,10);
+            if (sequence >= total) continue;
+            const auto due = start + interval * static_cast<long>(sequence);
+            latencies[sequence] = std::chrono::duration<double,std::micro>(arrived - due).count();
+            ++seen;
+        }
+        done.store(true);
+    });
+
+    for (size_t sequence = 0; sequence < total; ++sequence)
+    {
+        const auto due = start + interval * static_cast<long>(sequence);
+        while (probe_clock::now() < due) {} // Sleeping would add its own jitter
+        if (!PACMAN::send_message(sender,MESSAGE,JITTER_TAG + std::to_string(sequence))) break;
+    }
+
+    // Stragglers get a second, then the rest count as lost
+    const auto give_up = probe_clock::now() + std::chrono::seconds(1);
+    while (!done.load() && probe_clock::now() < give_up)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    PACMAN::send_message(sender,DISCONNECT,"x");
+    PACMAN::send_message(receiver,DISCONNECT,"x"); // The server hanging up ends the read
+    reading.join();
+    CLOSE_SOCKET(sender);
+    CLOSE_SOCKET(receiver);
+
+    std::vector<double> sorted;
+    size_t lost = 0;
+    for (size_t i = JITTER_WARMUP; i < total; ++i)
+    {
+        if (latencies[i] < 0) ++lost;
+        else sorted.push_back(latencies[i]);
+    }
+    std::sort(sorted.begin(),sorted.end());
+
+    std::cout << "Messages " << sorted.size() << " | Lost " << lost << " | Rate " << rate << "/s" << std::endl;
+    std::cout << "p50 " << percentile(sorted,0.5) << "us | p99 " << percentile(sorted,0.99)
+              << "us | p999 " << percentile(sorted,0.999) << "us | max " << (sorted.empty() ? 0 : sorted.back()) << "us" << std::endl;
+    WINSOCK_CLEANUP;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#include "search.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <random>
+
+/*
+ * Query latency once range(0) messages are indexed, built inline without the indexing thread
+ */
+
+static const char* m_words[] = {"hello","release","server","lunch","deploy","broken","fixed","tonight","anyone","meeting",
+                                "coffee","build","merge","review","weekend","game","patch","latency","thanks","later"};
+
+static void fill(SearchIndex& index, size_t count)
+{
+    std::mt19937 generator(7);
+    index.budget = ~size_t(0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string text;
+        for (int w = 0; w < 8; ++w)
+            text += std::string(m_words[generator() % 20]) + ' ';
+        text += "ticket" + std::to_string(i % 5000);
+        index.add(SearchMessage{"room" + std::to_string(i % 50),"user" + std::to_string(i % 1000),{},text});
+    }
+}
+
+static void BM_SearchRare(benchmark::State& state)
+{
+    SearchIndex index;
+    fill(index,state.range(0));
+    const SearchQuery query = SearchIndex::parse("ticket1234 deploy");
+    for (auto _ : state)
+        benchmark::DoNotOptimize(index.query(query,"user1",SEARCH_MAX_RESULTS));
+    state.counters["memory_mb"] = static_cast<double>(index.memory()) / (1024 * 1024);
+}
+BENCHMARK(BM_SearchRare)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void BM_SearchCommon(benchmark::State& state)
+{
+    SearchIndex index;
+    fill(index,state.range(0));
+    const SearchQuery query = SearchIndex::parse("hello lunch from:user42");
+    for (auto _ : state)
+        benchmark::DoNotOptimize(index.query(query,"user1",SEARCH_MAX_RESULTS));
+}
+BENCHMARK(BM_SearchCommon)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void BM_SearchIndexing(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        SearchIndex index;
+        fill(index,state.range(0));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SearchIndexing)->Arg(100000)->Unit(benchmark::kMillisecond);
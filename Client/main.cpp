@@ -1,67 +1,125 @@
 #include "os_diff.hpp"
 #include "logging.hpp"
 #include "packet_sender.hpp"
+#include "datagram.hpp"
+#include "tls.hpp"
+#include "render.hpp"
+#include "script.hpp"
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <fstream>
 #include <vector>
 #include <map>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <sstream>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 #define DEFAULT_PORT 25565
+#define RECONNECT_ATTEMPTS 5
+#define DATAGRAM_INTERVAL_SECONDS 5
+#define DRAIN_LIMIT 4096 // Messages handled per wakeup before datagrams and the select() get a turn
+#define DEFAULT_SCROLLBACK 50
 
-typedef void(*Command)(const std::vector<std::string>&);
+typedef void(*Command)(const std::vector<std::string_view>&);
 struct CommandEntry
 {
     Command command;
     std::string usage;
 };
 
-SOCKET main_socket;
+std::atomic<SOCKET> main_socket;
 std::string username;
-std::map<std::string,CommandEntry> m_commands;
+std::string session_token;
+uint64_t messages_received = 0; // Handed back to the server when resuming
+std::atomic<bool> admitted{false}; // Scripts hold off until the name is accepted, no point sending a refused one the whole file
+std::atomic<size_t> frame_size{PACMAN::packet_size}; // Raised once the server agrees to bigger frames
+
+// Datagram side channel, only set up once the server hands out an id
+std::atomic<SOCKET> datagram_socket{INVALID_SOCKET};
+std::atomic<uint32_t> datagram_id{};
+DATAGRAM::Key datagram_key{}; // Too wide for a lock free atomic
+std::mutex datagram_key_lock;
+sockaddr_in datagram_server{};
+std::map<std::string,CommandEntry,std::less<>> m_commands;
 std::atomic<bool> is_running{};
+Renderer m_renderer;
+
+// Scripts only, commands collect their frames here and the script sends a batch at a time
+bool batching = false;
+std::string outgoing;
+ScriptStats m_script;
 
-std::vector<std::string> split_string(const std::string& input)
+// One pass, every word is a view into input so it only lives as long as the line does
+// Repeated spaces give empty words, same as always
+std::vector<std::string_view> split_string(std::string_view input)
 {
-    std::vector<std::string> output;
-    std::string input_copy = input + ' ';
-    size_t position;
-    while ((position = input_copy.find(' ')) != std::string::npos)
+    std::vector<std::string_view> output;
+    size_t start = 0;
+    for (;;)
     {
-        output.emplace_back(input_copy.substr(0,position));
-        input_copy.erase(0,position + 1);
+        const size_t space = input.find(' ',start);
+        output.push_back(input.substr(start,space == std::string_view::npos ? std::string_view::npos : space - start));
+        if (space == std::string_view::npos) return output;
+        start = space + 1;
     }
-    return output;
 }
 
-bool parse_input(const std::string& input)
+// The command name if the line ran one, otherwise empty
+std::string_view parse_input(std::string_view input)
 {
     auto cut = split_string(input);
-    if (cut.empty()) return false;
-    if (cut[0].empty()) return false;
-    if (cut[0][0] != '/') return false;
-    if (cut[0].size() <= 1) return false;
-    std::string entry = cut[0].substr(1);
+    if (cut.empty()) return {};
+    if (cut[0].empty()) return {};
+    if (cut[0][0] != '/') return {};
+    if (cut[0].size() <= 1) return {};
+    const std::string_view entry = cut[0].substr(1);
     cut.erase(cut.begin());
-    if (!m_commands.count(entry))
+    const auto found = m_commands.find(entry);
+    if (found == m_commands.end())
     {
         CLIENT_MESSAGE("Command Not Found");
-        return false;
+        return {};
     }
-    m_commands.at(entry).command(cut);
-    return true;
+    found->second.command(cut);
+    return entry;
+}
+
+typedef const std::vector<std::string_view>& PARAMETERS;
+
+// The words back as they were typed, they all point into the same line
+std::string joined(PARAMETERS param)
+{
+    std::string output(param.front().data(),param.back().data() + param.back().size() - param.front().data());
+    output += ' ';
+    return output;
 }
 
-typedef const std::vector<std::string>& PARAMETERS;
+void send_to_server(NETWORK_CODE header, const std::string& message)
+{
+    if (batching)
+    {
+        outgoing += PACMAN::encode_message(header,message,frame_size);
+        return;
+    }
+    PACMAN::send_message(main_socket,header,message,frame_size);
+}
 
 void quit_command(PARAMETERS param)
 {
     is_running.store(false);
     CLIENT_MESSAGE("Quitting");
-    PACMAN::send_message(main_socket,DISCONNECT,"A");
+    send_to_server(DISCONNECT,"A");
 }
 
 void help_command(PARAMETERS param)
@@ -74,12 +132,13 @@ void help_command(PARAMETERS param)
     }
     else
     {
-        if (!m_commands.count(param[0]))
+        const auto found = m_commands.find(param[0]);
+        if (found == m_commands.end())
         {
             CLIENT_MESSAGE("Invalid Parameters for /help. See /help without parameters for more commands.");
             return;
         }
-        CLIENT_MESSAGE(m_commands.at(param[0]).usage);
+        CLIENT_MESSAGE(found->second.usage);
     }
 }
 
@@ -90,7 +149,7 @@ void joinroom_command(PARAMETERS param)
         CLIENT_MESSAGE("Join Room requires the name of the room. See /help for more commands.");
         return;
     }
-    PACMAN::send_message(main_socket,JOIN_ROOM,param[0]);
+    send_to_server(JOIN_ROOM,std::string(param[0]));
 }
 
 void authenticate_command(PARAMETERS param)
@@ -100,7 +159,17 @@ void authenticate_command(PARAMETERS param)
         CLIENT_MESSAGE("AUTHENTICATION requires an authentication code. See /help for more commands.");
         return;
     }
-    PACMAN::send_message(main_socket,AUTHENTICATE,param[0]);
+    send_to_server(AUTHENTICATE,std::string(param[0]));
+}
+
+void register_command(PARAMETERS param)
+{
+    if (param.empty())
+    {
+        CLIENT_MESSAGE("Registering requires a password. See /help register for more.");
+        return;
+    }
+    send_to_server(REGISTER,std::string(param[0]));
 }
 
 void friend_command(PARAMETERS param)
@@ -110,17 +179,17 @@ void friend_command(PARAMETERS param)
         CLIENT_MESSAGE("You need to provide somebody's name to befriend.");
         return;
     }
-    PACMAN::send_message(main_socket,FRIEND_REQUEST,param[0]);
+    send_to_server(FRIEND_REQUEST,std::string(param[0]));
 }
 
 void list_command(PARAMETERS param)
 {
-    PACMAN::send_message(main_socket,ROOM_LIST,"A");
+    send_to_server(ROOM_LIST,"A");
 }
 
 void friendslist_command(PARAMETERS param)
 {
-    PACMAN::send_message(main_socket,FRIENDS_LIST,"A");
+    send_to_server(FRIENDS_LIST,"A");
 }
 
 void whisper_command(PARAMETERS param)
@@ -130,29 +199,321 @@ void whisper_command(PARAMETERS param)
         CLIENT_MESSAGE("You need to provide a user and a message to whipser");
         return;
     }
-    std::stringstream packet;
-    for (const auto& p : param)
-        packet << p << ' ';
-    PACMAN::send_message(main_socket,WHISPER,packet.str());
+    send_to_server(WHISPER,joined(param));
 }
 
 void shutoff_command(PARAMETERS param)
 {
-    PACMAN::send_message(main_socket,ADMIN_SHUTOFF,"A");
+    send_to_server(ADMIN_SHUTOFF,"A");
 }
 
 void announce_command(PARAMETERS param)
 {
-    std::stringstream msg;
-    for (const auto& p : param)
-        msg << p << ' ';
-    PACMAN::send_message(main_socket,ADMIN_ANNOUNCE,msg.str());
+    if (param.empty()) return;
+    send_to_server(ADMIN_ANNOUNCE,joined(param));
+}
+
+void trace_command(PARAMETERS param)
+{
+    send_to_server(ADMIN_TRACE,param.empty() ? "dump" : std::string(param[0]));
+}
+
+void send_datagram(DATAGRAM::EVENT type, const std::string& payload)
+{
+    if (INVALID_SOCKET == datagram_socket) return;
+    std::string packet;
+    {
+        std::lock_guard<std::mutex> guard(datagram_key_lock);
+        packet = DATAGRAM::encode(datagram_id,datagram_key,type,payload);
+    }
+    sendto(datagram_socket,packet.c_str(),packet.size(),0,reinterpret_cast<const sockaddr*>(&datagram_server),sizeof(datagram_server));
+}
+
+void typing_command(PARAMETERS param)
+{
+    if (INVALID_SOCKET == datagram_socket)
+    {
+        CLIENT_MESSAGE("The server has no datagram channel");
+        return;
+    }
+    send_datagram(DATAGRAM::TYPING,"");
+}
+
+void open_datagram_channel(const sockaddr_in& server_info, uint32_t id)
+{
+    {
+        std::lock_guard<std::mutex> guard(datagram_key_lock);
+        datagram_key = DATAGRAM::derive_key(session_token);
+    }
+    datagram_id = id;
+    if (INVALID_SOCKET == datagram_socket)
+    {
+        const SOCKET channel = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+        if (INVALID_SOCKET == channel)
+        {
+            LOG_WARNING("Failed To Create Datagram Socket | " << GET_LAST_ERROR);
+            return;
+        }
+        SET_NONBLOCKING(channel);
+        datagram_server = server_info;
+        datagram_socket = channel;
+    }
+    send_datagram(DATAGRAM::PRESENCE,""); // Lets the server learn where to send to
+}
+
+void handle_datagrams()
+{
+    std::vector<DATAGRAM::Datagram> incoming;
+    DATAGRAM::receive_batch(datagram_socket,incoming);
+    DATAGRAM::Key key;
+    {
+        std::lock_guard<std::mutex> guard(datagram_key_lock);
+        key = datagram_key;
+    }
+    for (const auto& datagram : incoming)
+    {
+        DATAGRAM::Event event;
+        if (!DATAGRAM::decode(datagram.bytes,key,event)) continue;
+        if (event.type == DATAGRAM::TYPING)
+            m_renderer.push("[TYPING] " + event.payload + " is typing...");
+    }
+}
+
+void batch_command(PARAMETERS param)
+{
+    if (param.empty())
+    {
+        CLIENT_MESSAGE("You need to provide at least one operation. See /help batch for more.");
+        return;
+    }
+    send_to_server(ADMIN_BATCH,joined(param));
+}
+
+void search_command(PARAMETERS param)
+{
+    if (param.empty())
+    {
+        CLIENT_MESSAGE("Search needs words, from:NAME or in:ROOM. See /help search for more.");
+        return;
+    }
+    send_to_server(SEARCH,joined(param));
+}
+
+void scrollback_command(PARAMETERS param)
+{
+    size_t count = DEFAULT_SCROLLBACK;
+    if (!param.empty())
+    {
+        try
+        {
+            count = std::stoul(std::string(param[0]));
+        } catch (const std::exception&)
+        {
+            CLIENT_MESSAGE(param[0] << " is not a number of lines");
+            return;
+        }
+    }
+    std::string lines;
+    for (const auto& line : m_renderer.scrollback(count))
+    {
+        lines += line;
+        lines += '\n';
+    }
+    std::cout << lines << std::flush;
+}
+
+void subscribe_command(PARAMETERS param)
+{
+    if (param.empty())
+    {
+        CLIENT_MESSAGE("Subscribe requires the name of the room. See /help for more commands.");
+        return;
+    }
+    send_to_server(SUBSCRIBE,std::string(param[0]));
+}
+
+void unsubscribe_command(PARAMETERS param)
+{
+    if (param.empty())
+    {
+        CLIENT_MESSAGE("Unsubscribe requires the name of the room. See /help for more commands.");
+        return;
+    }
+    send_to_server(UNSUBSCRIBE,std::string(param[0]));
+}
+
+void publish_command(PARAMETERS param)
+{
+    if (param.size() < 2)
+    {
+        CLIENT_MESSAGE("You need to provide a room and a message to publish");
+        return;
+    }
+    send_to_server(PUBLISH,joined(param));
+}
+
+bool readable_now(SOCKET socket)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(socket,&set);
+    timeval immediately{};
+    return select(static_cast<int>(socket) + 1,&set,nullptr,nullptr,&immediately) > 0;
+}
+
+// Connects and uploads the handshake, returns INVALID_SOCKET on failure
+SOCKET open_connection(const sockaddr_in& server_info, const std::string& handshake)
+{
+    const SOCKET connection = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    if (INVALID_SOCKET == connection)
+    {
+        LOG_ERROR("Failed To Create Socket");
+        return INVALID_SOCKET;
+    }
+
+    int result = connect(connection,reinterpret_cast<const sockaddr*>(&server_info),sizeof(server_info));
+    if (0 > result) // SOCKET_ERROR is -1 | Linux also returns -1
+    {
+        LOG_ERROR("Failed To Connect To Server");
+        CLOSE_SOCKET(connection);
+        return INVALID_SOCKET;
+    }
+
+    if (TLS::enabled())
+    {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET,&server_info.sin_addr,address,INET_ADDRSTRLEN);
+        if (!TLS::connect(connection,address))
+        {
+            CLOSE_SOCKET(connection);
+            return INVALID_SOCKET;
+        }
+    }
+
+    const std::string terminated = handshake + static_cast<char>(TAIL_CODE_END); // The server reads up to this
+    result = TLS::send(connection,terminated.c_str(),static_cast<int>(terminated.size()));
+    if (result < 0)
+    {
+        LOG_ERROR("Failure when sending Username to Server | " << GET_LAST_ERROR);
+        TLS::release(connection);
+        CLOSE_SOCKET(connection);
+        return INVALID_SOCKET;
+    }
+    return connection;
+}
+
+// Lines go out a batch at a time, each one chased by an ECHO with its number, and nothing waits on a reply
+void run_script(std::istream& input)
+{
+    while (is_running.load() && !admitted.load())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    batching = true;
+    std::string line;
+    uint64_t number = 0;
+    size_t batched = 0;
+    bool stalled = false;
+    const auto flush = [&] {
+        if (!outgoing.empty() && !PACMAN::send_encoded(main_socket,outgoing)) is_running.store(false);
+        outgoing.clear();
+        batched = 0;
+    };
+    while (is_running.load() && std::getline(input,line))
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        std::string_view kind = parse_input(line);
+        if (kind.empty())
+        {
+            send_to_server(MESSAGE,line);
+            kind = "message";
+        }
+        send_to_server(ECHO,std::to_string(++number));
+        m_script.sent(number,std::string(kind));
+
+        // A pipe that goes quiet still gets its lines out straight away
+        if (++batched < SCRIPT_BATCH_LINES && input.rdbuf()->in_avail() > 0) continue;
+        flush();
+        if (!m_script.wait_below(SCRIPT_WINDOW,std::chrono::steady_clock::now() + std::chrono::seconds(SCRIPT_DRAIN_SECONDS)))
+        {
+            CLIENT_MESSAGE("The server stopped answering, giving up on the script");
+            stalled = true;
+            break;
+        }
+    }
+    flush();
+    batching = false;
+    if (!is_running.load() || stalled) return; // Quit on its own or can't go on
+
+    m_script.wait_below(1,std::chrono::steady_clock::now() + std::chrono::seconds(SCRIPT_DRAIN_SECONDS));
+    PACMAN::send_message(main_socket,DISCONNECT,"A");
+    is_running.store(false);
+}
+
+// Picks the session back up, the server replays everything after messages_received
+bool reconnect(const sockaddr_in& server_info)
+{
+    if (session_token.empty()) return false;
+
+    std::chrono::milliseconds delay{500};
+    for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS && is_running.load(); ++attempt)
+    {
+        CLIENT_MESSAGE("Reconnecting | Attempt " << attempt << " Of " << RECONNECT_ATTEMPTS);
+        std::stringstream handshake;
+        handshake << username << static_cast<char>(FRAME_SIZE) << PACMAN::max_packet_size
+                  << static_cast<char>(SESSION_RESUME) << session_token << ' ' << messages_received;
+        const SOCKET connection = open_connection(server_info,handshake.str());
+        if (INVALID_SOCKET != connection)
+        {
+            const SOCKET previous = main_socket.exchange(connection);
+            PACMAN::forget(previous);
+            TLS::release(previous);
+            CLOSE_SOCKET(previous);
+            CLIENT_MESSAGE("Reconnected");
+            return true;
+        }
+        std::this_thread::sleep_for(delay);
+        delay *= 2;
+    }
+    return false;
 }
 
 int main(const int argc, char* argv[])
 {
+    // NETCLIENT USERNAME [PORT] [ADDRESS] [--tls [TRUSTED_CERTIFICATE]] [--login] [--script FILE] [--quiet]
+    // A script of - reads standard input, with --login the password is its first line
     is_running.store(true); // Store Atomic Boolean to sync input thread and main thread while loops
-    if (argc <= 1)
+    int positional = argc;
+    bool login = false;
+    std::string script;
+    bool quiet = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        if (argument == "--login")
+        {
+            positional = std::min(positional,i);
+            login = true;
+            continue;
+        }
+        if (argument == "--script" && i + 1 < argc)
+        {
+            positional = std::min(positional,i);
+            script = argv[++i];
+            continue;
+        }
+        if (argument == "--quiet")
+        {
+            positional = std::min(positional,i);
+            quiet = true;
+            continue;
+        }
+        if (argument != "--tls") continue;
+        positional = std::min(positional,i);
+        // Without a certificate the system's trust store is used, pass a self signed one for local servers
+        const bool certificate = i + 1 < argc && argv[i+1][0] != '-';
+        if (!TLS::init_client(certificate ? argv[++i] : "")) return EXIT_FAILURE;
+    }
+    if (positional <= 1)
     {
         LOG_ERROR("Must Provide a Username");
         return EXIT_FAILURE;
@@ -192,6 +553,14 @@ int main(const int argc, char* argv[])
                                              "Example:\n"
                                              "/auth victorwee"
                                      }));
+    m_commands.insert(std::make_pair("register",
+                                     CommandEntry{
+                                             register_command,
+                                             "/register [PASSWORD]\n"
+                                             "Claims your current username, connect with --login from then on\n"
+                                             "Example:\n"
+                                             "/register hunter22"
+                                     }));
     m_commands.insert(std::make_pair("friend",
                                      CommandEntry{
                                              friend_command,
@@ -240,6 +609,72 @@ int main(const int argc, char* argv[])
                                              "Example:\n"
                                              "/announce hi everybody"
                                      }));
+    m_commands.insert(std::make_pair("trace",
+                                     CommandEntry{
+                                             trace_command,
+                                             "/trace [EVERY]\n"
+                                             "Traces one request in EVERY on the server, 0 stops. Without a number the server\n"
+                                             "writes what it traced to a Chrome trace file. You must be an administator to do this action\n"
+                                             "Example:\n"
+                                             "/trace 100"
+                                     }));
+    m_commands.insert(std::make_pair("batch",
+                                     CommandEntry{
+                                             batch_command,
+                                             "/batch [OPERATION]; [OPERATION]...\n"
+                                             "Runs many administrator operations in one request. Operations are\n"
+                                             "auth CODE | kick USER... | move ROOM USER... | broadcast ROOM,ROOM MESSAGE | stats | filter\n"
+                                             "Example:\n"
+                                             "/batch auth secure_code; kick spammer1 spammer2; move HOMEROOM alice bob; broadcast HOMEROOM,lobby hi; stats"
+                                     }));
+    m_commands.insert(std::make_pair("typing",
+                                     CommandEntry{
+                                             typing_command,
+                                             "/typing\n"
+                                             "Lets your room know you are typing\n"
+                                             "Example:\n"
+                                             "/typing"
+                                     }));
+    m_commands.insert(std::make_pair("subscribe",
+                                     CommandEntry{
+                                             subscribe_command,
+                                             "/subscribe [ROOMNAME]\n"
+                                             "Receive messages from another room without leaving your own\n"
+                                             "Example:\n"
+                                             "/subscribe lobby"
+                                     }));
+    m_commands.insert(std::make_pair("unsubscribe",
+                                     CommandEntry{
+                                             unsubscribe_command,
+                                             "/unsubscribe [ROOMNAME]\n"
+                                             "Stop receiving messages from a room you subscribed to\n"
+                                             "Example:\n"
+                                             "/unsubscribe lobby"
+                                     }));
+    m_commands.insert(std::make_pair("search",
+                                     CommandEntry{
+                                             search_command,
+                                             "/search [WORDS] [from:USERNAME] [in:ROOMNAME]\n"
+                                             "Finds recent messages with all of the words, whispers only show up for the two people in them\n"
+                                             "Example:\n"
+                                             "/search release date from:alice in:lobby"
+                                     }));
+    m_commands.insert(std::make_pair("scrollback",
+                                     CommandEntry{
+                                             scrollback_command,
+                                             "/scrollback [LINES]\n"
+                                             "Shows the last messages again, including ones skipped while the screen couldn't keep up\n"
+                                             "Example:\n"
+                                             "/scrollback 100"
+                                     }));
+    m_commands.insert(std::make_pair("publish",
+                                     CommandEntry{
+                                             publish_command,
+                                             "/publish [ROOMNAME] [MESSAGE]\n"
+                                             "Sends a message to a room you are subscribed to\n"
+                                             "Example:\n"
+                                             "/publish lobby hello from the other room"
+                                     }));
 
     int result = 0;
     LOG_INFO("Starting Up Client");
@@ -247,7 +682,7 @@ int main(const int argc, char* argv[])
     
     int port = DEFAULT_PORT;
     const char* server_address = "127.0.0.1";
-    if (argc > 2)
+    if (positional > 2)
     {
         try
         {
@@ -265,19 +700,10 @@ int main(const int argc, char* argv[])
             WINSOCK_CLEANUP;
             return EXIT_FAILURE;
         }
-        if (argc > 3)
+        if (positional > 3)
             server_address = argv[3];
     }
 
-    main_socket = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-    if (0 > main_socket) // INVALID_SOCKET is ~0 which is apparently same as -1
-    {
-        LOG_ERROR("Failed To Create Socket");
-        WINSOCK_CLEANUP;
-        return EXIT_FAILURE;
-    }
-    LOG_INFO("Created Socket");
-
     sockaddr_in server_info{};
     server_info.sin_family = AF_INET;
     server_info.sin_port = htons(static_cast<uint16_t>(port));
@@ -285,61 +711,114 @@ int main(const int argc, char* argv[])
     if (!conversion_result)
     {
         LOG_ERROR("Bad IP Address Provided");
-        CLOSE_SOCKET(main_socket);
         WINSOCK_CLEANUP;
         return EXIT_FAILURE;
     }
 
-    result = connect(main_socket,reinterpret_cast<sockaddr*>(&server_info),sizeof(server_info));
-    if (0 > result) // SOCKET_ERROR is -1 | Linux also returns -1
+    std::ifstream script_file;
+    if (!script.empty() && script != "-")
     {
-        LOG_ERROR("Failed To Connect To Server");
-        WINSOCK_CLEANUP;
-        return EXIT_FAILURE;
+        script_file.open(script);
+        if (!script_file.is_open())
+        {
+            LOG_ERROR("Could not open script | " << script);
+            WINSOCK_CLEANUP;
+            return EXIT_FAILURE;
+        }
     }
-    CLIENT_MESSAGE("Connected To " << server_address);
+    if (script == "-") std::ios::sync_with_stdio(false); // Lets cin buffer so a batch can fill up
+
+    // Registered names need their password in the handshake
+    std::string handshake = username + static_cast<char>(FRAME_SIZE) + std::to_string(PACMAN::max_packet_size);
+    if (login)
+    {
+        std::string password;
+        std::cout << "Password for " << username << ": " << std::flush;
+        std::getline(std::cin,password);
+        handshake += static_cast<char>(LOGIN);
+        handshake += password;
+    }
+
     LOG_INFO("Uploading Username");
-    int username_send_result = send(main_socket,username.c_str(),username.size(),0);
-    if (username_send_result < 0)
+    main_socket = open_connection(server_info,handshake);
+    if (INVALID_SOCKET == main_socket)
     {
-        LOG_ERROR("Failure when sending Username to Server | " << GET_LAST_ERROR);
-        CLOSE_SOCKET(main_socket);
         WINSOCK_CLEANUP;
         return EXIT_FAILURE;
     }
+    CLIENT_MESSAGE("Connected To " << server_address);
+    if (!script.empty())
+    {
+        const int on = 1; // Batches are already whole writes, Nagle only holds the last one back
+        setsockopt(main_socket,IPPROTO_TCP,TCP_NODELAY,reinterpret_cast<const char*>(&on),sizeof(on));
+        PACMAN::size_buffers(main_socket,PACMAN::LINK::BULK);
+    }
+    m_renderer.start();
 
     std::thread input_thread(
         [&]
         {
+            if (!script.empty())
+            {
+                run_script(script_file.is_open() ? static_cast<std::istream&>(script_file) : std::cin);
+                return;
+            }
             while (is_running.load())
             {
                 std::string input;
                 std::getline(std::cin,input);
                 if (input.empty()) continue;
-                if (parse_input(input)) continue;
-                PACMAN::send_message(main_socket,MESSAGE,input);
+                if (!parse_input(input).empty()) continue;
+                PACMAN::send_message(main_socket,MESSAGE,input,frame_size);
             }
         });
 
     bool exit_code = EXIT_SUCCESS;
+    auto next_datagram_tick = std::chrono::steady_clock::now();
+    uint64_t last_receipt = 0;
     while (is_running.load())
     {
+        // Keep the datagram peer alive and tell the server what we have read
+        const auto now = std::chrono::steady_clock::now();
+        if (INVALID_SOCKET != datagram_socket && now >= next_datagram_tick)
+        {
+            send_datagram(DATAGRAM::PRESENCE,"");
+            if (messages_received != last_receipt)
+            {
+                send_datagram(DATAGRAM::READ_RECEIPT,DATAGRAM::pack_u64(messages_received));
+                last_receipt = messages_received;
+            }
+            next_datagram_tick = now + std::chrono::seconds(DATAGRAM_INTERVAL_SECONDS);
+        }
+
         // Initialize Network Variables
+        // A message already sitting in the buffer only needs a quick poll for datagrams
+        const bool buffered = PACMAN::has_buffered_message(main_socket);
         timeval timeout{};
-        timeout.tv_sec = 1;
+        timeout.tv_sec = buffered ? 0 : 1;
         timeout.tv_usec = 0;
         fd_set server_connection;
         FD_ZERO(&server_connection);
         FD_SET(main_socket,&server_connection);
+        SOCKET highest = main_socket;
+        if (INVALID_SOCKET != datagram_socket)
+        {
+            FD_SET(datagram_socket,&server_connection);
+            highest = std::max<SOCKET>(highest,datagram_socket);
+        }
 
-        const int select_result = select(0,&server_connection,nullptr,nullptr,&timeout);
+        const int select_result = select(static_cast<int>(highest) + 1,&server_connection,nullptr,nullptr,&timeout);
         if (0 > select_result)
         {
             LOG_ERROR("Failure with select() | ERRORCODE: " << GET_LAST_ERROR);
             exit_code = EXIT_FAILURE;
             goto EXIT_POINT;
         }
-        if (0 == select_result) continue; // Timeout
+        if (0 == select_result && !buffered) continue; // Timeout
+
+        if (INVALID_SOCKET != datagram_socket && FD_ISSET(datagram_socket,&server_connection))
+            handle_datagrams();
+        if (!buffered && !FD_ISSET(main_socket,&server_connection)) continue;
 
 //        char message_buffer[MESSAGE_BUFFER_LENGTH]{'\0'};
 //        const int receive_length = recv(main_socket,message_buffer,MESSAGE_BUFFER_LENGTH,0);
@@ -355,38 +834,72 @@ int main(const int argc, char* argv[])
 //            goto EXIT_POINT;
 //        }
 
-        std::string from_server;
-        const PACMAN::RECV_RETURN_CODE recv_result = PACMAN::receive_message(main_socket,from_server);
-
-        switch (recv_result)
+        // Everything that already arrived gets handled before going back to select()
+        for (size_t drained = 0; drained < DRAIN_LIMIT; ++drained)
         {
-            case PACMAN::RECV_RETURN_CODE::RECV_ERROR:
+            std::string from_server;
+            const PACMAN::RECV_RETURN_CODE recv_result = PACMAN::receive_message(main_socket,from_server);
+
+            switch (recv_result)
             {
-                LOG_WARNING("Server Connection Suddenly Terminated | ERROR: " << GET_LAST_ERROR);
-                goto EXIT_POINT;
+                case PACMAN::RECV_RETURN_CODE::RECV_ERROR:
+                {
+                    LOG_WARNING("Server Connection Suddenly Terminated | ERROR: " << GET_LAST_ERROR);
+                    if (!reconnect(server_info)) goto EXIT_POINT;
+                    break;
+                }
+                case PACMAN::RECV_RETURN_CODE::RECV_ZERO_LEN:
+                {
+                    SERVER_MESSAGE("Server has terminated the connection on their side");
+                    if (!is_running.load() || !reconnect(server_info)) is_running.store(false);
+                    break;
+                }
+                case PACMAN::RECV_RETURN_CODE::RECV_WOULD_BLOCK: // The socket is blocking, for completeness
+                case PACMAN::RECV_RETURN_CODE::RECV_GOOD:
+                    break;
             }
-            case PACMAN::RECV_RETURN_CODE::RECV_ZERO_LEN:
+            if (recv_result != PACMAN::RECV_RETURN_CODE::RECV_GOOD) break; // Back to select() with whatever socket we have now
+
+            if (from_server[0] == SESSION_TOKEN)
             {
-                SERVER_MESSAGE("Server has terminated the connection on their side");
-                is_running.store(false);
-                continue;
+                session_token = from_server.c_str()+2;
+                messages_received = 1; // The token is always the first message of a session
+                admitted.store(true);
+            }
+            else
+            {
+                ++messages_received;
+                if (from_server[0] == DATAGRAM_SESSION)
+                    open_datagram_channel(server_info,static_cast<uint32_t>(std::stoul(from_server.c_str()+2)));
+                else if (from_server[0] == FRAME_SIZE)
+                    frame_size = PACMAN::negotiate_frame(std::strtoul(from_server.c_str()+2,nullptr,10));
+                else if (from_server[0] == ECHO)
+                    m_script.echoed(std::strtoull(from_server.c_str()+2,nullptr,10));
+                else
+                {
+                    if (!script.empty()) m_script.replied();
+                    if (!quiet) m_renderer.push(from_server.c_str()+1);
+                }
             }
-            case PACMAN::RECV_RETURN_CODE::RECV_GOOD:
-                break;
-        }
 
-        std::cout << from_server.c_str()+1 << std::endl;
+            if (!PACMAN::has_buffered_message(main_socket) && !readable_now(main_socket)) break;
+        }
     }
 
 EXIT_POINT:
+    m_renderer.stop();
     // Interrupt Thread and Join
     LOG_INFO("Waiting To Join Input Thread");
     is_running.store(false);
     std::cin.putback('\r');
     input_thread.join();
 
+    if (!script.empty()) m_script.report(std::cout);
     LOG_INFO("Client Closing");
+    TLS::release(main_socket);
     CLOSE_SOCKET(main_socket);
+    if (INVALID_SOCKET != datagram_socket)
+        CLOSE_SOCKET(datagram_socket);
     WINSOCK_CLEANUP;
     return exit_code;
 }
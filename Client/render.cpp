@@ -0,0 +1,78 @@
+#include "render.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+void Renderer::start()
+{
+    thread = std::thread([this] { run(); });
+}
+
+void Renderer::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!thread.joinable()) return;
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void Renderer::push(std::string line)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    history.push_back(line);
+    if (history.size() > SCROLLBACK_LINES) history.pop_front();
+    if (pending.size() == RENDER_MAX_LINES)
+    {
+        pending.pop_front();
+        ++skipped;
+    }
+    pending.push_back(std::move(line));
+}
+
+std::vector<std::string> Renderer::scrollback(size_t count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    count = std::min(count,history.size());
+    return std::vector<std::string>(history.end() - static_cast<std::ptrdiff_t>(count),history.end());
+}
+
+void Renderer::run()
+{
+    std::deque<std::string> batch;
+    for (;;)
+    {
+        bool last;
+        size_t missed;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait_for(guard,std::chrono::milliseconds(RENDER_INTERVAL_MS),[this] { return stopping; });
+            batch.swap(pending);
+            missed = skipped;
+            skipped = 0;
+            last = stopping;
+        }
+        // While this is stuck on a slow terminal the next frame piles up, capped, in pending
+        if (!batch.empty()) draw(batch,missed);
+        batch.clear();
+        if (last) return;
+    }
+}
+
+// One write and one flush for the whole frame
+void Renderer::draw(const std::deque<std::string>& batch, size_t skipped)
+{
+    std::string frame;
+    if (skipped)
+        frame += "[CLIENT] " + std::to_string(skipped) + " messages skipped, /scrollback shows them\n";
+    for (const auto& line : batch)
+    {
+        frame += line;
+        frame += '\n';
+    }
+    std::cout.write(frame.data(),static_cast<std::streamsize>(frame.size()));
+    std::cout.flush();
+}
@@ -0,0 +1,44 @@
+#ifndef NETWORK_RENDER_HPP
+#define NETWORK_RENDER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstddef>
+
+#define RENDER_INTERVAL_MS 33 // About 30 frames a second, nobody reads faster than that
+#define RENDER_MAX_LINES 200 // Per frame, more than this means the terminal is behind and the oldest get summarised
+#define SCROLLBACK_LINES 2000
+
+/*
+ * Incoming messages are queued here and written by their own thread once per frame
+ * The receive loop never waits on the console so the socket stays drained however slow the terminal is
+ * Everything lands in the scrollback, including whatever got skipped on screen
+ */
+
+struct Renderer
+{
+    ~Renderer() { stop(); }
+
+    void start();
+    void stop(); // Writes whatever is still pending first
+    void push(std::string line);
+    std::vector<std::string> scrollback(size_t count);
+
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::string> pending;
+    size_t skipped = 0; // Pushed out of pending before they could be drawn
+    std::deque<std::string> history;
+    std::thread thread;
+    bool stopping = false;
+
+    void run();
+    static void draw(const std::deque<std::string>& batch, size_t skipped);
+};
+
+#endif //NETWORK_RENDER_HPP
@@ -0,0 +1,69 @@
+#include "script.hpp"
+
+#include <algorithm>
+#include <iomanip>
+
+static double percentile(const std::vector<double>& sorted, double fraction)
+{
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1,static_cast<size_t>(fraction * static_cast<double>(sorted.size())))];
+}
+
+void ScriptStats::sent(uint64_t line, std::string kind)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!m_sent++) m_started = now;
+    m_pending.emplace(line,Pending{std::move(kind),now});
+}
+
+void ScriptStats::echoed(uint64_t line)
+{
+    const auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        const auto found = m_pending.find(line);
+        if (found == m_pending.end()) return;
+        m_latencies[found->second.kind].push_back(std::chrono::duration<double,std::micro>(now - found->second.at).count());
+        m_pending.erase(found);
+        m_finished = now;
+    }
+    m_progress.notify_all();
+}
+
+void ScriptStats::replied()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    ++m_replies;
+}
+
+bool ScriptStats::wait_below(size_t outstanding, std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    return m_progress.wait_until(guard,deadline,[this,outstanding] { return m_pending.size() < outstanding; });
+}
+
+void ScriptStats::report(std::ostream& output)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(m_lock);
+    // No echo ever came back, the run lasted until now, and nothing sent means it never started
+    const auto finished = m_finished != std::chrono::steady_clock::time_point{} ? m_finished : m_sent ? now : m_started;
+    const double seconds = std::chrono::duration<double>(finished - m_started).count();
+    size_t answered = 0;
+    for (const auto& kind : m_latencies)
+        answered += kind.second.size();
+
+    output << "[SCRIPT] Lines " << m_sent << " | Answered " << answered << " | Lost " << m_pending.size()
+           << " | Replies " << m_replies << " | " << std::fixed << std::setprecision(2) << seconds << "s | "
+           << (seconds > 0 ? static_cast<double>(answered) / seconds : 0) << " lines/s" << std::endl;
+    for (auto& kind : m_latencies)
+    {
+        std::sort(kind.second.begin(),kind.second.end());
+        output << "[SCRIPT] " << std::left << std::setw(12) << kind.first << std::right
+               << " Count " << kind.second.size()
+               << " | p50 " << percentile(kind.second,0.5) << "us"
+               << " | p99 " << percentile(kind.second,0.99) << "us"
+               << " | max " << kind.second.back() << "us" << std::endl;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef NETWORK_SCRIPT_HPP
+#define NETWORK_SCRIPT_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+#define SCRIPT_WINDOW 1024 // Lines the server hasn't echoed yet before the script waits for it to catch up
+#define SCRIPT_BATCH_LINES 64 // Lines sent together in one write
+#define SCRIPT_DRAIN_SECONDS 10 // After the last line, how long echoes get to come back
+
+/*
+ * Headless runs, a script or a pipe of the same lines someone would type
+ * Every line goes out followed by an ECHO carrying its number without waiting on the one before it
+ * The server answers in the order it dispatched them, so the echo coming back closes out that line
+ * and whatever arrived in between is counted as its replies
+ */
+
+struct ScriptStats
+{
+    void sent(uint64_t line, std::string kind); // Sending thread
+    void echoed(uint64_t line); // Receiving thread
+    void replied();
+    // Blocks while too many lines are out, false once the deadline passes
+    bool wait_below(size_t outstanding, std::chrono::steady_clock::time_point deadline);
+    void report(std::ostream& output);
+
+private:
+    struct Pending
+    {
+        std::string kind;
+        std::chrono::steady_clock::time_point at;
+    };
+
+    std::mutex m_lock;
+    std::condition_variable m_progress;
+    std::map<uint64_t,Pending> m_pending;
+    std::map<std::string,std::vector<double>> m_latencies; // Microseconds, by command
+    size_t m_replies = 0;
+    size_t m_sent = 0;
+    std::chrono::steady_clock::time_point m_started{};
+    std::chrono::steady_clock::time_point m_finished{};
+};
+
+#endif //NETWORK_SCRIPT_HPP
@@ -0,0 +1,369 @@
+#include "accounts.hpp"
+#include "logging.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#endif
+
+static const char m_account_magic[8] = {'N','E','T','A','C','C','T','1'};
+static constexpr uint32_t m_account_version = 1;
+
+static size_t file_size(uint64_t capacity)
+{
+    return sizeof(AccountHeader) + static_cast<size_t>(capacity) * sizeof(AccountRecord);
+}
+
+// FNV-1a, names are short and the table only needs a spread
+static uint64_t name_hash(const std::string& name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : name)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#ifdef _WIN32
+
+bool AccountFile::map(const std::string& path, uint64_t capacity, bool create)
+{
+    file = CreateFileA(path.c_str(),GENERIC_READ | GENERIC_WRITE,0,nullptr,create ? CREATE_ALWAYS : OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    if (create) size = file_size(capacity);
+    else
+    {
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file,&length)) { unmap(); return false; }
+        size = static_cast<size_t>(length.QuadPart);
+    }
+    if (size < sizeof(AccountHeader)) { unmap(); return false; }
+
+    mapping = CreateFileMappingA(file,nullptr,PAGE_READWRITE,static_cast<DWORD>(uint64_t(size) >> 32),static_cast<DWORD>(size),nullptr);
+    if (!mapping) { unmap(); return false; }
+    void* base = MapViewOfFile(mapping,FILE_MAP_ALL_ACCESS,0,0,size);
+    if (!base) { unmap(); return false; }
+    header = static_cast<AccountHeader*>(base);
+    records = reinterpret_cast<AccountRecord*>(header + 1);
+    return true;
+}
+
+void AccountFile::unmap()
+{
+    if (header) UnmapViewOfFile(header);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    header = nullptr;
+    records = nullptr;
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+    size = 0;
+}
+
+void AccountFile::sync(const void* at, size_t length) const
+{
+    FlushViewOfFile(at,length);
+}
+
+#else
+
+bool AccountFile::map(const std::string& path, uint64_t capacity, bool create)
+{
+    file = ::open(path.c_str(),O_RDWR | (create ? O_CREAT | O_TRUNC : 0),0600);
+    if (file < 0) return false;
+    if (create)
+    {
+        size = file_size(capacity);
+        if (ftruncate(file,static_cast<off_t>(size)) != 0) { unmap(); return false; }
+    }
+    else
+    {
+        struct stat status{};
+        if (fstat(file,&status) != 0) { unmap(); return false; }
+        size = static_cast<size_t>(status.st_size);
+    }
+    if (size < sizeof(AccountHeader)) { unmap(); return false; }
+
+    void* base = mmap(nullptr,size,PROT_READ | PROT_WRITE,MAP_SHARED,file,0);
+    if (base == MAP_FAILED) { unmap(); return false; }
+    header = static_cast<AccountHeader*>(base);
+    records = reinterpret_cast<AccountRecord*>(header + 1);
+    return true;
+}
+
+void AccountFile::unmap()
+{
+    if (header) munmap(header,size);
+    if (file >= 0) ::close(file);
+    header = nullptr;
+    records = nullptr;
+    file = -1;
+    size = 0;
+}
+
+// Only the pages that changed, a full msync on every registration would be wasted work
+void AccountFile::sync(const void* at, size_t length) const
+{
+    static const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(at) & ~(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(at) + length;
+    msync(reinterpret_cast<void*>(start),end - start,MS_SYNC);
+}
+
+#endif
+
+// Holds the lock file for one call, the store might have grown in another process since the last one
+struct AccountStore::ShareGuard
+{
+    AccountStore& store;
+
+    ShareGuard(const AccountStore& owner, bool exclusive) : store(const_cast<AccountStore&>(owner))
+    {
+        if (store.m_share < 0) return;
+        store.m_turn.lock();
+#ifndef _WIN32
+        flock(store.m_share,exclusive ? LOCK_EX : LOCK_SH);
+#endif
+        store.follow();
+    }
+
+    ~ShareGuard()
+    {
+        if (store.m_share < 0) return;
+#ifndef _WIN32
+        flock(store.m_share,LOCK_UN);
+#endif
+        store.m_turn.unlock();
+    }
+};
+
+AccountStore::~AccountStore()
+{
+    m_file.unmap();
+#ifndef _WIN32
+    if (m_share >= 0) ::close(m_share);
+#endif
+}
+
+bool AccountStore::open(const std::string& path)
+{
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_path = path;
+
+    std::error_code error;
+    const bool existing = std::filesystem::exists(path,error);
+    if (!m_file.map(path,ACCOUNT_INITIAL_CAPACITY,!existing))
+    {
+        LOG_ERROR("Could not map account file | " << path);
+        return false;
+    }
+
+    AccountHeader& header = *m_file.header;
+    if (!existing)
+    {
+        std::memcpy(header.magic,m_account_magic,sizeof(m_account_magic));
+        header.version = m_account_version;
+        header.record_size = sizeof(AccountRecord);
+        header.capacity = ACCOUNT_INITIAL_CAPACITY;
+        header.count = 0;
+        m_file.sync(m_file.header,m_file.size);
+    }
+    else if (std::memcmp(header.magic,m_account_magic,sizeof(m_account_magic)) != 0 ||
+             header.version != m_account_version ||
+             header.record_size != sizeof(AccountRecord) ||
+             header.capacity == 0 ||
+             m_file.size < file_size(header.capacity))
+    {
+        LOG_ERROR("Not an account file, or one from another version | " << path);
+        m_file.unmap();
+        return false;
+    }
+
+    // Cache entries only mean something to this process
+    std::random_device device;
+    m_cache_key.resize(32);
+    for (char& c : m_cache_key)
+        c = static_cast<char>(device());
+    return true;
+}
+
+bool AccountStore::share()
+{
+#ifdef _WIN32
+    LOG_ERROR("Account files can't be shared between processes on Windows");
+    return false;
+#else
+    // Opened per process, flock() locks belong to the open file and a forked copy would share them
+    m_share = ::open((m_path + ".lock").c_str(),O_RDWR | O_CREAT,0600);
+    if (m_share < 0)
+    {
+        LOG_ERROR("Could not open the account lock file | " << m_path << ".lock");
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Growing renames a new file over the old one, a process still mapping the old one moves over
+void AccountStore::follow()
+{
+#ifndef _WIN32
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    struct stat on_disk{};
+    struct stat mapped{};
+    if (!enabled() || ::stat(m_path.c_str(),&on_disk) != 0 || fstat(m_file.file,&mapped) != 0) return;
+    if (on_disk.st_ino == mapped.st_ino && on_disk.st_dev == mapped.st_dev) return;
+    m_file.unmap();
+    if (!m_file.map(m_path,0,false)) LOG_ERROR("Lost the account file another worker grew | " << m_path);
+#endif
+}
+
+size_t AccountStore::size() const
+{
+    const ShareGuard shared(*this,false);
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    return enabled() ? static_cast<size_t>(m_file.header->count) : 0;
+}
+
+// The record holding name, or the empty slot it would go in
+AccountRecord* AccountStore::probe(const AccountFile& file, const std::string& name) const
+{
+    const uint64_t capacity = file.header->capacity;
+    for (uint64_t i = name_hash(name) % capacity;; i = (i + 1) % capacity)
+    {
+        AccountRecord& record = file.records[i];
+        if (!record.used) return &record;
+        if (record.name_length == name.size() && std::memcmp(record.name,name.data(),name.size()) == 0) return &record;
+    }
+}
+
+bool AccountStore::exists(const std::string& name) const
+{
+    const ShareGuard shared(*this,false);
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    return enabled() && name.size() < ACCOUNT_NAME_SIZE && probe(m_file,name)->used;
+}
+
+// Rebuilt into a new file twice the size which then replaces the old one
+bool AccountStore::grow()
+{
+    const std::string temporary = m_path + ".grow";
+    AccountFile bigger;
+    const uint64_t capacity = m_file.header->capacity * 2;
+    if (!bigger.map(temporary,capacity,true)) return false;
+
+    *bigger.header = *m_file.header;
+    bigger.header->capacity = capacity;
+    for (uint64_t i = 0; i < m_file.header->capacity; ++i)
+    {
+        const AccountRecord& record = m_file.records[i];
+        if (!record.used) continue;
+        *probe(bigger,std::string(record.name,record.name_length)) = record;
+    }
+    bigger.sync(bigger.header,bigger.size);
+    bigger.unmap();
+    m_file.unmap();
+
+    std::error_code error;
+    std::filesystem::rename(temporary,m_path,error);
+    if (error) LOG_ERROR("Could not replace the account file | " << error.message());
+    if (!m_file.map(m_path,0,false))
+    {
+        LOG_ERROR("Lost the account file while growing it | " << m_path);
+        return false;
+    }
+    LOG_INFO("Account file grew to " << m_file.header->capacity << " records");
+    return !error;
+}
+
+bool AccountStore::create(const std::string& name, const std::string& password, ROLE role)
+{
+    if (name.empty() || name.size() >= ACCOUNT_NAME_SIZE || exists(name)) return false;
+
+    AccountRecord record{};
+    record.used = 1;
+    record.role = role;
+    record.name_length = static_cast<uint8_t>(name.size());
+    record.iterations = ACCOUNT_PBKDF2_ITERATIONS;
+    std::memcpy(record.name,name.data(),name.size());
+    std::random_device device;
+    for (uint8_t& byte : record.salt)
+        byte = static_cast<uint8_t>(device());
+    const HASH::Digest hash = HASH::pbkdf2_sha256(password,record.salt,sizeof(record.salt),record.iterations);
+    std::memcpy(record.hash,hash.data(),hash.size());
+
+    const ShareGuard shared(*this,true);
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    if (!enabled()) return false;
+    if (double(m_file.header->count + 1) > double(m_file.header->capacity) * ACCOUNT_MAX_LOAD && !grow()) return false;
+    AccountRecord* slot = probe(m_file,name);
+    if (slot->used) return false; // Somebody else got there while we were hashing
+    *slot = record;
+    ++m_file.header->count;
+    m_file.sync(slot,sizeof(AccountRecord));
+    m_file.sync(m_file.header,sizeof(AccountHeader));
+    return true;
+}
+
+HASH::Digest AccountStore::remember(const AccountRecord& record, const std::string& password) const
+{
+    // The stored hash is part of it, a new password makes the old entry worthless on its own
+    std::string material(reinterpret_cast<const char*>(record.hash),sizeof(record.hash));
+    material += password;
+    return HASH::hmac_sha256(m_cache_key,material.data(),material.size());
+}
+
+bool AccountStore::verify(const std::string& name, const std::string& password, ROLE& role)
+{
+    AccountRecord record;
+    {
+        const ShareGuard shared(*this,false);
+        std::shared_lock<std::shared_mutex> guard(m_lock);
+        if (!enabled() || name.size() >= ACCOUNT_NAME_SIZE) return false;
+        const AccountRecord* found = probe(m_file,name);
+        if (!found->used) return false;
+        record = *found; // Hash without holding up writers
+    }
+
+    const HASH::Digest quick = remember(record,password);
+    {
+        std::lock_guard<std::mutex> guard(m_cache_lock);
+        const auto cached = m_verified.find(name);
+        if (cached != m_verified.end() && HASH::equal(cached->second.data(),quick.data(),quick.size()))
+        {
+            role = record.role;
+            return true;
+        }
+    }
+
+    const HASH::Digest derived = HASH::pbkdf2_sha256(password,record.salt,sizeof(record.salt),record.iterations);
+    if (!HASH::equal(derived.data(),record.hash,sizeof(record.hash))) return false;
+
+    {
+        std::lock_guard<std::mutex> guard(m_cache_lock);
+        if (m_verified.size() >= ACCOUNT_CACHE_ENTRIES) m_verified.clear();
+        m_verified[name] = quick;
+    }
+    role = record.role;
+    return true;
+}
+
+bool AccountStore::set_role(const std::string& name, ROLE role)
+{
+    const ShareGuard shared(*this,true);
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    if (!enabled() || name.size() >= ACCOUNT_NAME_SIZE) return false;
+    AccountRecord* record = probe(m_file,name);
+    if (!record->used) return false;
+    record->role = role;
+    m_file.sync(record,sizeof(AccountRecord));
+    return true;
+}
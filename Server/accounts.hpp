@@ -0,0 +1,117 @@
+#ifndef NETWORK_ACCOUNTS_HPP
+#define NETWORK_ACCOUNTS_HPP
+
+#include "os_diff.hpp"
+#include "hash.hpp"
+
+#include <string>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#define ACCOUNT_NAME_SIZE 48 // Longest name is one less, the rest is the terminator
+#define ACCOUNT_MIN_PASSWORD 6
+#define ACCOUNT_MAX_PASSWORD 128 // Has to fit in the login handshake next to the name
+#define ACCOUNT_SALT_SIZE 16
+#define ACCOUNT_PBKDF2_ITERATIONS 100000
+#define ACCOUNT_INITIAL_CAPACITY 1024
+#define ACCOUNT_MAX_LOAD 0.7
+#define ACCOUNT_CACHE_ENTRIES 65536 // Verified logins kept in memory, cleared wholesale when full
+
+/*
+ * Registered users live in one memory mapped file
+ * A header, then a fixed size open addressing table of records probed linearly
+ * Salted PBKDF2 hashes are slow on purpose, verify() and create() belong on a worker thread
+ */
+
+enum class ROLE : uint8_t
+{
+    GUEST, // Not registered, gone when they disconnect
+    USER,
+    ADMIN
+};
+
+struct AccountHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+struct AccountRecord
+{
+    uint8_t used;
+    ROLE role;
+    uint8_t name_length;
+    uint8_t reserved;
+    uint32_t iterations; // Kept per record so raising the default doesn't lock anybody out
+    char name[ACCOUNT_NAME_SIZE];
+    uint8_t salt[ACCOUNT_SALT_SIZE];
+    uint8_t hash[32];
+};
+
+static_assert(sizeof(AccountHeader) == 32,"Account file layout changed");
+static_assert(sizeof(AccountRecord) == 104,"Account file layout changed");
+
+// One mapped account file
+struct AccountFile
+{
+    AccountHeader* header = nullptr;
+    AccountRecord* records = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int file = -1;
+#endif
+
+    bool map(const std::string& path, uint64_t capacity, bool create);
+    void unmap();
+    void sync(const void* at, size_t length) const;
+};
+
+struct AccountStore
+{
+    AccountStore() = default;
+    AccountStore(const AccountStore&) = delete;
+    AccountStore& operator=(const AccountStore&) = delete;
+    ~AccountStore();
+
+    bool open(const std::string& path);
+    bool share(); // Other processes write the same file, every call takes a turn on a lock file next to it
+    bool enabled() const { return m_file.header != nullptr; }
+    size_t size() const;
+
+    bool exists(const std::string& name) const;
+    bool create(const std::string& name, const std::string& password, ROLE role); // False when taken or the name doesn't fit
+    bool verify(const std::string& name, const std::string& password, ROLE& role);
+    bool set_role(const std::string& name, ROLE role);
+
+private:
+    std::string m_path;
+    AccountFile m_file;
+    mutable std::shared_mutex m_lock;
+
+    // Only set once shared, one thread per process holds the lock file at a time
+    struct ShareGuard;
+    mutable std::mutex m_turn;
+    int m_share = -1;
+
+    // Reconnect storms log the same people in again and again, a success is remembered
+    // as a keyed digest so the next login costs one HMAC instead of the whole PBKDF2
+    std::mutex m_cache_lock;
+    std::unordered_map<std::string,HASH::Digest> m_verified;
+    std::string m_cache_key;
+
+    AccountRecord* probe(const AccountFile& file, const std::string& name) const;
+    void follow();
+    bool grow();
+    HASH::Digest remember(const AccountRecord& record, const std::string& password) const;
+};
+
+#endif //NETWORK_ACCOUNTS_HPP
@@ -0,0 +1,88 @@
+#ifndef NETWORK_ADMIN_BATCH_HPP
+#define NETWORK_ADMIN_BATCH_HPP
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+/*
+ * ADMIN_BATCH payload
+ * Operations are separated by ';' and arguments by spaces
+ *
+ * auth CODE                        | Authenticate inside the batch, must come first
+ * kick USER [USER...]              | Disconnect users
+ * move ROOM USER [USER...]         | Move users into a room
+ * broadcast ROOM[,ROOM...] MESSAGE | Announce to a set of rooms
+ * stats                            | Dump server statistics
+ * filter                           | Reload the content filter's word list
+ */
+
+enum class ADMIN_OP
+{
+    AUTH,
+    KICK,
+    MOVE,
+    BROADCAST,
+    STATS,
+    FILTER,
+    UNKNOWN
+};
+
+struct AdminOp
+{
+    ADMIN_OP type;
+    std::string verb;
+    std::vector<std::string> args;
+    std::string text; // Everything after the target list for broadcast
+};
+
+inline std::vector<std::string> split_on(const std::string& input, char delim)
+{
+    std::vector<std::string> output;
+    std::stringstream stream(input);
+    std::string piece;
+    while (std::getline(stream,piece,delim))
+    {
+        if (piece.empty()) continue;
+        output.emplace_back(piece);
+    }
+    return output;
+}
+
+inline ADMIN_OP admin_op_from(const std::string& verb)
+{
+    if (verb == "auth") return ADMIN_OP::AUTH;
+    if (verb == "kick") return ADMIN_OP::KICK;
+    if (verb == "move") return ADMIN_OP::MOVE;
+    if (verb == "broadcast") return ADMIN_OP::BROADCAST;
+    if (verb == "stats") return ADMIN_OP::STATS;
+    if (verb == "filter") return ADMIN_OP::FILTER;
+    return ADMIN_OP::UNKNOWN;
+}
+
+inline std::vector<AdminOp> parse_admin_batch(const std::string& payload)
+{
+    std::vector<AdminOp> ops;
+    for (const auto& statement : split_on(payload,';'))
+    {
+        std::vector<std::string> words = split_on(statement,' ');
+        if (words.empty()) continue;
+
+        AdminOp op{admin_op_from(words[0]),words[0],{},{}};
+        if (op.type == ADMIN_OP::BROADCAST)
+        {
+            if (words.size() > 1)
+                op.args = split_on(words[1],',');
+            std::stringstream text;
+            for (size_t i = 2; i < words.size(); ++i)
+                text << (i > 2 ? " " : "") << words[i];
+            op.text = text.str();
+        }
+        else
+            op.args.assign(words.begin() + 1, words.end());
+        ops.emplace_back(std::move(op));
+    }
+    return ops;
+}
+
+#endif //NETWORK_ADMIN_BATCH_HPP
@@ -0,0 +1,586 @@
+#include "cluster.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+static void put_u32(std::string& out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+static uint32_t get_u32(const std::string& in, size_t at)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(in[at + i])) << (8 * i);
+    return value;
+}
+
+static void put_string(std::string& out, const std::string& value)
+{
+    put_u32(out,static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+static bool get_string(const std::string& in, size_t& at, size_t end, std::string& value)
+{
+    if (end - at < 4) return false;
+    const uint32_t length = get_u32(in,at);
+    at += 4;
+    if (end - at < length) return false;
+    value.assign(in,at,length);
+    at += length;
+    return true;
+}
+
+std::string encode_bus(const BusMessage& message)
+{
+    std::string body;
+    body.reserve(7 + 12 + message.key.size() + message.origin.size() + message.frames.size());
+    body.push_back(static_cast<char>(message.type));
+    put_u32(body,message.node);
+    body.push_back(static_cast<char>(message.hops));
+    body.push_back(static_cast<char>(message.on));
+    put_string(body,message.key);
+    put_string(body,message.origin);
+    put_string(body,message.frames);
+
+    std::string out;
+    out.reserve(4 + body.size());
+    put_u32(out,static_cast<uint32_t>(body.size()));
+    out += body;
+    return out;
+}
+
+bool decode_bus(std::string& buffer, std::vector<BusMessage>& messages)
+{
+    size_t position = 0;
+    while (buffer.size() - position >= 4)
+    {
+        const uint32_t length = get_u32(buffer,position);
+        if (length > CLUSTER_MAX_BACKLOG) return false;
+        if (buffer.size() - position - 4 < length) break; // Rest hasn't arrived yet
+
+        size_t at = position + 4;
+        const size_t end = at + length;
+        if (length < 7) return false;
+        BusMessage message;
+        message.type = static_cast<BUS_CODE>(buffer[at]);
+        message.node = get_u32(buffer,at + 1);
+        message.hops = static_cast<uint8_t>(buffer[at + 5]);
+        message.on = buffer[at + 6] != 0;
+        at += 7;
+        if (!get_string(buffer,at,end,message.key) ||
+            !get_string(buffer,at,end,message.origin) ||
+            !get_string(buffer,at,end,message.frames))
+            return false;
+        messages.push_back(std::move(message));
+        position = end;
+    }
+    buffer.erase(0,position);
+    return true;
+}
+
+// FNV-1a with a finalizer, plain FNV clumps on keys that only differ at the end
+static uint64_t ring_hash(const std::string& key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : key)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void HashRing::add(uint32_t node)
+{
+    if (contains(node)) return;
+    for (int i = 0; i < CLUSTER_VIRTUAL_NODES; ++i)
+        points.emplace_back(ring_hash(std::to_string(node) + '#' + std::to_string(i)),node);
+    std::sort(points.begin(),points.end());
+}
+
+void HashRing::remove(uint32_t node)
+{
+    points.erase(std::remove_if(points.begin(),points.end(),
+                                [node](const std::pair<uint64_t,uint32_t>& point) { return point.second == node; }),
+                 points.end());
+}
+
+bool HashRing::contains(uint32_t node) const
+{
+    return std::any_of(points.begin(),points.end(),
+                       [node](const std::pair<uint64_t,uint32_t>& point) { return point.second == node; });
+}
+
+uint32_t HashRing::owner(const std::string& key) const
+{
+    const uint64_t hash = ring_hash(key);
+    auto found = std::lower_bound(points.begin(),points.end(),std::make_pair(hash,static_cast<uint32_t>(0)));
+    if (found == points.end()) found = points.begin(); // Wrap around
+    return found->second;
+}
+
+bool ClusterNode::open(uint32_t id, int port)
+{
+    listener = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+    if (INVALID_SOCKET == listener)
+    {
+        LOG_ERROR("Failed To Create Cluster Socket");
+        return false;
+    }
+    // Nodes restart often, don't wait out TIME_WAIT on the bus port
+    const int reuse = 1;
+    setsockopt(listener,SOL_SOCKET,SO_REUSEADDR,reinterpret_cast<const char*>(&reuse),sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (0 > bind(listener,reinterpret_cast<sockaddr*>(&address),sizeof(address)) || 0 > ::listen(listener,16))
+    {
+        LOG_ERROR("Failed To Open Cluster Port " << port << " | " << GET_LAST_ERROR);
+        CLOSE_SOCKET(listener);
+        listener = INVALID_SOCKET;
+        return false;
+    }
+    SET_NONBLOCKING(listener);
+    self = id;
+    ring.add(self);
+    return true;
+}
+
+void ClusterNode::add_peer(uint32_t id, const sockaddr_in& address)
+{
+    peers[id].address = address;
+}
+
+void ClusterNode::shutdown()
+{
+    for (auto& peer : peers)
+        if (INVALID_SOCKET != peer.second.socket) CLOSE_SOCKET(peer.second.socket);
+    for (const auto& link : links)
+        CLOSE_SOCKET(link.socket);
+    peers.clear();
+    links.clear();
+    if (INVALID_SOCKET != listener) CLOSE_SOCKET(listener);
+    listener = INVALID_SOCKET;
+}
+
+// Outbound links are opened without blocking the chat, a dead peer just keeps getting retried
+void ClusterNode::tick(std::chrono::steady_clock::time_point time)
+{
+    now = time;
+    for (auto& p : peers)
+    {
+        ClusterPeer& peer = p.second;
+        if (peer.up) continue;
+        if (!peer.connecting)
+        {
+            if (now < peer.retry_at) continue;
+            peer.socket = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+            if (INVALID_SOCKET == peer.socket) continue;
+            if (!SOCKET_SELECTABLE(peer.socket))
+            {
+                take_down(p.first,peer);
+                continue;
+            }
+            PACMAN::size_buffers(peer.socket,PACMAN::LINK::PEER); // Before connect() so the window scale allows for it
+            SET_NONBLOCKING(peer.socket);
+            if (0 == connect(peer.socket,reinterpret_cast<const sockaddr*>(&peer.address),sizeof(peer.address)))
+            {
+                bring_up(p.first,peer);
+                continue;
+            }
+            if (!SOCKET_WOULD_BLOCK)
+            {
+                take_down(p.first,peer);
+                continue;
+            }
+            peer.connecting = true;
+        }
+
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(peer.socket,&writable);
+        timeval immediate{};
+        if (select(static_cast<int>(peer.socket) + 1,nullptr,&writable,nullptr,&immediate) <= 0) continue;
+        int error = 0;
+        sockaddr_length length = sizeof(error);
+        getsockopt(peer.socket,SOL_SOCKET,SO_ERROR,reinterpret_cast<char*>(&error),&length);
+        if (error) take_down(p.first,peer);
+        else bring_up(p.first,peer);
+    }
+}
+
+void ClusterNode::fill(fd_set& set, SOCKET& highest) const
+{
+    if (!enabled()) return;
+    FD_SET(listener,&set);
+    highest = std::max(highest,listener);
+    for (const auto& link : links)
+    {
+        FD_SET(link.socket,&set);
+        highest = std::max(highest,link.socket);
+    }
+    // Only there so we notice the peer hanging up
+    for (const auto& peer : peers)
+    {
+        if (!peer.second.up) continue;
+        FD_SET(peer.second.socket,&set);
+        highest = std::max(highest,peer.second.socket);
+    }
+}
+
+void ClusterNode::service(const fd_set& set)
+{
+    if (!enabled()) return;
+    if (FD_ISSET(listener,&set))
+    {
+        sockaddr_in incoming{};
+        sockaddr_length incoming_size = sizeof(incoming);
+        SOCKET accepted;
+        while (INVALID_SOCKET != (accepted = accept(listener,reinterpret_cast<sockaddr*>(&incoming),&incoming_size)))
+        {
+            if (!SOCKET_SELECTABLE(accepted))
+            {
+                LOG_WARNING("Cluster link past what select() can watch, dropping it | " << accepted);
+                CLOSE_SOCKET(accepted);
+                continue;
+            }
+            SET_NONBLOCKING(accepted);
+            PACMAN::size_buffers(accepted,PACMAN::LINK::PEER);
+            ClusterLink link;
+            link.socket = accepted;
+            links.push_back(std::move(link));
+        }
+    }
+
+    for (auto link = links.begin(); link != links.end();)
+    {
+        if (!FD_ISSET(link->socket,&set))
+        {
+            ++link;
+            continue;
+        }
+        bool closed = false;
+        char chunk[64 * 1024];
+        for (;;)
+        {
+            const int result = recv(link->socket,chunk,sizeof(chunk),0);
+            if (result > 0)
+            {
+                link->buffer.append(chunk,result);
+                continue;
+            }
+            closed = result == 0 || !SOCKET_WOULD_BLOCK;
+            break;
+        }
+
+        std::vector<BusMessage> messages;
+        if (!decode_bus(link->buffer,messages))
+        {
+            LOG_WARNING("Garbage on the cluster bus, dropping the link");
+            closed = true;
+        }
+        for (const auto& message : messages)
+        {
+            if (message.type == BUS_CODE::HELLO)
+            {
+                link->node = message.node;
+                link->known = peers.count(message.node) != 0;
+                if (!link->known) LOG_WARNING("Cluster node " << message.node << " isn't one of our peers");
+                continue;
+            }
+            if (!link->known) continue;
+            handle(message,link->node);
+        }
+
+        if (!closed)
+        {
+            ++link;
+            continue;
+        }
+        if (link->known) peers[link->node].interest.clear();
+        CLOSE_SOCKET(link->socket);
+        link = links.erase(link);
+    }
+
+    for (auto& p : peers)
+    {
+        ClusterPeer& peer = p.second;
+        if (!peer.up || !FD_ISSET(peer.socket,&set)) continue;
+        char chunk[256];
+        const int result = recv(peer.socket,chunk,sizeof(chunk),0);
+        if (result == 0 || (result < 0 && !SOCKET_WOULD_BLOCK)) take_down(p.first,peer);
+    }
+}
+
+std::vector<BusMessage> ClusterNode::take_events()
+{
+    std::vector<BusMessage> taken;
+    taken.swap(events);
+    return taken;
+}
+
+// Everything queued this pass goes out together
+void ClusterNode::flush()
+{
+    for (auto& p : peers)
+    {
+        ClusterPeer& peer = p.second;
+        if (!peer.up || peer.backlog.empty()) continue;
+        size_t sent = 0;
+        bool failed = false;
+        while (sent < peer.backlog.size())
+        {
+            const int result = send(peer.socket,peer.backlog.data() + sent,static_cast<int>(peer.backlog.size() - sent),SEND_NO_SIGNAL);
+            if (result > 0)
+            {
+                sent += result;
+                continue;
+            }
+            failed = !SOCKET_WOULD_BLOCK;
+            break;
+        }
+        if (failed)
+        {
+            take_down(p.first,peer);
+            continue;
+        }
+        peer.backlog.erase(0,sent);
+        if (peer.backlog.size() > CLUSTER_MAX_BACKLOG)
+        {
+            LOG_WARNING("Cluster node " << p.first << " fell too far behind, resetting the link");
+            take_down(p.first,peer);
+        }
+    }
+}
+
+void ClusterNode::set_interest(const std::string& topic, bool on)
+{
+    if (on) interest.insert(topic);
+    else interest.erase(topic);
+    BusMessage message;
+    message.type = BUS_CODE::INTEREST;
+    message.key = topic;
+    message.on = on;
+    const std::string encoded = encode_bus(message);
+    for (auto& peer : peers)
+        if (peer.second.up) peer.second.backlog += encoded;
+}
+
+// Only peers with somebody listening get a copy
+void ClusterNode::publish(const std::string& topic, const std::string& frames)
+{
+    std::string encoded;
+    for (auto& peer : peers)
+    {
+        if (!peer.second.up || !peer.second.interest.count(topic)) continue;
+        if (encoded.empty())
+        {
+            BusMessage message;
+            message.type = BUS_CODE::PUBLISH;
+            message.key = topic;
+            message.frames = frames;
+            encoded = encode_bus(message);
+        }
+        peer.second.backlog += encoded;
+    }
+}
+
+void ClusterNode::claim(const std::string& username)
+{
+    BusMessage message;
+    message.type = BUS_CODE::CLAIM;
+    message.key = username;
+    message.node = self;
+    post(ring.owner(username),message);
+}
+
+void ClusterNode::release(const std::string& username)
+{
+    BusMessage message;
+    message.type = BUS_CODE::RELEASE;
+    message.key = username;
+    message.node = self;
+    post(ring.owner(username),message);
+}
+
+// Goes to the directory owner first, it knows which node actually has them
+void ClusterNode::route(const std::string& target, const std::string& origin, const std::string& frames, uint8_t hops, bool kick)
+{
+    BusMessage message;
+    message.type = BUS_CODE::USER;
+    message.key = target;
+    message.origin = origin;
+    message.frames = frames;
+    message.hops = hops;
+    message.on = kick;
+
+    const uint32_t owner = ring.owner(target);
+    if (owner != self)
+    {
+        post(owner,message);
+        return;
+    }
+    const auto found = directory.find(target);
+    if (found != directory.end() && found->second != self && alive(found->second))
+    {
+        post(found->second,message);
+        return;
+    }
+
+    // Not connected anywhere, the origin can't be bounced twice
+    if (origin.empty()) return;
+    BusMessage bounce;
+    bounce.type = BUS_CODE::USER;
+    bounce.key = origin;
+    bounce.frames = PACMAN::encode_message(MESSAGE,"[SERVER] | " + target + " does not exist.");
+    events.push_back(std::move(bounce));
+}
+
+void ClusterNode::lookup(const std::string& username, uint64_t request)
+{
+    BusMessage message;
+    message.type = BUS_CODE::LOOKUP;
+    message.key = username;
+    message.node = self;
+    message.origin = std::to_string(request);
+    post(ring.owner(username),message);
+}
+
+void ClusterNode::post(uint32_t node, const BusMessage& message)
+{
+    if (node == self)
+    {
+        handle(message,self);
+        return;
+    }
+    const auto found = peers.find(node);
+    if (found == peers.end() || !found->second.up) return; // Lost with the node
+    found->second.backlog += encode_bus(message);
+}
+
+void ClusterNode::handle(const BusMessage& message, uint32_t from)
+{
+    switch (message.type)
+    {
+        case BUS_CODE::INTEREST:
+        {
+            if (from == self) return;
+            auto& topics = peers[from].interest;
+            if (message.on) topics.insert(message.key);
+            else topics.erase(message.key);
+            return;
+        }
+        case BUS_CODE::CLAIM:
+        {
+            const auto found = directory.find(message.key);
+            if (found != directory.end() && found->second != message.node && alive(found->second))
+            {
+                BusMessage conflict;
+                conflict.type = BUS_CODE::CONFLICT;
+                conflict.key = message.key;
+                conflict.node = self;
+                post(message.node,conflict);
+                return;
+            }
+            directory[message.key] = message.node;
+            return;
+        }
+        case BUS_CODE::RELEASE:
+        {
+            const auto found = directory.find(message.key);
+            if (found != directory.end() && found->second == message.node) directory.erase(found);
+            return;
+        }
+        case BUS_CODE::LOOKUP:
+        {
+            const auto found = directory.find(message.key);
+            BusMessage answer;
+            answer.type = BUS_CODE::LOCATED;
+            answer.key = message.key;
+            answer.origin = message.origin;
+            answer.on = found != directory.end() && alive(found->second);
+            answer.node = answer.on ? found->second : 0;
+            post(message.node,answer);
+            return;
+        }
+        case BUS_CODE::PUBLISH:
+        case BUS_CODE::CONFLICT:
+        case BUS_CODE::USER:
+        case BUS_CODE::LOCATED:
+            events.push_back(message);
+            return;
+        case BUS_CODE::HELLO:
+        case BUS_CODE::RING_CHANGED:
+            return;
+    }
+}
+
+bool ClusterNode::alive(uint32_t node) const
+{
+    if (node == self) return true;
+    const auto found = peers.find(node);
+    return found != peers.end() && found->second.up;
+}
+
+void ClusterNode::bring_up(uint32_t id, ClusterPeer& peer)
+{
+    peer.connecting = false;
+    peer.up = true;
+
+    // The peer starts with a clean slate so tell it everything we're listening to
+    BusMessage hello;
+    hello.type = BUS_CODE::HELLO;
+    hello.node = self;
+    peer.backlog = encode_bus(hello);
+    for (const auto& topic : interest)
+    {
+        BusMessage message;
+        message.type = BUS_CODE::INTEREST;
+        message.key = topic;
+        message.on = true;
+        peer.backlog += encode_bus(message);
+    }
+
+    LOG_INFO("Cluster Node Up | " << id);
+    ring.add(id);
+    ring_changed();
+}
+
+void ClusterNode::take_down(uint32_t id, ClusterPeer& peer)
+{
+    const bool was_up = peer.up;
+    if (INVALID_SOCKET != peer.socket) CLOSE_SOCKET(peer.socket);
+    peer.socket = INVALID_SOCKET;
+    peer.up = false;
+    peer.connecting = false;
+    peer.backlog.clear();
+    peer.interest.clear();
+    peer.retry_at = now + std::chrono::seconds(CLUSTER_RETRY_SECONDS);
+    if (!was_up) return;
+
+    LOG_WARNING("Cluster Node Down | " << id);
+    ring.remove(id);
+    ring_changed();
+}
+
+// Ownership moved, whatever pointed at a dead node is useless now
+void ClusterNode::ring_changed()
+{
+    for (auto entry = directory.begin(); entry != directory.end();)
+    {
+        if (alive(entry->second)) ++entry;
+        else entry = directory.erase(entry);
+    }
+    BusMessage message;
+    message.type = BUS_CODE::RING_CHANGED;
+    events.push_back(std::move(message));
+}
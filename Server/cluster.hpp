@@ -0,0 +1,128 @@
+#ifndef NETWORK_CLUSTER_HPP
+#define NETWORK_CLUSTER_HPP
+
+#include "os_diff.hpp"
+#include "packet_sender.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+#define CLUSTER_VIRTUAL_NODES 64
+#define CLUSTER_RETRY_SECONDS 2
+#define CLUSTER_MAX_HOPS 3
+#define CLUSTER_MAX_BACKLOG (32 * 1024 * 1024) // A peer this far behind gets its link reset
+
+/*
+ * Several NETSERVER processes sharing one chat
+ * Every node owns its own connections, the bus between them carries topic traffic and directory lookups
+ * Messages queue per peer and leave in one send() per loop pass, nothing waits on a reply
+ */
+
+enum class BUS_CODE : uint8_t
+{
+    HELLO = 1,    // First message on a link, node is the sender
+    INTEREST,     // key topic, on when the sender gained its first local subscriber
+    PUBLISH,      // key topic, frames already encoded for clients
+    CLAIM,        // key username, node is where they are connected
+    RELEASE,
+    CONFLICT,     // key username, somebody claimed it first
+    USER,         // key target, origin hears about it if the target is nowhere, on kicks after delivering
+    LOOKUP,       // key username, node asks the owner where they are, origin is the request id
+    LOCATED,      // Answer to LOOKUP, node is where they are and on if they are anywhere
+    RING_CHANGED  // Never on the wire, tells the core to claim its users again
+};
+
+struct BusMessage
+{
+    BUS_CODE type = BUS_CODE::HELLO;
+    uint32_t node = 0;
+    uint8_t hops = 0;
+    bool on = false;
+    std::string key;
+    std::string origin;
+    std::string frames;
+};
+
+// LENGTH(4) TYPE(1) NODE(4) HOPS(1) ON(1) then KEY, ORIGIN and FRAMES each as LENGTH(4) BYTES
+std::string encode_bus(const BusMessage& message);
+// Pops every whole message off the front of buffer, false if the stream is garbage
+bool decode_bus(std::string& buffer, std::vector<BusMessage>& messages);
+
+// Usernames map to the node holding their directory entry
+// Virtual points keep the load even and only move a slice of keys when a node comes or goes
+struct HashRing
+{
+    std::vector<std::pair<uint64_t,uint32_t>> points; // Sorted by hash
+
+    void add(uint32_t node);
+    void remove(uint32_t node);
+    bool contains(uint32_t node) const;
+    uint32_t owner(const std::string& key) const;
+};
+
+struct ClusterPeer
+{
+    sockaddr_in address{};
+    SOCKET socket = INVALID_SOCKET; // Outbound, we only ever write to it
+    bool connecting = false;
+    bool up = false;
+    std::string backlog;
+    std::set<std::string> interest; // Topics the peer has subscribers for
+    std::chrono::steady_clock::time_point retry_at{};
+};
+
+struct ClusterLink
+{
+    SOCKET socket = INVALID_SOCKET; // Inbound, we only ever read from it
+    uint32_t node = 0;
+    bool known = false; // Saw the HELLO
+    std::string buffer;
+};
+
+struct ClusterNode
+{
+    uint32_t self = 0;
+    SOCKET listener = INVALID_SOCKET;
+    std::map<uint32_t,ClusterPeer> peers;
+    std::vector<ClusterLink> links;
+    HashRing ring;
+    std::unordered_map<std::string,uint32_t> directory; // Only the usernames this node owns
+    std::set<std::string> interest; // Topics with local subscribers
+    std::vector<BusMessage> events; // For the core
+    std::chrono::steady_clock::time_point now{};
+
+    bool enabled() const { return INVALID_SOCKET != listener; }
+    bool open(uint32_t id, int port);
+    void add_peer(uint32_t id, const sockaddr_in& address);
+    void shutdown();
+
+    // Loop plumbing
+    void tick(std::chrono::steady_clock::time_point time);
+    void fill(fd_set& set, SOCKET& highest) const;
+    void service(const fd_set& set);
+    std::vector<BusMessage> take_events();
+    void flush();
+
+    // Called by the core
+    void set_interest(const std::string& topic, bool on);
+    void publish(const std::string& topic, const std::string& frames);
+    void claim(const std::string& username);
+    void release(const std::string& username);
+    void route(const std::string& target, const std::string& origin, const std::string& frames, uint8_t hops, bool kick = false);
+    void lookup(const std::string& username, uint64_t request); // Answered with a LOCATED event
+
+private:
+    void post(uint32_t node, const BusMessage& message);
+    void handle(const BusMessage& message, uint32_t from);
+    bool alive(uint32_t node) const;
+    void bring_up(uint32_t id, ClusterPeer& peer);
+    void take_down(uint32_t id, ClusterPeer& peer);
+    void ring_changed();
+};
+
+#endif //NETWORK_CLUSTER_HPP
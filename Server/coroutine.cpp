@@ -0,0 +1,218 @@
+#include "coroutine.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <exception>
+
+void Task::promise_type::unhandled_exception()
+{
+    try
+    {
+        throw;
+    } catch (const std::exception& e)
+    {
+        LOG_ERROR("Handler threw | " << e.what());
+    } catch (...)
+    {
+        LOG_ERROR("Handler threw something that isn't an exception");
+    }
+}
+
+// Whatever is still suspended never gets to finish
+Scheduler::~Scheduler()
+{
+    for (const auto& waiter : waiting)
+        waiter.handle.destroy();
+    for (const auto handle : posted)
+        handle.destroy();
+    if (INVALID_SOCKET != wake) CLOSE_SOCKET(wake);
+}
+
+bool Scheduler::open_wake()
+{
+    wake = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+    if (INVALID_SOCKET == wake) return false;
+    wake_address.sin_family = AF_INET;
+    wake_address.sin_port = 0;
+    inet_pton(AF_INET,"127.0.0.1",&wake_address.sin_addr);
+    sockaddr_length length = sizeof(wake_address);
+    if (0 > bind(wake,reinterpret_cast<sockaddr*>(&wake_address),sizeof(wake_address)) ||
+        0 > getsockname(wake,reinterpret_cast<sockaddr*>(&wake_address),&length))
+    {
+        CLOSE_SOCKET(wake);
+        wake = INVALID_SOCKET;
+        return false;
+    }
+    SET_NONBLOCKING(wake);
+    return true;
+}
+
+void Scheduler::notify(uint64_t signal)
+{
+    for (size_t i = 0; i < waiting.size(); ++i)
+    {
+        if (waiting[i].kind != WAIT::SIGNAL || waiting[i].signal != signal) continue;
+        resume(i,true);
+        return;
+    }
+}
+
+void Scheduler::post(std::coroutine_handle<> handle)
+{
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        posted.push_back(handle);
+    }
+    if (INVALID_SOCKET == wake) return;
+    const char poke = 0;
+    sendto(wake,&poke,1,0,reinterpret_cast<const sockaddr*>(&wake_address),sizeof(wake_address));
+}
+
+// Hands a waiter back to its coroutine, the coroutine can add new waiters while it runs
+void Scheduler::resume(size_t index, bool ready)
+{
+    const Waiter waiter = waiting[index];
+    waiting[index] = waiting.back();
+    waiting.pop_back();
+    *waiter.ready = ready;
+    waiter.handle.resume();
+}
+
+void Scheduler::run_due(LoopTime time)
+{
+    now = time;
+    loop_thread = std::this_thread::get_id();
+
+    std::vector<std::coroutine_handle<>> hopped;
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        hopped.swap(posted);
+    }
+    for (const auto handle : hopped)
+        handle.resume();
+
+    for (size_t i = 0; i < waiting.size();)
+    {
+        if (waiting[i].deadline > now)
+        {
+            ++i;
+            continue;
+        }
+        // Sleeping until the deadline is the whole point of SLEEP, for the rest it means giving up
+        resume(i,waiting[i].kind == WAIT::SLEEP);
+        i = 0; // Resuming can reshuffle the list
+    }
+}
+
+void Scheduler::fill(fd_set& read, fd_set& write, SOCKET& highest) const
+{
+    if (INVALID_SOCKET != wake)
+    {
+        FD_SET(wake,&read);
+        highest = std::max(highest,wake);
+    }
+    for (const auto& waiter : waiting)
+    {
+        if (waiter.kind == WAIT::READ) FD_SET(waiter.socket,&read);
+        else if (waiter.kind == WAIT::WRITE) FD_SET(waiter.socket,&write);
+        else continue;
+        highest = std::max(highest,waiter.socket);
+    }
+}
+
+void Scheduler::dispatch(const fd_set& read, const fd_set& write)
+{
+    if (INVALID_SOCKET != wake && FD_ISSET(wake,&read))
+    {
+        char drain[64];
+        while (recv(wake,drain,sizeof(drain),0) > 0) {}
+    }
+
+    // Collect first, resuming adds and removes waiters
+    std::vector<std::coroutine_handle<>> ready;
+    for (const auto& waiter : waiting)
+    {
+        if ((waiter.kind == WAIT::READ && FD_ISSET(waiter.socket,&read)) ||
+            (waiter.kind == WAIT::WRITE && FD_ISSET(waiter.socket,&write)))
+            ready.push_back(waiter.handle);
+    }
+    for (const auto handle : ready)
+    {
+        const auto found = std::find_if(waiting.begin(),waiting.end(),
+                                        [handle](const Waiter& waiter) { return waiter.handle == handle; });
+        if (found == waiting.end()) continue;
+        resume(found - waiting.begin(),true);
+    }
+
+    std::vector<std::coroutine_handle<>> hopped;
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        hopped.swap(posted);
+    }
+    for (const auto handle : hopped)
+        handle.resume();
+}
+
+bool Scheduler::has_writers() const
+{
+    return std::any_of(waiting.begin(),waiting.end(),[](const Waiter& waiter) { return waiter.kind == WAIT::WRITE; });
+}
+
+// How long select() may sleep before the next deadline is due
+std::chrono::milliseconds Scheduler::timeout(std::chrono::milliseconds longest) const
+{
+    std::chrono::milliseconds shortest = longest;
+    for (const auto& waiter : waiting)
+    {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(waiter.deadline - now);
+        shortest = std::min(shortest,std::max(left,std::chrono::milliseconds(0)));
+    }
+    return shortest;
+}
+
+void WorkerPool::start(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        threads.emplace_back([this] { work(); });
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+    threads.clear();
+    for (const auto handle : queue)
+        handle.destroy();
+    queue.clear();
+}
+
+void WorkerPool::push(std::coroutine_handle<> handle)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(handle);
+    }
+    ready.notify_one();
+}
+
+void WorkerPool::work()
+{
+    for (;;)
+    {
+        std::coroutine_handle<> handle;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard,[this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            handle = queue.front();
+            queue.pop_front();
+        }
+        handle.resume();
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef NETWORK_COROUTINE_HPP
+#define NETWORK_COROUTINE_HPP
+
+#include "os_diff.hpp"
+
+#include <coroutine>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+
+/*
+ * Handlers that have to wait are written as coroutines instead of blocking the select() loop
+ * A Task starts right away, runs until its first co_await that really waits and frees itself when done
+ * Whatever it waits on (timers, sockets, signals, other threads) hands it back to the loop thread
+ */
+
+typedef std::chrono::steady_clock::time_point LoopTime;
+
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception();
+    };
+};
+
+struct Scheduler
+{
+    enum class WAIT { SLEEP, READ, WRITE, SIGNAL };
+
+    struct Waiter
+    {
+        WAIT kind;
+        SOCKET socket;
+        uint64_t signal;
+        LoopTime deadline;
+        std::coroutine_handle<> handle;
+        bool* ready; // Where the awaiter reads its result, false means the deadline hit first
+    };
+
+    // co_await gives back true when the thing happened and false when the deadline did
+    struct WaitAwaiter
+    {
+        Scheduler& scheduler;
+        Waiter waiter;
+        bool ready = false;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            waiter.handle = handle;
+            waiter.ready = &ready;
+            scheduler.waiting.push_back(waiter);
+        }
+        bool await_resume() const noexcept { return ready; }
+    };
+
+    // Resumes on the loop thread, doesn't suspend at all if already there
+    struct HopAwaiter
+    {
+        Scheduler& scheduler;
+
+        bool await_ready() const noexcept { return std::this_thread::get_id() == scheduler.loop_thread; }
+        void await_suspend(std::coroutine_handle<> handle) { scheduler.post(handle); }
+        void await_resume() const noexcept {}
+    };
+
+    LoopTime now = std::chrono::steady_clock::now();
+    std::thread::id loop_thread = std::this_thread::get_id();
+    std::vector<Waiter> waiting;
+
+    std::mutex posted_lock;
+    std::vector<std::coroutine_handle<>> posted; // From other threads
+    SOCKET wake = INVALID_SOCKET; // Loopback datagram socket that pokes select() awake
+    sockaddr_in wake_address{};
+
+    ~Scheduler();
+
+    WaitAwaiter sleep_until(LoopTime deadline) { return WaitAwaiter{*this,Waiter{WAIT::SLEEP,INVALID_SOCKET,0,deadline,{},nullptr}}; }
+    WaitAwaiter sleep_for(std::chrono::milliseconds duration) { return sleep_until(now + duration); }
+    WaitAwaiter readable(SOCKET socket, LoopTime deadline) { return WaitAwaiter{*this,Waiter{WAIT::READ,socket,0,deadline,{},nullptr}}; }
+    WaitAwaiter writable(SOCKET socket, LoopTime deadline) { return WaitAwaiter{*this,Waiter{WAIT::WRITE,socket,0,deadline,{},nullptr}}; }
+    WaitAwaiter wait(uint64_t signal, LoopTime deadline) { return WaitAwaiter{*this,Waiter{WAIT::SIGNAL,INVALID_SOCKET,signal,deadline,{},nullptr}}; }
+    HopAwaiter schedule() { return HopAwaiter{*this}; }
+
+    void notify(uint64_t signal);
+    void post(std::coroutine_handle<> handle); // Safe from any thread
+    bool open_wake();
+
+    // Loop plumbing
+    void run_due(LoopTime time);
+    void fill(fd_set& read, fd_set& write, SOCKET& highest) const;
+    void dispatch(const fd_set& read, const fd_set& write);
+    bool has_writers() const;
+    std::chrono::milliseconds timeout(std::chrono::milliseconds longest) const;
+
+private:
+    void resume(size_t index, bool ready);
+};
+
+// Runs the parts of a handler that are too slow for the loop thread
+// Without threads co_await schedule() just carries on inline, replays stay deterministic that way
+struct WorkerPool
+{
+    struct HopAwaiter
+    {
+        WorkerPool& pool;
+
+        bool await_ready() const noexcept { return pool.threads.empty(); }
+        void await_suspend(std::coroutine_handle<> handle) { pool.push(handle); }
+        void await_resume() const noexcept {}
+    };
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::coroutine_handle<>> queue;
+    bool stopping = false;
+
+    ~WorkerPool() { stop(); }
+
+    void start(size_t count);
+    void stop();
+    HopAwaiter schedule() { return HopAwaiter{*this}; }
+
+private:
+    void push(std::coroutine_handle<> handle);
+    void work();
+};
+
+#endif //NETWORK_COROUTINE_HPP
@@ -0,0 +1,224 @@
+#ifndef NETWORK_DATABASE_HPP
+#define NETWORK_DATABASE_HPP
+
+#include "os_diff.hpp"
+#include "packet_sender.hpp"
+#include "pubsub.hpp"
+#include "accounts.hpp"
+#include "trace.hpp"
+
+#include <map>
+#include <set>
+#include <string>
+#include <memory>
+#include <chrono>
+
+#define STARTING_ROOM_NAME "HOMEROOM"
+#define DATABASE_MAX_ROOMS 4096 // Empty rooms are cleared out to make space, past that nobody gets a new one
+#define DATABASE_MAX_ROOM_NAME 64
+#define DATABASE_MAX_PENDING 64 // Friend requests waiting on one user, and sent by one user
+#define DATABASE_MAX_SUBSCRIPTIONS 64 // Rooms one user listens to on top of the one they are in
+
+struct ClientData
+{
+    std::string username;
+    std::string room;
+    SOCKET socket;
+    sockaddr_in network;
+    std::map<SOCKET,std::shared_ptr<ClientData>> friends;
+    std::map<SOCKET,bool> pending;
+    std::set<SOCKET> requested; // Whose pending list we're in, so leaving cleans up after us
+    std::chrono::steady_clock::time_point next_join{}; // Room hops queue up behind this
+    ROLE role = ROLE::GUEST;
+    bool registered = false; // Has an account, a promotion sticks past this connection
+
+    ClientData(const std::string& name, const std::string& rm, SOCKET sock, sockaddr_in net) : username(name), room(rm), socket(sock), network(net) {}
+};
+
+
+typedef std::shared_ptr<ClientData> ClientDataPtr;
+struct ChatRoom
+{
+    std::string name;
+    std::map<SOCKET,ClientDataPtr> clients;
+};
+
+struct Database
+{
+    std::map<SOCKET,ClientDataPtr> by_socket;
+    std::map<std::string,ClientDataPtr> by_name;
+    std::map<std::string,ChatRoom> rooms;
+    TopicRegistry topics;
+
+    // No Error checking for self sending
+    bool befriend(SOCKET sender, const std::string& receipient)
+    {
+        const auto& receiver = by_name.at(receipient);
+        const auto& who = by_socket.at(sender);
+        if (who->pending.count(receiver->socket))
+        {
+            receiver->friends.insert(std::make_pair(sender,who)); // Add to their list
+            who->pending.erase(receiver->socket); // Remove the pending friend request
+            receiver->requested.erase(sender);
+            who->friends.insert(std::make_pair(receiver->socket,receiver)); // Add to sender's list
+            topics.subscribe(sender,topics.intern(friends_topic(receiver->username)));
+            topics.subscribe(receiver->socket,topics.intern(friends_topic(who->username)));
+            return true;
+        }
+        receiver->pending.insert(std::make_pair(sender,true)); // Send a pending friend request
+        who->requested.insert(receiver->socket);
+        return false;
+    }
+
+    bool unfriend(SOCKET sender, const std::string& receipient)
+    {
+        const auto& receiver = by_name.at(receipient);
+        const auto& person = by_socket.at(sender);
+        if (person->friends.count(receiver->socket))
+        {
+            receiver->friends.erase(sender);
+            person->friends.erase(receiver->socket);
+            topics.unsubscribe(sender,topics.intern(friends_topic(receiver->username)));
+            topics.unsubscribe(receiver->socket,topics.intern(friends_topic(person->username)));
+            return true;
+        }
+        return false;
+    }
+
+    void wipe_slate(const ClientDataPtr& who)
+    {
+        const auto& flist = who->friends;
+        for (const auto& f : flist)
+            f.second->friends.erase(who->socket); // Remove this person from their friend's friends list
+        for (const SOCKET asked : who->requested)
+        {
+            const auto other = by_socket.find(asked);
+            if (other != by_socket.end()) other->second->pending.erase(who->socket);
+        }
+        for (const auto& p : who->pending)
+        {
+            const auto other = by_socket.find(p.first);
+            if (other != by_socket.end()) other->second->requested.erase(who->socket);
+        }
+        topics.clear(topics.intern(friends_topic(who->username)));
+        topics.drop(who->socket);
+    }
+
+    void join(const ClientDataPtr& user, const std::string& room)
+    {
+        TRACE_SPAN("database.join");
+        rooms[room].clients.insert(std::make_pair(user->socket,user));
+        rooms[room].name = room;
+        user->room = room;
+        topics.subscribe(user->socket,topics.intern(room_topic(room)));
+    }
+    void leave(const ClientDataPtr& user)
+    {
+        TRACE_SPAN("database.leave");
+        rooms.at(user->room).clients.erase(user->socket);
+        topics.unsubscribe(user->socket,topics.intern(room_topic(user->room)));
+    }
+    void move(SOCKET user, const std::string& room)
+    {
+        const auto& userdata = by_socket.at(user);
+        leave(userdata); // Remove from old room
+        join(userdata,room); // Inserts into existing or creates a new room
+    }
+
+    bool add(const ClientDataPtr& user)
+    {
+        TRACE_SPAN("database.add");
+        if (by_name.count(user->username)) return false; // Check for existing user
+        by_socket.emplace(std::make_pair(user->socket,user));
+        by_name.emplace(std::make_pair(user->username,user));
+        topics.subscribe(user->socket,topics.intern(GLOBAL_TOPIC));
+        join(user,STARTING_ROOM_NAME);
+        return true;
+    }
+
+    void rem(const ClientDataPtr& user)
+    {
+        TRACE_SPAN("database.remove");
+        leave(user);
+        wipe_slate(user);
+        by_socket.erase(user->socket);
+        by_name.erase(user->username);
+    }
+    void rem(SOCKET socket)
+    {
+        const ClientDataPtr user = by_socket.at(socket); // Copy, the map entry is erased inside
+        rem(user);
+    }
+    void rem(const std::string& name)
+    {
+        const ClientDataPtr user = by_name.at(name);
+        rem(user);
+    }
+
+    bool promote(SOCKET socket)
+    {
+        const auto& user = by_socket.at(socket);
+        topics.subscribe(socket,topics.intern(ADMIN_TOPIC));
+        if (user->role == ROLE::ADMIN) return false;
+        user->role = ROLE::ADMIN;
+        return true;
+    }
+
+    bool is_admin(SOCKET socket) const
+    {
+        return by_socket.at(socket)->role == ROLE::ADMIN;
+    }
+
+    // Moves a user onto a new socket key in every index
+    void rekey(SOCKET from, SOCKET to)
+    {
+        const ClientDataPtr user = by_socket.at(from);
+        by_socket.erase(from);
+        by_socket.emplace(to,user);
+        user->socket = to;
+
+        auto& members = rooms.at(user->room).clients;
+        members.erase(from);
+        members.emplace(to,user);
+
+        for (const auto& f : user->friends)
+        {
+            f.second->friends.erase(from);
+            f.second->friends.emplace(to,user);
+        }
+        for (const SOCKET asked : user->requested)
+        {
+            const auto other = by_socket.find(asked);
+            if (other != by_socket.end() && other->second->pending.erase(from))
+                other->second->pending.emplace(to,true);
+        }
+        for (const auto& p : user->pending)
+        {
+            const auto other = by_socket.find(p.first);
+            if (other != by_socket.end() && other->second->requested.erase(from))
+                other->second->requested.insert(to);
+        }
+        topics.rekey(from,to);
+    }
+
+    // Whether roomname exists or there's space to make it, clearing out empty rooms if there isn't
+    bool room_available(const std::string& roomname)
+    {
+        if (rooms.count(roomname)) return true;
+        if (roomname.empty() || roomname.size() > DATABASE_MAX_ROOM_NAME) return false;
+        if (rooms.size() < DATABASE_MAX_ROOMS) return true;
+        for (auto room = rooms.begin(); room != rooms.end();)
+        {
+            if (room->second.clients.empty() && room->first != STARTING_ROOM_NAME) room = rooms.erase(room);
+            else ++room;
+        }
+        return rooms.size() < DATABASE_MAX_ROOMS;
+    }
+
+    const ChatRoom& room(SOCKET socket)
+    {
+        return rooms.at(by_socket.at(socket)->room);
+    }
+};
+
+#endif //NETWORK_DATABASE_HPP
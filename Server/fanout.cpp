@@ -0,0 +1,75 @@
+#include "fanout.hpp"
+
+void FanoutPool::start(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        threads.emplace_back([this] { work(); });
+}
+
+void FanoutPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+    threads.clear();
+    stopping = false;
+}
+
+void FanoutPool::run(size_t count, const std::function<void(size_t)>& job)
+{
+    if (threads.empty())
+    {
+        for (size_t i = 0; i < count; ++i)
+            job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current = &job;
+        shards = count;
+        next.store(0);
+        checked_in = 0;
+        ++round;
+    }
+    wake.notify_all();
+    drain(job,count);
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard,[this] { return checked_in == threads.size(); });
+    current = nullptr;
+}
+
+void FanoutPool::drain(const std::function<void(size_t)>& job, size_t count)
+{
+    for (size_t shard = next.fetch_add(1); shard < count; shard = next.fetch_add(1))
+        job(shard);
+}
+
+void FanoutPool::work()
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        const std::function<void(size_t)>* job;
+        size_t count;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard,[this,seen] { return stopping || round != seen; });
+            if (stopping) return;
+            seen = round;
+            job = current;
+            count = shards;
+        }
+        drain(*job,count);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++checked_in;
+        }
+        done.notify_one();
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef NETWORK_FANOUT_HPP
+#define NETWORK_FANOUT_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Splits one big send across cores
+ * The loop thread hands over a set of shards and waits for all of them, nothing else touches the
+ * Database, sessions or transport meanwhile. Every socket belongs to exactly one shard so whoever
+ * runs a shard owns that socket's queue and replay buffer outright, no locks on the way out
+ */
+
+struct FanoutPool
+{
+    ~FanoutPool() { stop(); }
+
+    void start(size_t count);
+    void stop();
+    size_t size() const { return threads.size(); }
+
+    // Calls job(0) to job(shards - 1) spread over the pool and the calling thread, returns when all are done
+    void run(size_t shards, const std::function<void(size_t)>& job);
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* current = nullptr;
+    size_t shards = 0;
+    std::atomic<size_t> next{0};
+    size_t checked_in = 0; // Every thread passes through every round, so a late one can't run the next round's job with this one's
+    uint64_t round = 0;
+    bool stopping = false;
+
+    void work();
+    void drain(const std::function<void(size_t)>& job, size_t count);
+};
+
+#endif //NETWORK_FANOUT_HPP
@@ -0,0 +1,124 @@
+#include "filter.hpp"
+#include "logging.hpp"
+#include "simd_scan.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include <algorithm>
+
+static unsigned char folded(unsigned char byte)
+{
+    return byte >= 'A' && byte <= 'Z' ? static_cast<unsigned char>(byte - 'A' + 'a') : byte;
+}
+
+std::shared_ptr<const FilterAutomaton> FilterAutomaton::build(const std::vector<std::string>& patterns)
+{
+    auto automaton = std::make_shared<FilterAutomaton>();
+    FilterAutomaton& a = *automaton;
+
+    // Columns only for bytes some pattern uses, keeps the table a fraction of 256 wide
+    for (const auto& pattern : patterns)
+    {
+        for (const char c : pattern)
+        {
+            const unsigned char byte = folded(static_cast<unsigned char>(c));
+            if (!a.classes[byte]) a.classes[byte] = static_cast<uint8_t>(a.columns++);
+        }
+    }
+    for (unsigned char byte = 'A'; byte <= 'Z'; ++byte)
+        a.classes[byte] = a.classes[folded(byte)];
+
+    // Trie first, 0 stands for no edge since nothing points back at the root yet
+    a.next.assign(a.columns,0);
+    a.longest.assign(1,0);
+    for (const auto& pattern : patterns)
+    {
+        uint32_t state = 0;
+        for (const char c : pattern)
+        {
+            uint32_t& edge = a.next[state * a.columns + a.classes[static_cast<unsigned char>(c)]];
+            if (!edge)
+            {
+                edge = static_cast<uint32_t>(a.longest.size());
+                a.longest.push_back(0);
+                a.next.resize(a.next.size() + a.columns,0);
+            }
+            state = a.next[state * a.columns + a.classes[static_cast<unsigned char>(c)]]; // resize() may have moved edge
+        }
+        a.longest[state] = static_cast<uint8_t>(std::max<size_t>(a.longest[state],pattern.size()));
+        ++a.patterns;
+    }
+
+    // Breadth first so a state's fail target is finished before the state itself
+    std::vector<uint32_t> fail(a.longest.size(),0);
+    std::deque<uint32_t> queue;
+    for (uint32_t column = 0; column < a.columns; ++column)
+        if (a.next[column]) queue.push_back(a.next[column]);
+    while (!queue.empty())
+    {
+        const uint32_t state = queue.front();
+        queue.pop_front();
+        a.longest[state] = std::max(a.longest[state],a.longest[fail[state]]);
+        for (uint32_t column = 0; column < a.columns; ++column)
+        {
+            uint32_t& edge = a.next[state * a.columns + column];
+            const uint32_t fallback = a.next[fail[state] * a.columns + column];
+            if (edge)
+            {
+                fail[edge] = fallback;
+                queue.push_back(edge);
+            }
+            else
+                edge = fallback;
+        }
+    }
+    return automaton;
+}
+
+bool FilterAutomaton::apply(std::string& text) const
+{
+    bool masked = false;
+    uint32_t state = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        state = next[state * columns + classes[static_cast<unsigned char>(text[i])]];
+        const size_t length = longest[state];
+        if (!length) continue;
+        std::fill(text.begin() + static_cast<std::ptrdiff_t>(i + 1 - length),text.begin() + static_cast<std::ptrdiff_t>(i + 1),FILTER_MASK);
+        masked = true;
+    }
+    return masked;
+}
+
+bool ContentFilter::apply(std::string& text)
+{
+    if (!current || !current->apply(text)) return false;
+    ++filtered;
+    return true;
+}
+
+std::shared_ptr<const FilterAutomaton> ContentFilter::compile(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) return nullptr;
+    std::vector<std::string> patterns;
+    std::string line;
+    size_t skipped = 0;
+    while (std::getline(file,line))
+    {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        // Half a UTF-8 character would get masked into something that isn't UTF-8 anymore
+        if (line.size() > FILTER_MAX_PATTERN || !SCAN::valid_utf8(line.data(),line.size()))
+        {
+            ++skipped;
+            continue;
+        }
+        for (char& c : line)
+            c = static_cast<char>(folded(static_cast<unsigned char>(c)));
+        patterns.push_back(std::move(line));
+    }
+    if (skipped) LOG_WARNING("Skipped " << skipped << " filter patterns that were too long or not UTF-8 | " << path);
+    return FilterAutomaton::build(patterns);
+}
@@ -0,0 +1,48 @@
+#ifndef NETWORK_FILTER_HPP
+#define NETWORK_FILTER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#define FILTER_MASK '*'
+#define FILTER_MAX_PATTERN 64 // Longer lines in the word list are skipped
+
+/*
+ * Moderation word list compiled into one Aho-Corasick automaton
+ * Every fail link is folded into a full transition table over byte classes, so a message costs one
+ * table lookup per byte however many patterns there are. ASCII letters match either case
+ * Matches are masked in place, the text that gets fanned out and indexed never has them
+ */
+
+struct FilterAutomaton
+{
+    uint8_t classes[256]{}; // Byte to column, bytes in no pattern share column 0
+    uint32_t columns = 1;
+    std::vector<uint32_t> next; // state * columns + column
+    std::vector<uint8_t> longest; // Longest pattern ending in each state, suffixes included, 0 for none
+    size_t patterns = 0;
+
+    static std::shared_ptr<const FilterAutomaton> build(const std::vector<std::string>& patterns);
+    // True if anything was masked
+    bool apply(std::string& text) const;
+    size_t memory() const { return next.size() * sizeof(uint32_t) + longest.size(); }
+};
+
+struct ContentFilter
+{
+    std::string path; // One pattern per line, # starts a comment
+    std::shared_ptr<const FilterAutomaton> current; // Loop thread only, a reload swaps the whole thing
+    std::atomic<size_t> filtered{0}; // Messages that had something masked
+
+    // Any thread, current is only swapped between passes
+    bool apply(std::string& text);
+
+    // Reads and compiles a word list, nothing if it can't be read
+    static std::shared_ptr<const FilterAutomaton> compile(const std::string& path);
+};
+
+#endif //NETWORK_FILTER_HPP
@@ -0,0 +1,301 @@
+#include "inbox.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+
+#define INBOX_MAGIC "NETINBX1"
+#define INBOX_MAGIC_SIZE 8
+#define INBOX_RECORD_HEADER 7
+
+static void put_u32(char* at, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        at[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+static uint32_t get_u32(const char* at)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= uint32_t(static_cast<unsigned char>(at[i])) << (8 * i);
+    return value;
+}
+
+bool InboxStore::open(const std::string& path)
+{
+    m_path = path;
+    std::error_code error;
+    if (!std::filesystem::exists(path,error))
+    {
+        std::ofstream created(path,std::ios::binary);
+        created.write(INBOX_MAGIC,INBOX_MAGIC_SIZE);
+        if (!created)
+        {
+            LOG_ERROR("Could not create the inbox file | " << path);
+            return false;
+        }
+    }
+    if (!load()) return false;
+    if (!m_file.is_open()) m_file.open(path,std::ios::binary | std::ios::in | std::ios::out); // A rewrite while loading opened it already
+    if (!m_file.is_open())
+    {
+        LOG_ERROR("Could not open the inbox file | " << path);
+        return false;
+    }
+    m_enabled = true;
+    return true;
+}
+
+// Rebuilds the boxes from the file, a torn record at the end is cut off by rewriting
+bool InboxStore::load()
+{
+    std::ifstream file(m_path,std::ios::binary);
+    char magic[INBOX_MAGIC_SIZE];
+    if (!file.read(magic,INBOX_MAGIC_SIZE) || std::memcmp(magic,INBOX_MAGIC,INBOX_MAGIC_SIZE) != 0)
+    {
+        LOG_ERROR("Not an inbox file | " << m_path);
+        return false;
+    }
+
+    file.seekg(0,std::ios::end);
+    const uint64_t size = static_cast<uint64_t>(file.tellg());
+    file.seekg(INBOX_MAGIC_SIZE);
+
+    m_boxes.clear();
+    m_dead = 0;
+    m_end = INBOX_MAGIC_SIZE;
+    char header[INBOX_RECORD_HEADER];
+    std::string recipient;
+    while (m_end + INBOX_RECORD_HEADER <= size && file.read(header,INBOX_RECORD_HEADER))
+    {
+        const INBOX_KIND kind = static_cast<INBOX_KIND>(header[0]);
+        const uint8_t recipient_length = static_cast<uint8_t>(header[1]);
+        const uint8_t sender_length = static_cast<uint8_t>(header[2]);
+        const uint32_t value = get_u32(header + 3);
+        const uint64_t length = INBOX_RECORD_HEADER + recipient_length + (kind == INBOX_KIND::DELIVERED ? 0 : sender_length + uint64_t(value));
+        if (kind > INBOX_KIND::DELIVERED || m_end + length > size) break;
+        recipient.resize(recipient_length);
+        file.read(&recipient[0],recipient_length);
+        file.seekg(static_cast<std::streamoff>(m_end + length));
+
+        if (kind == INBOX_KIND::DELIVERED)
+        {
+            const auto box = m_boxes.find(recipient);
+            if (box != m_boxes.end())
+            {
+                const size_t retired = std::min<size_t>(value,box->second.size());
+                for (size_t i = 0; i < retired; ++i)
+                    m_dead += box->second[i].length;
+                box->second.erase(box->second.begin(),box->second.begin() + static_cast<std::ptrdiff_t>(retired));
+                if (box->second.empty()) m_boxes.erase(box);
+            }
+            m_dead += length;
+        }
+        else
+            m_boxes[recipient].push_back(Entry{m_end,static_cast<uint32_t>(length)});
+        m_end += length;
+    }
+
+    if (m_end != size)
+    {
+        // Whatever was being written when the server died never made it, the rewrite leaves it out
+        LOG_WARNING("Inbox file ends in the middle of a record, rewriting it | " << m_path);
+        return compact();
+    }
+    if (m_dead > INBOX_COMPACT_MIN_BYTES && m_dead > m_end - m_dead) return compact();
+    return true;
+}
+
+// Live items only into a new file, then swapped over the old one
+// Offsets only move once the new file is in place, a failure carries on with the old file as it was
+bool InboxStore::compact()
+{
+    const std::string temporary = m_path + ".tmp";
+    if (m_file.is_open())
+    {
+        m_file.flush();
+        m_file.close();
+    }
+    std::vector<uint64_t> offsets; // Same walk order as the copy below
+    uint64_t offset = INBOX_MAGIC_SIZE;
+    bool copied;
+    {
+        std::ifstream from(m_path,std::ios::binary);
+        std::ofstream to(temporary,std::ios::binary | std::ios::trunc);
+        to.write(INBOX_MAGIC,INBOX_MAGIC_SIZE);
+        std::string record;
+        for (const auto& box : m_boxes)
+        {
+            for (const auto& entry : box.second)
+            {
+                record.resize(entry.length);
+                from.seekg(static_cast<std::streamoff>(entry.offset));
+                from.read(&record[0],entry.length);
+                to.write(record.data(),entry.length);
+                offsets.push_back(offset);
+                offset += entry.length;
+            }
+        }
+        to.flush();
+        copied = from && to;
+    }
+    std::error_code error;
+    if (!copied)
+        LOG_ERROR("Could not rewrite the inbox file | " << m_path);
+    else
+    {
+        std::filesystem::rename(temporary,m_path,error);
+        if (error) LOG_ERROR("Could not replace the inbox file | " << m_path << " | " << error.message());
+    }
+    if (!copied || error)
+    {
+        std::filesystem::remove(temporary,error);
+        m_file.open(m_path,std::ios::binary | std::ios::in | std::ios::out);
+        return false;
+    }
+
+    size_t next = 0;
+    for (auto& box : m_boxes)
+        for (auto& entry : box.second)
+            entry.offset = offsets[next++];
+    m_end = offset;
+    m_dead = 0;
+    m_file.open(m_path,std::ios::binary | std::ios::in | std::ios::out);
+    return true;
+}
+
+bool InboxStore::write_record(INBOX_KIND kind, const std::string& recipient, const std::string& sender, uint32_t value, const std::string& text)
+{
+    std::string record(INBOX_RECORD_HEADER,'\0');
+    record[0] = static_cast<char>(kind);
+    record[1] = static_cast<char>(recipient.size());
+    record[2] = static_cast<char>(sender.size());
+    put_u32(&record[3],value);
+    record += recipient;
+    record += sender;
+    record += text;
+
+    m_file.seekp(static_cast<std::streamoff>(m_end));
+    m_file.write(record.data(),static_cast<std::streamsize>(record.size()));
+    if (!m_file)
+    {
+        m_file.clear();
+        return false;
+    }
+    m_end += record.size();
+    m_dirty = true;
+    return true;
+}
+
+bool InboxStore::append(const std::string& recipient, INBOX_KIND kind, const std::string& sender, const std::string& text)
+{
+    if (recipient.empty() || recipient.size() > INBOX_MAX_NAME || sender.size() > INBOX_MAX_NAME) return false;
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto& box = m_boxes[recipient];
+    if (box.size() >= INBOX_MAX_ITEMS) return false;
+    const uint64_t offset = m_end;
+    if (!write_record(kind,recipient,sender,static_cast<uint32_t>(text.size()),text))
+    {
+        if (box.empty()) m_boxes.erase(recipient);
+        return false;
+    }
+    box.push_back(Entry{offset,static_cast<uint32_t>(m_end - offset)});
+    return true;
+}
+
+size_t InboxStore::waiting(const std::string& recipient) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    const auto box = m_boxes.find(recipient);
+    return box == m_boxes.end() ? 0 : box->second.size();
+}
+
+std::vector<InboxItem> InboxStore::peek(const std::string& recipient, size_t max_items, size_t max_bytes)
+{
+    std::vector<InboxItem> items;
+    std::lock_guard<std::mutex> guard(m_lock);
+    const auto box = m_boxes.find(recipient);
+    if (box == m_boxes.end()) return items;
+
+    m_file.flush();
+    size_t bytes = 0;
+    std::string record;
+    for (const Entry& entry : box->second)
+    {
+        if (items.size() == max_items || (!items.empty() && bytes + entry.length > max_bytes)) break;
+        record.resize(entry.length);
+        m_file.seekg(static_cast<std::streamoff>(entry.offset));
+        if (!m_file.read(&record[0],entry.length))
+        {
+            m_file.clear();
+            LOG_ERROR("Could not read back an inbox item | " << recipient);
+            break;
+        }
+        const uint8_t recipient_length = static_cast<uint8_t>(record[1]);
+        const uint8_t sender_length = static_cast<uint8_t>(record[2]);
+        InboxItem item;
+        item.kind = static_cast<INBOX_KIND>(record[0]);
+        item.sender = record.substr(INBOX_RECORD_HEADER + recipient_length,sender_length);
+        item.text = record.substr(INBOX_RECORD_HEADER + recipient_length + sender_length);
+        items.push_back(std::move(item));
+        bytes += entry.length;
+    }
+    return items;
+}
+
+void InboxStore::consume(const std::string& recipient, size_t count)
+{
+    if (!count) return;
+    std::lock_guard<std::mutex> guard(m_lock);
+    const auto box = m_boxes.find(recipient);
+    if (box == m_boxes.end()) return;
+    count = std::min(count,box->second.size());
+
+    const uint64_t before = m_end;
+    if (!write_record(INBOX_KIND::DELIVERED,recipient,{},static_cast<uint32_t>(count),{}))
+        LOG_WARNING("Could not mark inbox items delivered, they'll come again after a restart | " << recipient);
+    m_dead += m_end - before;
+    for (size_t i = 0; i < count; ++i)
+        m_dead += box->second[i].length;
+    box->second.erase(box->second.begin(),box->second.begin() + static_cast<std::ptrdiff_t>(count));
+    if (box->second.empty()) m_boxes.erase(box);
+
+    if (m_dead > INBOX_COMPACT_MIN_BYTES && m_dead > m_end - m_dead)
+    {
+        m_file.flush();
+        compact();
+    }
+}
+
+// Hands everything to the OS, called once per pass like the traffic log
+void InboxStore::flush()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!m_dirty) return;
+    m_file.flush();
+    m_dirty = false;
+}
+
+size_t InboxStore::items() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    size_t total = 0;
+    for (const auto& box : m_boxes)
+        total += box.second.size();
+    return total;
+}
+
+size_t InboxStore::boxes() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_boxes.size();
+}
+
+size_t InboxStore::file_bytes() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_end;
+}
@@ -0,0 +1,78 @@
+#ifndef NETWORK_INBOX_HPP
+#define NETWORK_INBOX_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#define INBOX_MAX_ITEMS 20000 // Per user, past this new whispers are turned away
+#define INBOX_MAX_NAME 255
+#define INBOX_COMPACT_MIN_BYTES (1024 * 1024) // Delivered records aren't worth rewriting the file for below this
+
+/*
+ * Whispers and friend requests for registered users who aren't connected
+ * One append-only file after an 8 byte magic, items and DELIVERED markers that retire the oldest items of a box
+ * Only offsets are kept in memory, the text is read back when it goes out
+ * Once delivered records outweigh the live ones the file is rewritten with just the live ones
+ * Record Format | KIND(1) RECIPIENT_LENGTH(1) SENDER_LENGTH(1) TEXT_LENGTH(4) RECIPIENT SENDER TEXT
+ * A DELIVERED record keeps how many items it retires in TEXT_LENGTH and has no sender or text
+ */
+
+enum class INBOX_KIND : uint8_t
+{
+    WHISPER,
+    FRIEND_REQUEST,
+    DELIVERED
+};
+
+struct InboxItem
+{
+    INBOX_KIND kind;
+    std::string sender;
+    std::string text;
+};
+
+struct InboxStore
+{
+    bool open(const std::string& path);
+    bool enabled() const { return m_enabled; } // m_file closes for a moment while a worker compacts
+
+    // False when the box is full or a name doesn't fit
+    bool append(const std::string& recipient, INBOX_KIND kind, const std::string& sender, const std::string& text);
+    size_t waiting(const std::string& recipient) const;
+    // Oldest first, stops at whichever limit comes first but always returns at least one if there is one
+    std::vector<InboxItem> peek(const std::string& recipient, size_t max_items, size_t max_bytes);
+    void consume(const std::string& recipient, size_t count); // Retires what peek returned once it went out
+    void flush();
+
+    size_t items() const;
+    size_t boxes() const;
+    size_t file_bytes() const;
+
+private:
+    struct Entry
+    {
+        uint64_t offset; // Start of the record
+        uint32_t length; // Whole record
+    };
+
+    std::string m_path;
+    mutable std::mutex m_lock; // The loop appends while a worker reads a batch out
+    std::fstream m_file;
+    std::unordered_map<std::string,std::deque<Entry>> m_boxes;
+    uint64_t m_end = 0;
+    uint64_t m_dead = 0; // Bytes of retired items and DELIVERED records
+    bool m_dirty = false;
+    bool m_enabled = false; // Set once by open(), before any worker runs
+
+    bool load();
+    bool compact();
+    bool write_record(INBOX_KIND kind, const std::string& recipient, const std::string& sender, uint32_t length, const std::string& text);
+};
+
+#endif //NETWORK_INBOX_HPP
@@ -2,236 +2,520 @@
 #include "logging.hpp"
 #include "NETWORK_CODES.hpp"
 #include "packet_sender.hpp"
+#include "datagram.hpp"
+#include "server_core.hpp"
+#include "transport.hpp"
+#include "traffic_log.hpp"
+#include "tls.hpp"
+#include "cluster.hpp"
+#include "trace.hpp"
 
 #include <iostream>
-#include <map>
 #include <string>
 #include <vector>
-#include <queue>
+#include <set>
 #include <limits>
+#include <chrono>
+#include <thread>
 #include <algorithm>
-#include <logging.hpp>
 #include <sstream>
-#include <memory>
+#include <csignal>
+
+#ifdef __linux__
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sched.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#endif
 
 #define TCP_BACKLOG 10
 #define DEFAULT_PORT 25565
-#define STARTING_ROOM_NAME "HOMEROOM"
-#define DEFAULT_AUTHENTICATION_CODE "secure_code"
+#define HANDSHAKE_TIMEOUT_SECONDS 10
+#define HANDSHAKE_MAX_BYTES 512 // Name, frame size and password or resume token, up to the TAIL_CODE_END
+#define MIN_HANDLER_THREADS 2 // Otherwise one per core, password hashing runs on them
+#define WORKER_BUS_ADDRESS "127.0.0.1"
+#define LOW_LATENCY_BUSY_POLL_US 50 // How long a read on a client socket spins on the device queue before sleeping
 
-struct ClientData
+SOCKET m_listener_socket;
+SOCKET m_datagram_socket = INVALID_SOCKET;
+SocketTransport m_transport{};
+ServerCore m_core{m_transport};
+TrafficRecorder m_recorder{};
+ClusterNode m_cluster{};
+#ifdef __linux__
+std::vector<pid_t> m_workers{}; // Only the first worker forks, the rest have none
+#endif
+
+bool m_low_latency = false; // Pinned, preallocated, locked and never sleeping in select()
+std::vector<int> m_cpus{};
+std::set<SOCKET> m_primed{}; // Sent messages right behind their handshake, select() won't wake for those
+std::vector<Received> m_received{}; // Read this pass and not handled yet, in arrival order
+
+volatile std::sig_atomic_t m_trace_requested = 0; // SIGUSR1, the loop does the writing
+volatile std::sig_atomic_t m_filter_requested = 0; // SIGHUP, reloads the word list
+
+// ADDRESS:PORT
+bool parse_peer(const std::string& text, sockaddr_in& address)
 {
-    std::string username;
-    std::string room;
-    SOCKET socket;
-    sockaddr_in network;
-    std::map<SOCKET,std::shared_ptr<ClientData>> friends;
-    std::map<SOCKET,bool> pending;
-
-    ClientData(const std::string& name, const std::string& rm, SOCKET sock, sockaddr_in net) : username(name), room(rm), socket(sock), network(net) {}
-};
-
+    const size_t colon = text.rfind(':');
+    if (colon == std::string::npos) return false;
+    address = sockaddr_in{};
+    address.sin_family = AF_INET;
+    try
+    {
+        address.sin_port = htons(static_cast<uint16_t>(std::stoi(text.substr(colon + 1))));
+    } catch (const std::exception&)
+    {
+        return false;
+    }
+    return inet_pton(AF_INET,text.substr(0,colon).c_str(),&address.sin_addr) == 1;
+}
 
-typedef std::shared_ptr<ClientData> ClientDataPtr;
-struct ChatRoom
+// Hands whatever the other nodes sent to the core
+void drain_cluster()
 {
-    std::string name;
-    std::map<SOCKET,ClientDataPtr> clients;
-};
+    for (const auto& message : m_cluster.take_events())
+        m_core.remote(message);
+}
 
-struct Database
+/*
+ * Every worker is its own process with its own listener on the same port, the kernel spreads accepts between them
+ * The workers are nodes of a cluster on loopback, the bus keeps usernames unique and rooms whole across them
+ * Returns which worker this process is, or -1
+ */
+int spawn_workers(size_t count, int bus_port)
 {
-    std::map<SOCKET,ClientDataPtr> by_socket;
-    std::map<std::string,ClientDataPtr> by_name;
-    std::map<std::string,ChatRoom> rooms;
-    std::map<SOCKET,ClientDataPtr> administrators;
-
-    // No Error checking for self sending
-    bool befriend(SOCKET sender, const std::string& receipient)
+#ifdef __linux__
+    size_t index = 0;
+    std::cout.flush(); // Anything still buffered would be printed once per child
+    for (size_t i = 1; i < count; ++i)
     {
-        const auto& receiver = by_name.at(receipient);
-        const auto& who = by_socket.at(sender);
-        if (who->pending.count(receiver->socket))
+        const pid_t child = fork();
+        if (child < 0)
         {
-            receiver->friends.insert(std::make_pair(sender,who)); // Add to their list
-            who->pending.erase(receiver->socket); // Remove the pending friend request
-            who->friends.insert(std::make_pair(receiver->socket,receiver)); // Add to sender's list
-            return true;
+            LOG_ERROR("Could not start worker " << i << " | " << GET_LAST_ERROR);
+            return -1;
         }
-        receiver->pending.insert(std::make_pair(sender,true)); // Send a pending friend request
-        return false;
-    }
-
-    bool unfriend(SOCKET sender, const std::string& receipient)
-    {
-        const auto& receiver = by_name.at(receipient);
-        const auto& person = by_socket.at(sender);
-        if (person->friends.count(receiver->socket))
+        if (child == 0)
         {
-            receiver->friends.erase(sender);
-            person->friends.erase(receiver->socket);
-            return true;
+            prctl(PR_SET_PDEATHSIG,SIGTERM); // Workers go down with the first one
+            m_workers.clear();
+            index = i;
+            break;
         }
-        return false;
+        m_workers.push_back(child);
     }
 
-    void wipe_slate(const ClientDataPtr& who)
+    const uint32_t self = static_cast<uint32_t>(index + 1);
+    if (!m_cluster.open(self,bus_port + static_cast<int>(index))) return -1;
+    for (size_t i = 0; i < count; ++i)
     {
-        const auto& flist = who->friends;
-        for (const auto& f : flist)
-            f.second->friends.erase(who->socket); // Remove this person from their friend's friends list
+        if (i == index) continue;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(bus_port + static_cast<int>(i)));
+        inet_pton(AF_INET,WORKER_BUS_ADDRESS,&address.sin_addr);
+        m_cluster.add_peer(static_cast<uint32_t>(i + 1),address);
     }
+    m_core.attach(m_cluster);
+    if (m_core.m_accounts.enabled() && !m_core.m_accounts.share()) return -1;
+    LOG_INFO("Worker " << index << " of " << count << " | PID " << getpid() << " | Bus Port " << bus_port + static_cast<int>(index));
+    return static_cast<int>(index);
+#else
+    (void)count;
+    (void)bus_port;
+    LOG_ERROR("Workers need SO_REUSEPORT and fork(), run separate --cluster nodes instead");
+    return -1;
+#endif
+}
 
-    void join(const ClientDataPtr& user, const std::string& room)
-    {
-        rooms[room].clients.insert(std::make_pair(user->socket,user));
-        user->room = room;
-    }
-    void leave(const ClientDataPtr& user)
-    {
-        rooms.at(user->room).clients.erase(user->socket);
-    }
-    void move(SOCKET user, const std::string& room)
-    {
-        const auto& userdata = by_socket.at(user);
-        leave(userdata); // Remove from old room
-        join(userdata,room); // Inserts into existing or creates a new room
-    }
+void stop_workers()
+{
+#ifdef __linux__
+    for (const pid_t worker : m_workers)
+        kill(worker,SIGTERM);
+    for (const pid_t worker : m_workers)
+        waitpid(worker,nullptr,0);
+    m_workers.clear();
+#endif
+}
 
-    bool add(const ClientDataPtr& user)
-    {
-        if (by_name.count(user->username)) return false; // Check for existing user
-        by_socket.emplace(std::make_pair(user->socket,user));
-        by_name.emplace(std::make_pair(user->username,user));
-        join(user,STARTING_ROOM_NAME);
-        return true;
-    }
+// Without this the kernel hashes the whole address and port, a client reconnecting from a new port
+// would usually land on another worker and lose the session it wanted to resume
+bool steer_by_address(SOCKET listener, size_t count)
+{
+#ifdef __linux__
+    sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS,0,0,static_cast<uint32_t>(SKF_NET_OFF + 12)}, // IPv4 source address
+        {BPF_ALU | BPF_MOD | BPF_K,0,0,static_cast<uint32_t>(count)},
+        {BPF_RET | BPF_A,0,0,0} // Index into the listeners sharing the port, past the end falls back to the hash
+    };
+    sock_fprog program{static_cast<unsigned short>(sizeof(code) / sizeof(code[0])),code};
+    return setsockopt(listener,SOL_SOCKET,SO_ATTACH_REUSEPORT_CBPF,&program,sizeof(program)) == 0;
+#else
+    (void)listener;
+    (void)count;
+    return false;
+#endif
+}
 
-    void rem(const ClientDataPtr& user)
+// CPU,CPU,...
+bool parse_cpus(const std::string& text, std::vector<int>& cpus)
+{
+    std::stringstream stream(text);
+    std::string cpu;
+    try
     {
-        if (administrators.count(user->socket))
-            administrators.erase(user->socket);
-        wipe_slate(user);
-        by_socket.erase(user->socket);
-        by_name.erase(user->username);
-        leave(user);
-    }
-    void rem(SOCKET socket)
+        while (std::getline(stream,cpu,','))
+            cpus.push_back(std::stoi(cpu));
+    } catch (const std::exception&)
     {
-        if (administrators.count(socket))
-            administrators.erase(socket);
-        wipe_slate(by_socket.at(socket));
-        leave(by_socket.at(socket));
-        by_name.erase(by_socket.at(socket)->username);
-        by_socket.erase(socket);
-    }
-    void rem(const std::string& name)
-    {
-        if (administrators.count(by_name.at(name)->socket))
-            administrators.erase(by_name.at(name)->socket);
-        wipe_slate(by_name.at(name));
-        leave(by_name.at(name));
-        by_socket.erase(by_name.at(name)->socket);
-        by_name.erase(name);
-    }
-
-    const ChatRoom& room(SOCKET socket)
-    {
-        return rooms.at(by_socket.at(socket)->room);
+        return false;
     }
-};
+    return !cpus.empty();
+}
 
-SOCKET m_listener_socket;
-fd_set m_sockets;
-Database m_users{};
-bool isRunning = true;
-std::string authcode = DEFAULT_AUTHENTICATION_CODE;
+// Pins the calling thread, threads it starts afterwards inherit the same set
+bool pin_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus)
+        CPU_SET(cpu,&set);
+    return sched_setaffinity(0,sizeof(set),&set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
 
-void print_clientdata(const ClientDataPtr& data)
+/*
+ * The loop gets a core of its own and the pools share the rest, a worker process takes the next core along
+ * Receive buffers for CAPACITY connections are made now, then everything is locked in memory so the
+ * loop never waits on a page fault. Freed memory stays with the process for the same reason
+ * Runs before the pools start so their threads land on the shared cores
+ */
+void enter_low_latency(size_t index, size_t capacity)
 {
-    char ip_address[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET,&data->network.sin_addr,ip_address,INET_ADDRSTRLEN);
-    SERVER_MESSAGE("IP Address: " << ip_address);
-    SERVER_MESSAGE("Port: " << ntohs(data->network.sin_port));
-    SERVER_MESSAGE("Username: " << data->username);
-    SERVER_MESSAGE("Socket: " << data->socket);
+    const int loop_cpu = m_cpus[index % m_cpus.size()];
+    std::vector<int> shared;
+    for (const int cpu : m_cpus)
+        if (cpu != loop_cpu) shared.push_back(cpu);
+    if (shared.empty()) shared.push_back(loop_cpu);
+    if (!pin_thread(shared)) LOG_WARNING("Could not pin the pools | " << GET_LAST_ERROR);
+
+    PACMAN::preallocate(capacity);
+#ifdef __linux__
+#ifdef __GLIBC__
+    mallopt(M_MMAP_MAX,0);
+    mallopt(M_TRIM_THRESHOLD,-1);
+#endif
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        LOG_WARNING("Could not lock memory, raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK | " << GET_LAST_ERROR);
+#endif
+    LOG_INFO("Low Latency | Loop on CPU " << loop_cpu << " | Buffers for " << capacity << " connections");
 }
 
-std::stringstream get_server_stream()
+// The loop thread itself, once the pools are running
+void pin_loop(size_t index)
 {
-    std::stringstream stream;
-    stream << "[SERVER] | ";
-    return stream;
+    if (!pin_thread({m_cpus[index % m_cpus.size()]})) LOG_WARNING("Could not pin the loop | " << GET_LAST_ERROR);
 }
 
-// Automatically adds the server tag
-void announce_all(const std::string& message)
+// Small messages go out as they're written and reads spin briefly instead of sleeping
+void tune_client(SOCKET client)
 {
-    for (const auto& user : m_users.by_socket)
-        PACMAN::send_message(user.first,MESSAGE,message);
+    const int on = 1;
+    setsockopt(client,IPPROTO_TCP,TCP_NODELAY,reinterpret_cast<const char*>(&on),sizeof(on));
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    const int busy = LOW_LATENCY_BUSY_POLL_US;
+    setsockopt(client,SOL_SOCKET,SO_BUSY_POLL,&busy,sizeof(busy));
+#endif
 }
 
-void announce_all_but(SOCKET socket, const std::string& message)
+// New connections finish their handshake off to the side, a client that connects and goes quiet holds up nobody
+Task greet(SOCKET new_client, sockaddr_in incoming)
 {
-    for (const auto& user : m_users.by_socket)
+    Scheduler& loop = m_core.m_loop;
+    const auto deadline = loop.now + std::chrono::seconds(HANDSHAKE_TIMEOUT_SECONDS);
+    SET_NONBLOCKING(new_client);
+
+    bool ready = true;
+    while (TLS::enabled() && ready)
     {
-        if (user.first == socket) continue;
-        PACMAN::send_message(user.first,MESSAGE,message);
+        const TLS::HANDSHAKE step = TLS::accept(new_client);
+        if (step == TLS::HANDSHAKE::DONE) break;
+        if (step == TLS::HANDSHAKE::FAILED) ready = false;
+        else if (step == TLS::HANDSHAKE::WANT_READ) ready = co_await loop.readable(new_client,deadline);
+        else ready = co_await loop.writable(new_client,deadline);
     }
+
+    // Segments can split it anywhere, so it's read up to its terminator rather than taken from one recv()
+    std::string handshake;
+    size_t end = std::string::npos;
+    char chunk[HANDSHAKE_MAX_BYTES];
+    while (ready && end == std::string::npos)
+    {
+        const int received = TLS::recv(new_client,chunk,sizeof(chunk));
+        if (received > 0)
+        {
+            handshake.append(chunk,static_cast<size_t>(received));
+            end = handshake.find(static_cast<char>(TAIL_CODE_END));
+            if (end == std::string::npos && handshake.size() >= HANDSHAKE_MAX_BYTES) ready = false;
+            continue;
+        }
+        if (received == 0 || !SOCKET_WOULD_BLOCK) ready = false;
+        else ready = co_await loop.readable(new_client,deadline);
+    }
+    if (!ready)
+    {
+        LOG_WARNING("Dropping connection that never finished its handshake | " << new_client);
+        TLS::release(new_client);
+        CLOSE_SOCKET(new_client);
+        co_return;
+    }
+
+    // Whatever came in behind it is the start of their first messages
+    if (end + 1 < handshake.size())
+    {
+        PACMAN::prime(new_client,handshake.substr(end + 1));
+        m_primed.insert(new_client);
+    }
+    handshake.resize(end);
+
+    // Passwords stay out of traffic logs, replays connect everyone as guests
+    m_recorder.record(TRAFFIC_EVENT::CONNECT,new_client,incoming,handshake.substr(0,handshake.find(static_cast<char>(LOGIN))));
+    m_core.connect(new_client,incoming,handshake); // Watched once the core lets them in
 }
 
-void announce_room(const std::string& room, const std::string& message)
+// What this pass has read so far, handled before anything else gets to change the Database
+void handle_received()
 {
-    const ChatRoom& theRoom = m_users.rooms[room];
-    for (const auto& user : theRoom.clients)
-        PACMAN::send_message(user.first,MESSAGE,message);
+    if (m_received.empty()) return;
+    m_core.receive_all(m_received);
+    m_received.clear();
 }
 
-void announce_room_but(SOCKET socket, const std::string& room, const std::string& message)
+// One read can carry several messages, select() won't tell us about the rest
+// They wait in m_received so a busy pass can prepare them in parallel
+void serve(SOCKET client)
 {
-    const ChatRoom& theRoom = m_users.rooms[room];
-    for (const auto& user : theRoom.clients)
+    do
     {
-        if (user.first == socket) continue;
-        PACMAN::send_message(user.first,MESSAGE,message);
+        const TRACE::Request traced("read",client);
+        std::string from_client;
+        const PACMAN::RECV_RETURN_CODE recv_result = PACMAN::receive_message(client,from_client);
+        switch (recv_result)
+        {
+            case PACMAN::RECV_RETURN_CODE::RECV_ERROR:
+            {
+                LOG_WARNING("Failure when receiving from client | " << client);
+                handle_received(); // What they sent before going still counts
+                m_recorder.record(TRAFFIC_EVENT::LOST,client,{},{});
+                m_core.lost(client);
+                continue;
+            }
+            case PACMAN::RECV_RETURN_CODE::RECV_ZERO_LEN:
+            {
+                handle_received();
+                m_recorder.record(TRAFFIC_EVENT::LOST,client,{},{});
+                m_core.lost(client);
+                continue;
+            }
+            case PACMAN::RECV_RETURN_CODE::RECV_WOULD_BLOCK:
+                return; // Half a message, select() brings us back for the rest
+            case PACMAN::RECV_RETURN_CODE::RECV_GOOD:
+                break;
+        }
+
+        m_recorder.record(TRAFFIC_EVENT::MESSAGE,client,{},from_client[0] == REGISTER ? from_client.substr(0,1) : from_client);
+        m_received.push_back(Received{client,std::move(from_client)});
     }
+    while (m_core.connected(client) && PACMAN::has_buffered_message(client));
 }
 
-void announce_all_friends(SOCKET socket, const std::string& message)
+// Primed sockets are served once the core has let them in, a refused one has had its bytes forgotten
+void serve_primed()
 {
-    const auto& fList = m_users.by_socket.at(socket)->friends;
-    for (const auto& f : fList)
-        PACMAN::send_message(f.first,MESSAGE,message);
+    for (auto primed = m_primed.begin(); primed != m_primed.end();)
+    {
+        const SOCKET client = *primed;
+        if (!PACMAN::buffered(client)) primed = m_primed.erase(primed);
+        else if (!m_transport.open.count(client)) ++primed; // Still logging in
+        else
+        {
+            primed = m_primed.erase(primed);
+            if (m_core.connected(client) && PACMAN::has_buffered_message(client)) serve(client);
+        }
+    }
 }
 
-void disconnect_user(SOCKET client)
+// Feeds a captured traffic log through the core with nothing but memory underneath
+int run_replay(const std::string& path)
 {
-    std::stringstream announcement = get_server_stream();
-    announcement << m_users.by_socket.at(client)->username << " has disconnected from the server.";
-    announce_all_but(client,announcement.str());
-    announcement = get_server_stream();
-    announcement << "Your friend " << m_users.by_socket.at(client)->username << " has disconnected from the server.";
-    announce_all_friends(client,announcement.str());
-//    const auto& room = m_users.room(client);
-//    for (const auto& user : room.clients)
-//    {
-//        if (user.first == client) continue;
-//        PACMAN::send_message(user.first,MESSAGE,announcement.str());
-//    }
-    SERVER_MESSAGE("Client Has Disconnected");
-    print_clientdata(m_users.by_socket.at(client));
-    m_users.rem(client);
-    FD_CLR(client,&m_sockets);
+    std::vector<TrafficEvent> events;
+    if (!load_traffic(path,events))
+    {
+        LOG_ERROR("Could not open traffic log | " << path);
+        return EXIT_FAILURE;
+    }
+    LOG_INFO("Replaying " << events.size() << " events from " << path);
+
+    LoopbackTransport loopback;
+    loopback.keep_frames = false;
+    ServerCore core{loopback};
+    core.seed(0);
+
+    std::streambuf* console = std::cout.rdbuf(nullptr); // Server chatter would drown out the timing
+    const ReplayStats stats = replay_traffic(events,core,loopback);
+    std::cout.rdbuf(console);
+
+    LOG_INFO("Events " << stats.events << " | Messages Sent " << stats.messages_sent << " | Bytes Sent " << stats.bytes_sent);
+    LOG_INFO("Took " << stats.seconds * 1000.0 << "ms | " << (stats.seconds > 0 ? stats.events / stats.seconds : 0) << " events/s");
+    return EXIT_SUCCESS;
 }
 
 int main(const int argc, char* argv[])
 {
     // Parse Console Arguments
+    // NETSERVER [PORT] [--record FILE] [--replay FILE] [--tls CERTIFICATE KEY]
+    //           [--cluster NODE BUS_PORT] [--peer NODE ADDRESS:PORT]... [--accounts FILE]
+    //           [--fanout THREADS] [--search-memory MEGABYTES] [--workers COUNT BUS_PORT] [--steer-by-address]
+    //           [--trace EVERY] [--memory-limit MEGABYTES] [--filter WORD_LIST] [--inbox FILE]
+    //           [--low-latency CPU,CPU... CAPACITY]
     int port = DEFAULT_PORT;
+    size_t fanout_threads = 0; // The loop thread always helps, this many more join it on big topics
+    size_t workers = 1;
+    int worker_bus_port = 0; // Worker N listens for the others on this plus N
+    bool steer = false;
+    int worker_index = 0;
+    size_t capacity = 0; // Connections low latency mode makes room for up front
     int result{};
-    if (argc > 1)
+    for (int i = 1; i < argc; ++i)
     {
-        port = std::stoi(argv[1]);
+        const std::string argument = argv[i];
+        if (argument == "--replay" && i + 1 < argc)
+            return run_replay(argv[++i]);
+        if (argument == "--record" && i + 1 < argc)
+        {
+            const std::string path = argv[++i];
+            if (!m_recorder.open(path))
+            {
+                LOG_ERROR("Could not open traffic log | " << path);
+                return EXIT_FAILURE;
+            }
+            LOG_INFO("Recording Traffic | " << path);
+            continue;
+        }
+        if (argument == "--cluster" && i + 2 < argc)
+        {
+            const uint32_t node = static_cast<uint32_t>(std::stoul(argv[++i]));
+            const int bus_port = std::stoi(argv[++i]);
+            if (!m_cluster.open(node,bus_port)) return EXIT_FAILURE;
+            m_core.attach(m_cluster);
+            LOG_INFO("Cluster Node " << node << " | Bus Port " << bus_port);
+            continue;
+        }
+        if (argument == "--peer" && i + 2 < argc)
+        {
+            const uint32_t node = static_cast<uint32_t>(std::stoul(argv[++i]));
+            sockaddr_in address;
+            if (!parse_peer(argv[++i],address))
+            {
+                LOG_ERROR("Peers look like ADDRESS:PORT | " << argv[i]);
+                return EXIT_FAILURE;
+            }
+            m_cluster.add_peer(node,address);
+            continue;
+        }
+        if (argument == "--accounts" && i + 1 < argc)
+        {
+            const std::string path = argv[++i];
+            if (!m_core.m_accounts.open(path)) return EXIT_FAILURE;
+            LOG_INFO("Accounts | " << path << " | " << m_core.m_accounts.size() << " registered | Hashing with " << HASH::backend());
+            continue;
+        }
+        if (argument == "--inbox" && i + 1 < argc)
+        {
+            const std::string path = argv[++i];
+            if (!m_core.m_inbox.open(path)) return EXIT_FAILURE;
+            LOG_INFO("Inbox | " << path << " | " << m_core.m_inbox.items() << " waiting for " << m_core.m_inbox.boxes() << " users");
+            continue;
+        }
+        if (argument == "--fanout" && i + 1 < argc)
+        {
+            fanout_threads = std::stoul(argv[++i]);
+            LOG_INFO("Fan-out Threads | " << fanout_threads);
+            continue;
+        }
+        if (argument == "--search-memory" && i + 1 < argc)
+        {
+            m_core.m_search.budget = std::stoull(argv[++i]) * 1024 * 1024;
+            LOG_INFO("Search Index Budget | " << argv[i] << " MiB");
+            continue;
+        }
+        if (argument == "--workers" && i + 2 < argc)
+        {
+            workers = std::max<size_t>(1,std::stoul(argv[++i]));
+            worker_bus_port = std::stoi(argv[++i]);
+            continue;
+        }
+        if (argument == "--low-latency" && i + 2 < argc)
+        {
+            if (!parse_cpus(argv[++i],m_cpus))
+            {
+                LOG_ERROR("CPUs look like 2,3,4 | " << argv[i]);
+                return EXIT_FAILURE;
+            }
+            capacity = std::min<size_t>(std::stoul(argv[++i]),FD_SETSIZE); // No more can be watched anyway
+            m_low_latency = true;
+            continue;
+        }
+        if (argument == "--steer-by-address")
+        {
+            steer = true;
+            continue;
+        }
+        if (argument == "--memory-limit" && i + 1 < argc)
+        {
+            m_core.m_memory.limit = std::stoull(argv[++i]) * 1024 * 1024;
+            LOG_INFO("Memory Limit | " << argv[i] << " MiB");
+            continue;
+        }
+        if (argument == "--filter" && i + 1 < argc)
+        {
+            m_core.m_filter.path = argv[++i];
+            m_core.m_filter.current = ContentFilter::compile(m_core.m_filter.path);
+            if (!m_core.m_filter.current)
+            {
+                LOG_ERROR("Could not read the filter word list | " << m_core.m_filter.path);
+                return EXIT_FAILURE;
+            }
+            LOG_INFO("Content Filter | " << m_core.m_filter.path << " | " << m_core.m_filter.current->patterns << " patterns");
+            continue;
+        }
+        if (argument == "--trace" && i + 1 < argc)
+        {
+            TRACE::set_rate(static_cast<uint32_t>(std::stoul(argv[++i])));
+            LOG_INFO("Tracing one request in " << TRACE::rate());
+            continue;
+        }
+        if (argument == "--tls" && i + 2 < argc)
+        {
+            const std::string certificate = argv[++i];
+            const std::string key = argv[++i];
+            if (!TLS::init_server(certificate,key)) return EXIT_FAILURE;
+            LOG_INFO("TLS Enabled | " << certificate);
+            continue;
+        }
+
+        port = std::stoi(argument);
         LOG_INFO("Custom Port | " << port);
         if (port > std::numeric_limits<uint16_t>::max())
         {
@@ -241,26 +525,54 @@ int main(const int argc, char* argv[])
         }
     }
 
-    // Initialize Server Variables
-    m_users.rooms.insert(std::make_pair(std::string{STARTING_ROOM_NAME}, ChatRoom{})); // Default Room
+    // Only registered names get mail, and one process owns the file
+    if (m_core.m_inbox.enabled() && (!m_core.m_accounts.enabled() || workers > 1 || m_cluster.enabled()))
+    {
+        LOG_ERROR("--inbox needs --accounts and a single server, leave out --workers and --cluster");
+        return EXIT_FAILURE;
+    }
 
     // Initialize winsock2
     SERVER_MESSAGE("Starting Up Server");
     WINSOCK_LINK
 
+    if (workers > 1)
+    {
+        if (m_cluster.enabled() || m_recorder.file.is_open())
+        {
+            LOG_ERROR("--workers runs its own cluster and can't share one traffic log, leave out --cluster and --record");
+            WINSOCK_CLEANUP;
+            return EXIT_FAILURE;
+        }
+        worker_index = spawn_workers(workers,worker_bus_port);
+        if (worker_index < 0)
+        {
+            stop_workers();
+            WINSOCK_CLEANUP;
+            return EXIT_FAILURE;
+        }
+    }
+
     /*
      * AF_INET | IPv4
      * SOCK_STREAM | Stream Data
      * IPPROTO_TCP | TCP Protocol
      */
     m_listener_socket = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-    if (0 > m_listener_socket)
+    if (INVALID_SOCKET == m_listener_socket)
     {
         LOG_ERROR("Failed To Create Listener Socket");
         WINSOCK_CLEANUP;
         return EXIT_FAILURE;
     }
     LOG_INFO("Created Listener Socket | " << m_listener_socket);
+#ifdef __linux__
+    if (workers > 1)
+    {
+        const int reuse = 1;
+        setsockopt(m_listener_socket,SOL_SOCKET,SO_REUSEPORT,&reuse,sizeof(reuse));
+    }
+#endif
 
     sockaddr_in server_info{};
     server_info.sin_family = AF_INET;
@@ -285,20 +597,96 @@ int main(const int argc, char* argv[])
         return EXIT_FAILURE;
     }
     LOG_INFO("Listening On Port | " << port);
+    // After listen(), that's when the socket joins the others on the port
+    if (workers > 1 && steer)
+    {
+        if (steer_by_address(m_listener_socket,workers)) LOG_INFO("Steering clients to workers by address");
+        else LOG_WARNING("Could not attach the steering program, the kernel hashes connections instead | " << GET_LAST_ERROR);
+    }
 
+    // The datagram channel is optional, chat still works without it
+    // Workers go without, a datagram could reach any of them and only one holds the session
+    if (workers > 1)
+        LOG_INFO("Datagram channel off with workers");
+    else
+    {
+        m_datagram_socket = socket(AF_INET,SOCK_DGRAM,IPPROTO_UDP);
+        if (INVALID_SOCKET == m_datagram_socket ||
+            0 > bind(m_datagram_socket,reinterpret_cast<sockaddr*>(&server_info),sizeof(server_info)))
+        {
+            LOG_WARNING("Datagram channel unavailable | " << GET_LAST_ERROR);
+            if (INVALID_SOCKET != m_datagram_socket) CLOSE_SOCKET(m_datagram_socket);
+            m_datagram_socket = INVALID_SOCKET;
+        }
+        else
+        {
+            SET_NONBLOCKING(m_datagram_socket);
+            LOG_INFO("Datagram Channel On Port | " << port);
+        }
+    }
 
-    FD_ZERO(&m_sockets);
-    FD_SET(m_listener_socket,&m_sockets);
+    m_transport.watch(m_listener_socket);
+    if (INVALID_SOCKET != m_datagram_socket)
+        m_transport.watch(m_datagram_socket);
+    m_core.datagrams_enabled = INVALID_SOCKET != m_datagram_socket;
+    if (!m_core.m_loop.open_wake())
+        LOG_WARNING("No wake socket, handlers on worker threads resume on the next pass | " << GET_LAST_ERROR);
+    if (m_low_latency) enter_low_latency(static_cast<size_t>(worker_index),capacity);
+    m_core.m_workers.start(std::max<size_t>(MIN_HANDLER_THREADS,std::thread::hardware_concurrency()));
+    m_core.m_fanout.start(fanout_threads);
+    m_core.m_search.start();
+    if (m_low_latency) pin_loop(static_cast<size_t>(worker_index));
+#ifdef SIGUSR1
+    std::signal(SIGUSR1,[](int) { m_trace_requested = 1; });
+#endif
+#ifdef SIGHUP
+    if (!m_core.m_filter.path.empty())
+        std::signal(SIGHUP,[](int) { m_filter_requested = 1; });
+#endif
 
     int exit_code = EXIT_SUCCESS;
-    while (isRunning)
+    while (m_core.isRunning)
     {
+        if (m_trace_requested)
+        {
+            m_trace_requested = 0;
+            ServerCore::dump_trace();
+        }
+        if (m_filter_requested)
+        {
+            m_filter_requested = 0;
+            m_core.reload_filter();
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        m_core.tick(now);
+        serve_primed(); // Handshakes that finished last pass
+        handle_received();
+        if (m_cluster.enabled())
+        {
+            m_cluster.tick(now);
+            drain_cluster();
+            m_cluster.flush(); // Everything the last pass queued for the other nodes
+        }
+
+        // Never sleep past the next handler deadline
+        // Low latency spins instead, the loop has its core to itself
+        const auto wait = m_low_latency ? std::chrono::milliseconds(0) : m_core.m_loop.timeout(std::chrono::milliseconds(1000));
         timeval timeout{};
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        fd_set temp_set = m_sockets;
+        timeout.tv_sec = static_cast<long>(wait.count() / 1000);
+        timeout.tv_usec = static_cast<long>(wait.count() % 1000 * 1000);
+        fd_set temp_set = m_transport.watched;
+        fd_set write_set;
+        FD_ZERO(&write_set);
+        SOCKET highest = m_transport.highest();
+        m_cluster.fill(temp_set,highest);
+        m_core.m_loop.fill(temp_set,write_set,highest);
+        const bool writing = m_transport.fill_writes(write_set,highest) || m_core.m_loop.has_writers();
         // Check for Incoming Connections on the listener socket
-        const int check = select(0,&temp_set,nullptr,nullptr,&timeout);
+        const int check = select(static_cast<int>(highest) + 1,&temp_set,writing ? &write_set : nullptr,nullptr,&timeout);
+#ifdef EINTR
+        if (0 > check && errno == EINTR) continue; // A signal, most likely somebody asking for a trace
+#endif
         if (0 > check)
         {
             LOG_ERROR("Failure with select() | ERROR: " << GET_LAST_ERROR << " LINE: " << __LINE__);
@@ -308,307 +696,74 @@ int main(const int argc, char* argv[])
         if (0 == check) // select() timeout
             continue;
 
-        for (int i = 0; i < temp_set.fd_count; ++i)
+        // select() may have slept a while, deadlines set by the handlers below count from now
+        m_core.tick(std::chrono::steady_clock::now());
+        m_cluster.service(temp_set);
+        drain_cluster();
         {
-            const SOCKET client = temp_set.fd_array[i];
+            const TRACE::Request traced("flush");
+            m_transport.flush(write_set); // Backed up connections that have room again
+        }
+
+        // Copy, handlers can close sockets while we go
+        const std::vector<SOCKET> ready(m_transport.open.begin(),m_transport.open.end());
+        for (const SOCKET client : ready)
+        {
+            if (!FD_ISSET(client,&temp_set)) continue;
+            if (client == m_datagram_socket)
+            {
+                handle_received();
+                std::vector<DATAGRAM::Datagram> incoming;
+                std::vector<DATAGRAM::Datagram> outgoing;
+                DATAGRAM::receive_batch(m_datagram_socket,incoming);
+                m_core.datagrams(incoming,outgoing);
+                DATAGRAM::send_batch(m_datagram_socket,outgoing);
+                continue;
+            }
             if (client != m_listener_socket)
             {
-                std::string from_client;
-                const PACMAN::RECV_RETURN_CODE recv_result = PACMAN::receive_message(client,from_client);
-                switch (recv_result)
-                {
-                    case PACMAN::RECV_RETURN_CODE::RECV_ERROR:
-                    {
-                        LOG_WARNING("Failure when receiving from client");
-                        print_clientdata(m_users.by_socket.at(client));
-                        continue;
-                    }
-                    case PACMAN::RECV_RETURN_CODE::RECV_ZERO_LEN:
-                    {
-                        disconnect_user(client);
-                        continue;
-                    }
-                    case PACMAN::RECV_RETURN_CODE::RECV_GOOD:
-                        break;
-                }
-
-                // Parse Incoming Messages
-                switch (from_client[0])
-                {
-                    case DISCONNECT:
-                    {
-                        disconnect_user(client);
-                        continue;
-                    }
-                    case MESSAGE:
-                    {
-                        // Print out what the client sent over
-                        std::stringstream formatted_message;
-                        formatted_message << '[' << m_users.by_socket.at(client)->username << "] | " << from_client.c_str()+1;
-                        const auto& room = m_users.room(client);
-                        for (const auto& user : room.clients)
-                        {
-                            if (user.second->socket == client) continue;
-                            PACMAN::send_message(user.first, MESSAGE,formatted_message.str());
-                        }
-                        SERVER_MESSAGE(formatted_message.str());
-                        continue;
-                    }
-                    case JOIN_ROOM:
-                    {
-                        const std::string& username = m_users.by_socket.at(client)->username;
-                        if (from_client.size() <= 1)
-                        {
-                            LOG_WARNING(username << " asked to join with no room name.");
-                            std::stringstream stream = get_server_stream();
-                            stream << "You need to give a room name";
-                            PACMAN::send_message(client,MESSAGE,stream.str());
-                            continue;
-                        }
-                        std::string roomname = from_client.c_str()+2;
-
-                        const ChatRoom& afterRoom = m_users.rooms[roomname];
-                        const ChatRoom& beforeRoom = m_users.room(client);
-                        m_users.move(client,roomname);
-
-                        std::stringstream joinMessage = get_server_stream();
-                        joinMessage << username << " has joined " << afterRoom.name;
-                        for (const auto& user : afterRoom.clients)
-                        {
-                            if (user.first == client) continue;
-                            PACMAN::send_message(user.first,MESSAGE,joinMessage.str());
-                        }
-                        std::stringstream leaveMessage = get_server_stream();
-                        leaveMessage << username << " has left " << beforeRoom.name;
-                        for (const auto& user : beforeRoom.clients)
-                            PACMAN::send_message(user.first,MESSAGE,leaveMessage.str());
-
-                        SERVER_MESSAGE(m_users.by_socket.at(client)->username << " Has Moved To " << roomname);
-
-                        continue;
-                    }
-                    case AUTHENTICATE:
-                    {
-                        std::string provided_code = from_client.c_str()+2;
-                        const std::string& author = m_users.by_socket.at(client)->username;
-
-                        if (provided_code == authcode)
-                        {
-                            m_users.administrators.insert(std::make_pair(client,m_users.by_socket.at(client)));
-                            SERVER_MESSAGE(author << " has authenticated as Administrator");
-                            PACMAN::send_message(client,MESSAGE, "You are now an administrator.");
-                            continue;
-                        }
-
-                        SERVER_MESSAGE(author << " attempted to authenticate as Administrator with code " << provided_code);
-                        PACMAN::send_message(client,MESSAGE, "You have entered an invalid code.");
-                        continue;
-                    }
-                    case FRIEND_REQUEST:
-                    {
-                        std::string userToFriend = from_client.c_str()+2;
-                        const auto& senderData = m_users.by_socket.at(client);
-                        const std::string& sender = senderData->username;
-                        if (userToFriend == sender) // Self send
-                        {
-                            std::stringstream warn = get_server_stream();
-                            warn << "You cannot send a friend request to yourself.";
-                            SERVER_MESSAGE(sender << " tried to befriend himself");
-                            PACMAN::send_message(client, MESSAGE, warn.str());
-                            continue;
-                        }
-                        if (!m_users.by_name.count(userToFriend)) // Possible Send
-                        {
-                            std::stringstream errormsg = get_server_stream();
-                            errormsg << userToFriend << " does not exist.";
-                            SERVER_MESSAGE(sender << " tried to send a friend request to unknown user " << userToFriend);
-                            PACMAN::send_message(client,MESSAGE,errormsg.str());
-                            continue;
-                        }
-                        const auto& userToFriendData = m_users.by_name.at(userToFriend);
-                        if (userToFriendData->pending.count(senderData->socket))
-                        {
-                            std::stringstream errormsg = get_server_stream();
-                            errormsg << "You have already sent a friend request to this person";
-                            SERVER_MESSAGE(sender << " sent a duplicate friend request to " << userToFriend);
-                            PACMAN::send_message(client,MESSAGE,errormsg.str());
-                            continue;
-                        }
-                        if (senderData->friends.count(userToFriendData->socket))
-                        {
-                            std::stringstream errormsg = get_server_stream();
-                            errormsg << "You are already friends with " << userToFriend;
-                            SERVER_MESSAGE(sender << " tried to befriend " << userToFriend << " again");
-                            PACMAN::send_message(client,MESSAGE,errormsg.str());
-                            continue;
-                        }
-                        bool friendStatus = m_users.befriend(client,userToFriend);
-                        if (friendStatus)
-                        {
-                            std::stringstream updateThem = get_server_stream();
-                            updateThem << sender << " has accepted your friend request.";
-                            std::stringstream updateClient = get_server_stream();
-                            updateClient << "You are now friends with " << userToFriend << '.';
-                            SERVER_MESSAGE(sender << " is now friends with " << userToFriend);
-                            PACMAN::send_message(m_users.by_name.at(userToFriend)->socket,MESSAGE,updateThem.str());
-                            PACMAN::send_message(client,MESSAGE,updateClient.str());
-                            continue;
-                        }
-
-                        std::stringstream noticeThem = get_server_stream();
-                        noticeThem << sender << " has sent you a friend request.";
-                        std::stringstream noticeMe = get_server_stream();
-                        noticeMe << "You have sent a friend request to " << userToFriend << '.';
-
-                        PACMAN::send_message(m_users.by_name.at(userToFriend)->socket,MESSAGE,noticeThem.str());
-                        PACMAN::send_message(client,MESSAGE,noticeMe.str());
-                        continue;
-                    }
-                    case FRIENDS_LIST:
-                    {
-                        std::stringstream flist = get_server_stream();
-                        const auto& who = m_users.by_socket.at(client);
-                        flist << "Friends:" << std::endl;
-                        for (const auto& f : who->friends)
-                        {
-                            flist << '\t' <<  f.second->username;
-                            flist << std::endl;
-                        }
-                        flist << "Pending:";
-                        for (const auto& p : who->pending)
-                        {
-                            flist << std::endl;
-                            flist << '\t' << m_users.by_socket.at(p.first)->username;
-                        }
-                        flist << std::endl;
-                        PACMAN::send_message(client,MESSAGE,flist.str());
-                        continue;
-                    }
-                    case ROOM_LIST:
-                    {
-                        std::stringstream list = get_server_stream();
-                        list << "Room List:" << std::endl;
-
-                        const auto& room = m_users.room(client);
-                        for (const auto& user : room.clients)
-                        {
-                            list << '\t' <<  user.second->username;
-                            list << std::endl;
-                        }
-
-                        PACMAN::send_message(client,MESSAGE,list.str());
-                        continue;
-                    }
-                    case WHISPER:
-                    {
-                        std::string rest_of_the_message = from_client.c_str()+2;
-                        auto iter = rest_of_the_message.find(' ');
-                        std::string target = rest_of_the_message.substr(0,iter);
-                        std::string message = rest_of_the_message.substr(iter);
-                        if (target == m_users.by_socket.at(client)->username)
-                        {
-                            std::stringstream stream = get_server_stream();
-                            stream << "You cannot whisper to yourself.";
-                            SERVER_MESSAGE(m_users.by_socket.at(client)->username << " attempted to whisper to himself");
-                            PACMAN::send_message(client,MESSAGE,stream.str());
-                            continue;
-                        }
-
-                        if (!m_users.by_name.count(target))
-                        {
-                            std::stringstream stream = get_server_stream();
-                            stream << target << " does not exist.";
-                            SERVER_MESSAGE(m_users.by_socket.at(client)->username << " attempted to whisper to someone who doesn't exist");
-                            PACMAN::send_message(client,MESSAGE,stream.str());
-                            continue;
-                        }
-                        const auto& targetData = m_users.by_name.at(target);
-                        std::stringstream whisper;
-                        whisper << "[WHISPER FROM " << m_users.by_socket.at(client)->username << "] | " << message;
-                        PACMAN::send_message(targetData->socket,MESSAGE,whisper.str());
-
-                        continue;
-                    }
-                    case ADMIN_SHUTOFF:
-                    {
-                        if (!m_users.administrators.count(client))
-                        {
-                            SERVER_MESSAGE(m_users.by_socket.at(client)->username << " issued a shutdown request as a normal user");
-                            PACMAN::send_message(client, MESSAGE, "You have to be an administrator to do this action.");
-                            continue;
-                        }
-                        std::stringstream msg = get_server_stream();
-                        msg << "Server shutdown has been issued";
-                        announce_all(msg.str());
-                        isRunning = false;
-                        continue;
-                    }
-                    case ADMIN_ANNOUNCE:
-                    {
-                        if (!m_users.administrators.count(client))
-                        {
-                            SERVER_MESSAGE(m_users.by_socket.at(client)->username << " issued an announcement request as a normal user");
-                            PACMAN::send_message(client, MESSAGE, "You have to be an administrator to do this action.");
-                            continue;
-                        }
-                        std::string msg = from_client.c_str() + 2;
-                        std::stringstream announcement = get_server_stream();
-                        announcement << msg;
-                        announce_all(announcement.str());
-                        continue;
-                    }
-                    default:
-                        LOG_WARNING("Received Unrecognised Code | " << from_client[0]);
-                        break;
-                }
+                if (!m_core.connected(client)) continue; // Removed earlier in this pass
+                serve(client);
                 continue; // Skip self socket
             }
 
             // If the listener has incoming connections
+            handle_received(); // A greeting can finish right away and add somebody
             sockaddr_in incoming{};
             sockaddr_length incoming_size = sizeof(incoming);
             const SOCKET new_client = accept(m_listener_socket,reinterpret_cast<sockaddr*>(&incoming),&incoming_size);
-            char username_buffer[64]{'\0'};
-            recv(new_client,username_buffer,63,0);
-
-            // Add Client to Database
-            SERVER_MESSAGE("Client Has Connected");
-            ClientDataPtr new_client_data = std::make_shared<ClientData>(std::string(username_buffer),STARTING_ROOM_NAME,new_client,incoming);
-            bool exist = m_users.add(new_client_data);
-            if (!exist)
+            if (INVALID_SOCKET == new_client) continue;
+            if (!SOCKET_SELECTABLE(new_client))
             {
-                SERVER_MESSAGE("Attempted join from User with conflicting names | NAME: " << new_client_data->username);
-                PACMAN::send_message(new_client,REFUSE_CONNECTION,"This username is taken");
+                LOG_WARNING("Out of room for connections select() can watch, turning one away | " << new_client);
                 CLOSE_SOCKET(new_client);
                 continue;
             }
-            print_clientdata(new_client_data);
-
-            // Hard Coding Tags ([TAG]), no time for rewrite
-            std::stringstream welcome_msg = get_server_stream();
-            welcome_msg << "Welcome " << new_client_data->username << ". You are in room HOMEROOM.";
-            PACMAN::send_message(new_client,MESSAGE,welcome_msg.str());
-
-            std::stringstream announcement_msg = get_server_stream();
-            announcement_msg << new_client_data->username << " has joined the server.";
-            announce_all_but(new_client, announcement_msg.str());
-
-            FD_SET(new_client,&m_sockets);
+            PACMAN::size_buffers(new_client,PACMAN::LINK::INTERACTIVE);
+            if (m_low_latency) tune_client(new_client);
+            greet(new_client,incoming);
         }
+        handle_received();
+        // Last, a handler that resumes here may add sockets the set above knows nothing about
+        m_core.m_loop.dispatch(temp_set,write_set);
+        m_recorder.flush(); // Once per pass so a killed server still leaves a usable log
+        m_core.m_inbox.flush(); // Same for whatever was queued for people who are away
     }
 
     LOG_INFO("Server Closing");
 
 EXIT_POINT:
-    for (int i = 0; i < m_sockets.fd_count; ++i)
-    {
-        if (m_sockets.fd_array[i] == m_listener_socket)
-        {
-            CLOSE_SOCKET(m_sockets.fd_array[i]);
-            continue;
-        }
-        disconnect_user(m_sockets.fd_array[i]);
-    }
+    m_core.shutdown();
+    m_core.m_workers.stop();
+    m_core.m_fanout.stop();
+    m_core.m_search.stop();
+    m_core.m_inbox.flush(); // Requests stashed by the goodbyes above
+    m_cluster.flush(); // Directory releases, best effort
+    m_cluster.shutdown();
+    CLOSE_SOCKET(m_listener_socket);
+    if (INVALID_SOCKET != m_datagram_socket)
+        CLOSE_SOCKET(m_datagram_socket);
+    stop_workers();
     WINSOCK_CLEANUP;
     return exit_code;
 }
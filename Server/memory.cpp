@@ -0,0 +1,65 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+bool MemoryGuard::due(std::chrono::steady_clock::time_point now)
+{
+    if (now < next_check) return false;
+    next_check = now + std::chrono::milliseconds(MEMORY_CHECK_MS);
+    return true;
+}
+
+PRESSURE MemoryGuard::level(size_t total) const
+{
+    if (!limit) return PRESSURE::NORMAL;
+    if (total >= static_cast<size_t>(static_cast<double>(limit) * MEMORY_CRITICAL_WATER)) return PRESSURE::CRITICAL;
+    if (total >= static_cast<size_t>(static_cast<double>(limit) * MEMORY_HIGH_WATER)) return PRESSURE::HIGH;
+    return PRESSURE::NORMAL;
+}
+
+std::vector<SOCKET> MemoryGuard::assess(std::vector<MemoryUsage>& usage, size_t total)
+{
+    accounted = total;
+    resident = resident_bytes();
+    std::vector<SOCKET> evict;
+
+    for (auto& entry : usage)
+    {
+        if (entry.bytes <= connection_limit) continue;
+        evict.push_back(entry.socket);
+        total -= entry.bytes;
+        entry.bytes = 0;
+    }
+
+    // Only the worst few per check, the next one sees what these freed
+    const size_t high = static_cast<size_t>(static_cast<double>(limit) * MEMORY_HIGH_WATER);
+    if (level(total) == PRESSURE::CRITICAL)
+    {
+        const size_t count = std::min<size_t>(usage.size(),MEMORY_EVICTIONS_PER_CHECK);
+        std::partial_sort(usage.begin(),usage.begin() + static_cast<std::ptrdiff_t>(count),usage.end(),
+                          [](const MemoryUsage& a, const MemoryUsage& b) { return a.bytes > b.bytes; });
+        for (size_t i = 0; i < count && total > high && usage[i].bytes; ++i)
+        {
+            evict.push_back(usage[i].socket);
+            total -= usage[i].bytes;
+        }
+    }
+    pressure = level(total);
+    evicted += evict.size();
+    return evict;
+}
+
+size_t MemoryGuard::resident_bytes()
+{
+#ifdef __linux__
+    // Second field is resident pages
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident_pages = 0;
+    if (!(statm >> pages >> resident_pages)) return 0;
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
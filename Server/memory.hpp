@@ -0,0 +1,72 @@
+#ifndef NETWORK_MEMORY_HPP
+#define NETWORK_MEMORY_HPP
+
+#include "os_diff.hpp"
+
+#include <vector>
+#include <chrono>
+#include <cstddef>
+
+#define MEMORY_CHECK_MS 250
+#define MEMORY_CONNECTION_LIMIT (16 * 1024 * 1024) // One connection past this goes whatever the rest look like
+#define MEMORY_HIGH_WATER 0.75 // New connections are refused and server wide broadcasts shed
+#define MEMORY_CRITICAL_WATER 0.9 // The biggest connections get evicted until it's back under the high water mark
+#define MEMORY_EVICTIONS_PER_CHECK 8
+#define MEMORY_MAP_NODE 64 // Rough cost of one std::map entry with its node
+#define MEMORY_ROOM_BYTES 256
+#define MEMORY_TOPIC_BYTES 128 // One subscription, its place in both indexes and the topic's name
+
+/*
+ * What every connection costs the server, estimated from its buffers, queues, session and friend state
+ * Checked on a timer rather than tracked byte by byte, the numbers only have to be good enough to pick who goes
+ * Without a global limit only the per connection one applies
+ */
+
+enum class PRESSURE
+{
+    NORMAL,
+    HIGH,
+    CRITICAL
+};
+
+inline const char* pressure_name(PRESSURE pressure)
+{
+    switch (pressure)
+    {
+        case PRESSURE::NORMAL: return "normal";
+        case PRESSURE::HIGH: return "high";
+        default: return "critical";
+    }
+}
+
+struct MemoryUsage
+{
+    SOCKET socket;
+    size_t bytes;
+};
+
+struct MemoryGuard
+{
+    size_t limit = 0; // Whole server, 0 for none
+    size_t connection_limit = MEMORY_CONNECTION_LIMIT;
+    PRESSURE pressure = PRESSURE::NORMAL;
+    std::chrono::steady_clock::time_point next_check{};
+
+    // As of the last check
+    size_t accounted = 0;
+    size_t resident = 0;
+
+    // Since startup
+    size_t refused = 0;
+    size_t shed = 0;
+    size_t evicted = 0;
+
+    bool due(std::chrono::steady_clock::time_point now);
+    // Sets the pressure from total and returns who has to go, worst first
+    std::vector<SOCKET> assess(std::vector<MemoryUsage>& usage, size_t total);
+    PRESSURE level(size_t total) const;
+
+    static size_t resident_bytes(); // 0 where the platform doesn't say
+};
+
+#endif //NETWORK_MEMORY_HPP
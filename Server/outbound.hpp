@@ -0,0 +1,118 @@
+#ifndef NETWORK_OUTBOUND_HPP
+#define NETWORK_OUTBOUND_HPP
+
+#include "NETWORK_CODES.hpp"
+#include "packet_sender.hpp"
+
+#include <string>
+#include <deque>
+#include <cstddef>
+
+#define OUTBOUND_MAX_QUEUED (4 * 1024 * 1024) // Past this room and bulk traffic gets dropped for the connection
+#define OUTBOUND_BULK_SIZE (4 * PACMAN::packet_size) // Direct replies bigger than this don't get to cut in line
+
+/*
+ * What a connection sends while its socket is backed up
+ * Control frames go first, the rest share the wire by deficit round robin so a pile of broadcasts
+ * can't hold up a whisper. Only whole messages get reordered, frames of two messages never interleave
+ */
+
+enum class TRAFFIC_CLASS : unsigned char
+{
+    CONTROL, // Session and connection management, always first
+    DIRECT,  // Whispers and replies to the user
+    ROOM,    // Rooms and topics they are in
+    BULK     // Server wide announcements and big listings
+};
+
+constexpr size_t TRAFFIC_CLASSES = 4;
+
+// Byte budget each class earns per round, CONTROL isn't part of the rotation
+constexpr size_t TRAFFIC_QUANTUM[TRAFFIC_CLASSES] = {0,16 * 1024,8 * 1024,2 * 1024};
+
+inline TRAFFIC_CLASS classify(NETWORK_CODE header, size_t size)
+{
+    switch (header)
+    {
+        case DISCONNECT:
+        case REFUSE_CONNECTION:
+        case SESSION_TOKEN:
+        case SESSION_RESUME:
+        case DATAGRAM_SESSION:
+        case FRAME_SIZE:
+            return TRAFFIC_CLASS::CONTROL;
+        default:
+            return size > OUTBOUND_BULK_SIZE ? TRAFFIC_CLASS::BULK : TRAFFIC_CLASS::DIRECT;
+    }
+}
+
+struct OutboundQueue
+{
+    struct Pending
+    {
+        std::string frames;
+        bool tracked; // Counts towards the session's sequence once it reaches the wire
+    };
+
+    std::deque<Pending> classes[TRAFFIC_CLASSES];
+    size_t deficit[TRAFFIC_CLASSES]{};
+    size_t cursor = static_cast<size_t>(TRAFFIC_CLASS::DIRECT);
+    size_t queued = 0; // Bytes waiting, not counting current
+
+    std::string current; // Partly written, has to finish before anything else starts
+    size_t offset = 0;
+    bool broken = false; // Send failed, the read side will notice and clean up
+
+    bool idle() const { return offset == current.size() && queued == 0; }
+    bool writing() const { return offset < current.size(); }
+
+    bool push(TRAFFIC_CLASS type, std::string frames, bool tracked)
+    {
+        if (queued > OUTBOUND_MAX_QUEUED && type >= TRAFFIC_CLASS::ROOM) return false;
+        queued += frames.size();
+        classes[static_cast<size_t>(type)].push_back(Pending{std::move(frames),tracked});
+        return true;
+    }
+
+    // Next message for the wire, false when there's nothing left
+    bool next(Pending& out)
+    {
+        auto& control = classes[static_cast<size_t>(TRAFFIC_CLASS::CONTROL)];
+        if (!control.empty()) return take(control,out);
+        if (queued == 0) return false;
+
+        for (;;)
+        {
+            auto& queue = classes[cursor];
+            if (queue.empty())
+            {
+                deficit[cursor] = 0; // Idle classes don't bank credit
+                advance();
+                continue;
+            }
+            if (queue.front().frames.size() <= deficit[cursor])
+            {
+                deficit[cursor] -= queue.front().frames.size();
+                return take(queue,out);
+            }
+            deficit[cursor] += TRAFFIC_QUANTUM[cursor];
+            advance();
+        }
+    }
+
+private:
+    bool take(std::deque<Pending>& queue, Pending& out)
+    {
+        out = std::move(queue.front());
+        queue.pop_front();
+        queued -= out.frames.size();
+        return true;
+    }
+
+    void advance()
+    {
+        cursor = cursor + 1 < TRAFFIC_CLASSES ? cursor + 1 : static_cast<size_t>(TRAFFIC_CLASS::DIRECT);
+    }
+};
+
+#endif //NETWORK_OUTBOUND_HPP
@@ -0,0 +1,184 @@
+#ifndef NETWORK_PUBSUB_HPP
+#define NETWORK_PUBSUB_HPP
+
+#include "packet_sender.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+/*
+ * Topics replace the one-room-per-client model
+ * Rooms, friend presence, administrators and the whole server are all topics
+ * A connection can be subscribed to any number of them
+ * A topic is forgotten once its last subscriber goes, its id is handed to the next new one
+ */
+
+typedef uint32_t TopicId;
+
+#define GLOBAL_TOPIC "all"
+#define ADMIN_TOPIC "admin"
+
+inline std::string room_topic(const std::string& room) { return "room:" + room; }
+inline std::string friends_topic(const std::string& username) { return "friends:" + username; }
+
+struct TopicRegistry
+{
+    std::unordered_map<std::string,TopicId> ids;
+    std::vector<std::string> names;
+    std::vector<std::vector<SOCKET>> subscribers;
+    std::map<SOCKET,std::vector<TopicId>> subscriptions;
+    std::vector<TopicId> free_ids;
+    // Fires when a topic gets its first subscriber or loses its last one
+    std::function<void(const std::string&, bool)> on_interest;
+
+    TopicId intern(const std::string& name)
+    {
+        const auto found = ids.find(name);
+        if (found != ids.end()) return found->second;
+        if (!free_ids.empty())
+        {
+            const TopicId id = free_ids.back();
+            free_ids.pop_back();
+            ids.emplace(name,id);
+            names[id] = name;
+            return id;
+        }
+        const TopicId id = static_cast<TopicId>(names.size());
+        ids.emplace(name,id);
+        names.emplace_back(name);
+        subscribers.emplace_back();
+        return id;
+    }
+
+    size_t count() const { return names.size() - free_ids.size(); }
+
+    const std::vector<TopicId>& subscriptions_of(SOCKET socket) const
+    {
+        static const std::vector<TopicId> none;
+        const auto found = subscriptions.find(socket);
+        return found == subscriptions.end() ? none : found->second;
+    }
+
+    bool find(const std::string& name, TopicId& id) const
+    {
+        const auto found = ids.find(name);
+        if (found == ids.end()) return false;
+        id = found->second;
+        return true;
+    }
+
+    bool subscribed(SOCKET socket, TopicId topic) const
+    {
+        const auto found = subscriptions.find(socket);
+        if (found == subscriptions.end()) return false;
+        return std::find(found->second.begin(),found->second.end(),topic) != found->second.end();
+    }
+
+    bool subscribe(SOCKET socket, TopicId topic)
+    {
+        if (subscribed(socket,topic)) return false;
+        subscribers[topic].push_back(socket);
+        subscriptions[socket].push_back(topic);
+        if (subscribers[topic].size() == 1) interest(topic,true);
+        return true;
+    }
+
+    bool unsubscribe(SOCKET socket, TopicId topic)
+    {
+        if (!subscribed(socket,topic))
+        {
+            release(topic); // Interned just to ask
+            return false;
+        }
+        erase_unordered(subscribers[topic],socket);
+        auto& list = subscriptions[socket];
+        erase_unordered(list,topic);
+        if (list.empty()) subscriptions.erase(socket);
+        if (subscribers[topic].empty()) interest(topic,false);
+        release(topic);
+        return true;
+    }
+
+    // Unsubscribes a connection from everything
+    void drop(SOCKET socket)
+    {
+        const auto found = subscriptions.find(socket);
+        if (found == subscriptions.end()) return;
+        for (const TopicId topic : found->second)
+        {
+            erase_unordered(subscribers[topic],socket);
+            if (subscribers[topic].empty()) interest(topic,false);
+            release(topic);
+        }
+        subscriptions.erase(found);
+    }
+
+    // Unsubscribes everyone from a topic
+    void clear(TopicId topic)
+    {
+        if (subscribers[topic].empty())
+        {
+            release(topic);
+            return;
+        }
+        for (const SOCKET socket : subscribers[topic])
+        {
+            auto& list = subscriptions[socket];
+            erase_unordered(list,topic);
+            if (list.empty()) subscriptions.erase(socket);
+        }
+        subscribers[topic].clear();
+        interest(topic,false);
+        release(topic);
+    }
+
+    // Moves every subscription over when a connection changes socket
+    void rekey(SOCKET from, SOCKET to)
+    {
+        const auto found = subscriptions.find(from);
+        if (found == subscriptions.end()) return;
+        for (const TopicId topic : found->second)
+            std::replace(subscribers[topic].begin(),subscribers[topic].end(),from,to);
+        std::vector<TopicId> list = std::move(found->second);
+        subscriptions.erase(found);
+        subscriptions[to] = std::move(list);
+    }
+
+    const std::vector<SOCKET>& subscribers_of(TopicId topic) const
+    {
+        return subscribers[topic];
+    }
+
+private:
+    void interest(TopicId topic, bool on)
+    {
+        if (on_interest) on_interest(names[topic],on);
+    }
+
+    // Nobody is listening, the name goes and the id is free for the next topic
+    void release(TopicId topic)
+    {
+        if (!subscribers[topic].empty() || names[topic].empty()) return;
+        ids.erase(names[topic]);
+        std::string().swap(names[topic]);
+        subscribers[topic].shrink_to_fit();
+        free_ids.push_back(topic);
+    }
+
+    // Order does not matter so swap with the back instead of shifting
+    template <typename T>
+    static void erase_unordered(std::vector<T>& list, const T& value)
+    {
+        const auto found = std::find(list.begin(),list.end(),value);
+        if (found == list.end()) return;
+        *found = list.back();
+        list.pop_back();
+    }
+};
+
+#endif //NETWORK_PUBSUB_HPP
@@ -0,0 +1,355 @@
+#include "search.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#define SEARCH_MAX_QUEUED 100000 // Past this the indexer is hopelessly behind, new messages just aren't indexed
+
+static void put_varint(std::string& output, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        output.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+}
+
+static size_t message_bytes(const SearchMessage& message)
+{
+    return sizeof(SearchMessage) + message.room.size() + message.author.size() + message.recipient.size() + message.text.size();
+}
+
+static std::string lowered(const std::string& text)
+{
+    std::string output = text;
+    for (char& c : output)
+        if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+    return output;
+}
+
+static bool visible(const SearchMessage& message, const std::string& viewer)
+{
+    return !message.room.empty() || message.author == viewer || message.recipient == viewer;
+}
+
+// Every term of a message, the author and room are terms too so from: and in: are just lookups
+static void message_terms(const SearchMessage& message, std::vector<std::string>& terms)
+{
+    terms.clear();
+    SearchIndex::tokenize(message.text,terms);
+    terms.push_back('@' + lowered(message.author));
+    if (!message.room.empty()) terms.push_back('#' + lowered(message.room));
+    std::sort(terms.begin(),terms.end());
+    terms.erase(std::unique(terms.begin(),terms.end()),terms.end()); // Postings have to be strictly increasing
+}
+
+// Both sorted, keeps what's in both
+static void intersect(std::vector<uint32_t>& into, const std::vector<uint32_t>& other)
+{
+    size_t kept = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < into.size(); ++i)
+    {
+        while (j < other.size() && other[j] < into[i]) ++j;
+        if (j == other.size()) break;
+        if (other[j] == into[i]) into[kept++] = into[i];
+    }
+    into.resize(kept);
+}
+
+void SearchIndex::tokenize(const std::string& text, std::vector<std::string>& terms)
+{
+    std::string current;
+    for (const char c : text)
+    {
+        const unsigned char byte = static_cast<unsigned char>(c);
+        // Anything outside ASCII is part of a word, that keeps UTF-8 words whole
+        if ((byte >= 'a' && byte <= 'z') || (byte >= '0' && byte <= '9') || byte >= 0x80)
+            current.push_back(c);
+        else if (byte >= 'A' && byte <= 'Z')
+            current.push_back(static_cast<char>(byte - 'A' + 'a'));
+        else
+        {
+            if (!current.empty()) terms.push_back(current.substr(0,SEARCH_MAX_TERM));
+            current.clear();
+        }
+    }
+    if (!current.empty()) terms.push_back(current.substr(0,SEARCH_MAX_TERM));
+}
+
+// Words, from:NAME and in:ROOM
+SearchQuery SearchIndex::parse(const std::string& text)
+{
+    SearchQuery query;
+    std::stringstream stream(text);
+    std::string word;
+    while (stream >> word)
+    {
+        if (word.rfind("from:",0) == 0) query.author = word.substr(5);
+        else if (word.rfind("in:",0) == 0) query.room = word.substr(3);
+        else tokenize(word,query.terms);
+    }
+    return query;
+}
+
+std::vector<uint32_t> SearchSegment::find(const std::string& term) const
+{
+    std::vector<uint32_t> output;
+    const auto found = terms.find(term);
+    if (found == terms.end()) return output;
+    const unsigned char* at = reinterpret_cast<const unsigned char*>(postings.data()) + found->second.first;
+    const unsigned char* end = at + found->second.second;
+    uint32_t previous = 0;
+    while (at < end)
+    {
+        uint32_t value = 0;
+        int shift = 0;
+        while (*at & 0x80)
+        {
+            value |= uint32_t(*at++ & 0x7F) << shift;
+            shift += 7;
+        }
+        value |= uint32_t(*at++) << shift;
+        previous = output.empty() ? value : previous + value;
+        output.push_back(previous);
+    }
+    return output;
+}
+
+SearchIndex::SegmentPtr SearchIndex::build(uint64_t first, std::vector<SearchMessage> messages,
+                                           const std::unordered_map<std::string,std::vector<uint32_t>>& terms, int level)
+{
+    auto segment = std::make_shared<SearchSegment>();
+    segment->first = first;
+    segment->level = level;
+    segment->terms.reserve(terms.size());
+    for (const auto& term : terms)
+    {
+        const uint32_t offset = static_cast<uint32_t>(segment->postings.size());
+        uint32_t previous = 0;
+        for (size_t i = 0; i < term.second.size(); ++i)
+        {
+            put_varint(segment->postings,i ? term.second[i] - previous : term.second[i]);
+            previous = term.second[i];
+        }
+        segment->terms.emplace(term.first,std::make_pair(offset,static_cast<uint32_t>(segment->postings.size()) - offset));
+        segment->bytes += term.first.size() + sizeof(std::pair<std::string,std::pair<uint32_t,uint32_t>>) + 16;
+    }
+    segment->postings.shrink_to_fit();
+    segment->bytes += segment->postings.size();
+    for (const auto& message : messages)
+        segment->bytes += message_bytes(message);
+    segment->messages = std::move(messages);
+    return segment;
+}
+
+// Neighbours in the list, so their messages are numbered back to back
+SearchIndex::SegmentPtr SearchIndex::merge(const std::vector<SegmentPtr>& parts)
+{
+    std::unordered_map<std::string,std::vector<uint32_t>> terms;
+    std::vector<SearchMessage> messages;
+    int level = 0;
+    for (const auto& part : parts)
+    {
+        const uint32_t offset = static_cast<uint32_t>(messages.size());
+        for (const auto& term : part->terms)
+        {
+            auto& list = terms[term.first];
+            for (const uint32_t index : part->find(term.first))
+                list.push_back(index + offset);
+        }
+        messages.insert(messages.end(),part->messages.begin(),part->messages.end());
+        level = std::max(level,part->level);
+    }
+    return build(parts.front()->first,std::move(messages),terms,level + 1);
+}
+
+void SearchIndex::start()
+{
+    m_thread = std::thread([this] { run(); });
+}
+
+void SearchIndex::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_queue_lock);
+        if (!m_thread.joinable()) return;
+        m_stopping = true;
+    }
+    m_queue_ready.notify_one();
+    m_thread.join();
+    m_stopping = false;
+}
+
+void SearchIndex::add(SearchMessage message)
+{
+    if (!m_thread.joinable())
+    {
+        std::vector<SearchMessage> batch;
+        batch.push_back(std::move(message));
+        index(batch);
+        compact();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_queue_lock);
+        if (m_queue.size() >= SEARCH_MAX_QUEUED) return;
+        m_queue.push_back(std::move(message));
+    }
+    m_queue_ready.notify_one();
+}
+
+void SearchIndex::flush()
+{
+    std::unique_lock<std::mutex> guard(m_queue_lock);
+    m_queue_empty.wait(guard,[this] { return !m_thread.joinable() || (m_queue.empty() && !m_busy); });
+}
+
+void SearchIndex::run()
+{
+    std::vector<SearchMessage> batch;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(m_queue_lock);
+            m_busy = false;
+            if (m_queue.empty()) m_queue_empty.notify_all();
+            m_queue_ready.wait(guard,[this] { return m_stopping || !m_queue.empty(); });
+            if (m_stopping) return;
+            batch.assign(std::make_move_iterator(m_queue.begin()),std::make_move_iterator(m_queue.end()));
+            m_queue.clear();
+            m_busy = true;
+        }
+        index(batch);
+        compact();
+        batch.clear();
+    }
+}
+
+void SearchIndex::index(std::vector<SearchMessage>& batch)
+{
+    std::vector<std::string> terms;
+    for (auto& message : batch)
+    {
+        message_terms(message,terms);
+        {
+            std::unique_lock<std::shared_mutex> guard(m_lock);
+            const uint32_t local = static_cast<uint32_t>(m_open.messages.size());
+            for (const auto& term : terms)
+            {
+                auto& list = m_open.terms[term];
+                if (list.empty()) m_open.bytes += term.size() + 64;
+                list.push_back(local);
+                m_open.bytes += sizeof(uint32_t);
+            }
+            m_open.bytes += message_bytes(message);
+            m_open.messages.push_back(std::move(message));
+            ++m_next;
+        }
+        if (m_open.messages.size() >= SEARCH_SEGMENT_MESSAGES) seal();
+    }
+}
+
+// Only this side writes the open segment, so reading it here needs no lock
+void SearchIndex::seal()
+{
+    SegmentPtr sealed = build(m_open.first,m_open.messages,m_open.terms,0);
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_sealed.push_back(std::move(sealed));
+    m_open = OpenSegment{};
+    m_open.first = m_next;
+}
+
+void SearchIndex::compact()
+{
+    // Merging happens outside the lock, queries keep using the parts until the swap
+    for (;;)
+    {
+        if (m_sealed.size() < SEARCH_MERGE_FAN_IN) break;
+        const size_t from = m_sealed.size() - SEARCH_MERGE_FAN_IN;
+        const int level = m_sealed.back()->level;
+        bool same = true;
+        for (size_t i = from; i < m_sealed.size(); ++i)
+            same = same && m_sealed[i]->level == level;
+        if (!same) break;
+
+        const std::vector<SegmentPtr> parts(m_sealed.begin() + static_cast<std::ptrdiff_t>(from),m_sealed.end());
+        SegmentPtr merged = merge(parts);
+        std::unique_lock<std::shared_mutex> guard(m_lock);
+        m_sealed.resize(from);
+        m_sealed.push_back(std::move(merged));
+    }
+
+    // Whole segments go, oldest first
+    while (!m_sealed.empty() && memory() > budget)
+    {
+        std::unique_lock<std::shared_mutex> guard(m_lock);
+        m_sealed.erase(m_sealed.begin());
+    }
+}
+
+size_t SearchIndex::memory() const
+{
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    size_t total = m_open.bytes;
+    for (const auto& segment : m_sealed)
+        total += segment->bytes;
+    return total;
+}
+
+size_t SearchIndex::messages() const
+{
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    size_t total = m_open.messages.size();
+    for (const auto& segment : m_sealed)
+        total += segment->messages.size();
+    return total;
+}
+
+std::vector<SearchMessage> SearchIndex::query(const SearchQuery& query, const std::string& viewer, size_t limit) const
+{
+    std::vector<std::string> terms = query.terms;
+    if (!query.author.empty()) terms.push_back('@' + lowered(query.author));
+    if (!query.room.empty()) terms.push_back('#' + lowered(query.room));
+    std::vector<SearchMessage> results;
+    if (terms.empty()) return results;
+
+    std::vector<SegmentPtr> sealed;
+    {
+        std::shared_lock<std::shared_mutex> guard(m_lock);
+        std::vector<uint32_t> matches;
+        for (size_t i = 0; i < terms.size(); ++i)
+        {
+            const auto found = m_open.terms.find(terms[i]);
+            if (found == m_open.terms.end()) { matches.clear(); break; }
+            if (i == 0) matches = found->second;
+            else intersect(matches,found->second);
+        }
+        for (auto it = matches.rbegin(); it != matches.rend() && results.size() < limit; ++it)
+            if (visible(m_open.messages[*it],viewer)) results.push_back(m_open.messages[*it]);
+        sealed = m_sealed;
+    }
+
+    // Sealed segments never change, no lock needed past this point
+    for (auto segment = sealed.rbegin(); segment != sealed.rend() && results.size() < limit; ++segment)
+    {
+        // Rarest term first, a missing one rules the whole segment out
+        std::vector<std::pair<uint32_t,const std::string*>> order;
+        for (const auto& term : terms)
+        {
+            const auto found = (*segment)->terms.find(term);
+            if (found == (*segment)->terms.end()) break;
+            order.emplace_back(found->second.second,&term);
+        }
+        if (order.size() < terms.size()) continue;
+        std::sort(order.begin(),order.end());
+
+        std::vector<uint32_t> matches = (*segment)->find(*order[0].second);
+        for (size_t i = 1; i < order.size() && !matches.empty(); ++i)
+            intersect(matches,(*segment)->find(*order[i].second));
+        for (auto it = matches.rbegin(); it != matches.rend() && results.size() < limit; ++it)
+            if (visible((*segment)->messages[*it],viewer)) results.push_back((*segment)->messages[*it]);
+    }
+    return results;
+}
@@ -0,0 +1,114 @@
+#ifndef NETWORK_SEARCH_HPP
+#define NETWORK_SEARCH_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+#define SEARCH_SEGMENT_MESSAGES 32768 // The open segment is sealed and compressed at this size
+#define SEARCH_MERGE_FAN_IN 4 // This many sealed segments of one size become one of the next size
+#define SEARCH_DEFAULT_MEMORY (256ull * 1024 * 1024)
+#define SEARCH_MAX_RESULTS 20
+#define SEARCH_MAX_TERM 32 // Longer words are cut, nobody searches for those in full
+
+/*
+ * Inverted index over recent room messages and whispers
+ * New messages go into an open segment, full segments are sealed into sorted terms with
+ * delta + varint posting lists, and sealed segments of the same size are merged like an LSM tree
+ * Past the memory budget the oldest segment is dropped whole
+ * Adding only queues the message, a background thread does the tokenizing
+ */
+
+struct SearchMessage
+{
+    std::string room; // Empty for whispers
+    std::string author;
+    std::string recipient; // Whispers only, they're only found by the two people in them
+    std::string text;
+};
+
+struct SearchQuery
+{
+    std::vector<std::string> terms;
+    std::string author; // from:NAME
+    std::string room; // in:ROOM
+};
+
+// Sealed segments never change, queries and merges share them without copying
+struct SearchSegment
+{
+    uint64_t first = 0; // Global number of messages[0]
+    std::vector<SearchMessage> messages;
+    std::unordered_map<std::string,std::pair<uint32_t,uint32_t>> terms; // Offset and length in postings
+    std::string postings; // Every term's message indexes, delta encoded varints
+    size_t bytes = 0;
+    int level = 0; // How many merges made it
+
+    std::vector<uint32_t> find(const std::string& term) const;
+};
+
+struct SearchIndex
+{
+    ~SearchIndex() { stop(); }
+
+    // Without a thread messages are indexed as they're added, replays stay deterministic
+    void start();
+    void stop();
+
+    void add(SearchMessage message);
+    // Newest first, viewer decides which whispers can show up
+    std::vector<SearchMessage> query(const SearchQuery& query, const std::string& viewer, size_t limit) const;
+    void flush(); // Waits until everything added so far is searchable
+
+    size_t memory() const;
+    size_t messages() const;
+
+    size_t budget = SEARCH_DEFAULT_MEMORY;
+
+    static SearchQuery parse(const std::string& text);
+    static void tokenize(const std::string& text, std::vector<std::string>& terms);
+
+private:
+    typedef std::shared_ptr<const SearchSegment> SegmentPtr;
+
+    // Open segment, only the indexing side writes it
+    struct OpenSegment
+    {
+        uint64_t first = 0;
+        std::vector<SearchMessage> messages;
+        std::unordered_map<std::string,std::vector<uint32_t>> terms;
+        size_t bytes = 0;
+    };
+
+    mutable std::shared_mutex m_lock; // Guards m_open and m_sealed
+    OpenSegment m_open;
+    std::vector<SegmentPtr> m_sealed; // Oldest first
+    uint64_t m_next = 0;
+
+    std::mutex m_queue_lock;
+    std::condition_variable m_queue_ready;
+    std::condition_variable m_queue_empty;
+    std::deque<SearchMessage> m_queue;
+    bool m_busy = false;
+    bool m_stopping = false;
+    std::thread m_thread;
+
+    void index(std::vector<SearchMessage>& batch);
+    void seal();
+    void compact();
+    void run();
+
+    static SegmentPtr build(uint64_t first, std::vector<SearchMessage> messages,
+                            const std::unordered_map<std::string,std::vector<uint32_t>>& terms, int level);
+    static SegmentPtr merge(const std::vector<SegmentPtr>& parts);
+};
+
+#endif //NETWORK_SEARCH_HPP
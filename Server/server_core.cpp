@@ -0,0 +1,1531 @@
+#include "server_core.hpp"
+#include "logging.hpp"
+#include "admin_batch.hpp"
+#include "simd_scan.hpp"
+#include "tls.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <atomic>
+#ifdef _WIN32
+#include <process.h> // _getpid
+#endif
+
+static void print_clientdata(const ClientDataPtr& data)
+{
+    char ip_address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET,&data->network.sin_addr,ip_address,INET_ADDRSTRLEN);
+    SERVER_MESSAGE("IP Address: " << ip_address);
+    SERVER_MESSAGE("Port: " << ntohs(data->network.sin_port));
+    SERVER_MESSAGE("Username: " << data->username);
+    SERVER_MESSAGE("Socket: " << data->socket);
+}
+
+static std::stringstream get_server_stream()
+{
+    std::stringstream stream;
+    stream << "[SERVER] | ";
+    return stream;
+}
+
+// Every message to a client goes through here, it gets its sequence number once the transport puts it on the wire
+bool ServerCore::deliver_encoded(SOCKET socket, const std::string& frames, TRAFFIC_CLASS type)
+{
+    Session* session = m_sessions.find(socket);
+    if (session && session->detached)
+    {
+        session->record(frames); // Buffered until they come back
+        return true;
+    }
+    return m_transport.send(socket,frames,type,true);
+}
+
+bool ServerCore::deliver(SOCKET socket, NETWORK_CODE header, const std::string& message)
+{
+    const std::string frames = PACMAN::encode_message(header,message,frame_for(socket,message.size()));
+    return deliver_encoded(socket,frames,classify(header,frames.size()));
+}
+
+// Replies to one client can use the frames it agreed to, sized to what its connection moves per round trip
+// Anything encoded once for many sockets stays at packet_size so every client can take it
+size_t ServerCore::frame_for(SOCKET socket, size_t size)
+{
+    if (size + 2 <= PACMAN::packet_size) return PACMAN::packet_size; // One frame either way
+    Session* session = m_sessions.find(socket);
+    if (!session || session->frame_limit == PACMAN::packet_size) return PACMAN::packet_size;
+    if (!session->detached && m_loop.now - session->frame_checked >= std::chrono::milliseconds(FRAME_REFRESH_MS))
+    {
+        size_t segment = 0;
+        const size_t window = m_transport.window(socket,segment);
+        session->frame = PACMAN::adapt_frame(session->frame_limit,window,segment);
+        session->frame_checked = m_loop.now;
+    }
+    return session->frame;
+}
+
+void ServerCore::close_connection(SOCKET socket)
+{
+    if (SessionTable::parked(socket)) return; // Nothing to close
+    m_transport.disconnect(socket);
+}
+
+void ServerCore::publish_local(SOCKET socket, const std::string& topic, const std::string& frames)
+{
+    TopicId id;
+    if (!m_users.topics.find(topic,id)) return;
+    // Server wide traffic yields to everything a user is actually in
+    const TRAFFIC_CLASS type = topic == GLOBAL_TOPIC ? TRAFFIC_CLASS::BULK : TRAFFIC_CLASS::ROOM;
+    if (type == TRAFFIC_CLASS::BULK && m_memory.pressure != PRESSURE::NORMAL)
+    {
+        ++m_memory.shed; // First to go when memory is tight, every copy would sit in somebody's queue
+        return;
+    }
+    const std::vector<SOCKET>& subscribers = m_users.topics.subscribers_of(id);
+    TRACE_SPAN_ARG("fanout",subscribers.size());
+    if (m_fanout.size() && subscribers.size() >= FANOUT_PARALLEL_MIN && m_transport.sharded())
+    {
+        // Grouped by transport shard, each group is sent by one thread and the loop waits for all of them
+        std::vector<SOCKET> shards[TRANSPORT_SHARDS];
+        for (const SOCKET subscriber : subscribers)
+        {
+            if (subscriber == socket) continue;
+            shards[transport_shard(subscriber)].push_back(subscriber);
+        }
+        const bool traced = TRACE::t_active;
+        m_fanout.run(TRANSPORT_SHARDS,[&](size_t shard)
+        {
+            const TRACE::Inherit inherit(traced);
+            for (const SOCKET subscriber : shards[shard])
+                deliver_encoded(subscriber,frames,type);
+        });
+        return;
+    }
+    for (const SOCKET subscriber : subscribers)
+    {
+        if (subscriber == socket) continue;
+        deliver_encoded(subscriber,frames,type);
+    }
+}
+
+// Encodes once and fans the frames out to every subscriber, other nodes get the same frames
+void ServerCore::publish_but(SOCKET socket, const std::string& topic, const std::string& message)
+{
+    publish_frames(socket,topic,PACMAN::encode_message(MESSAGE,message));
+}
+
+void ServerCore::publish_frames(SOCKET socket, const std::string& topic, const std::string& frames)
+{
+    publish_local(socket,topic,frames);
+    if (m_cluster) m_cluster->publish(topic,frames);
+}
+
+void ServerCore::publish(const std::string& topic, const std::string& message)
+{
+    publish_but(INVALID_SOCKET,topic,message);
+}
+
+// Automatically adds the server tag
+void ServerCore::announce_all(const std::string& message)
+{
+    publish(GLOBAL_TOPIC,message);
+}
+
+void ServerCore::announce_all_but(SOCKET socket, const std::string& message)
+{
+    publish_but(socket,GLOBAL_TOPIC,message);
+}
+
+void ServerCore::announce_room(const std::string& room, const std::string& message)
+{
+    publish(room_topic(room),message);
+}
+
+void ServerCore::announce_room_but(SOCKET socket, const std::string& room, const std::string& message)
+{
+    publish_but(socket,room_topic(room),message);
+}
+
+void ServerCore::announce_all_friends(SOCKET socket, const std::string& message)
+{
+    publish(friends_topic(m_users.by_socket.at(socket)->username),message);
+}
+
+void ServerCore::announce_admins(const std::string& message)
+{
+    publish(ADMIN_TOPIC,message);
+}
+
+// Typing indicators, presence pings and read receipts never touch the TCP stream
+void ServerCore::datagrams(const std::vector<DATAGRAM::Datagram>& incoming, std::vector<DATAGRAM::Datagram>& outgoing)
+{
+    for (const auto& datagram : incoming)
+    {
+        uint32_t id;
+        SOCKET owner;
+        DATAGRAM::Event event;
+        if (!DATAGRAM::peek_session(datagram.bytes,id)) continue;
+        Session* session = m_sessions.find_datagram(id,owner);
+        if (!session) continue;
+        if (!DATAGRAM::decode(datagram.bytes,session->datagram_key,event)) continue; // Forged or corrupt
+        if (session->detached) continue;
+        session->datagram_peer = datagram.peer;
+        session->datagram_bound = true;
+
+        switch (event.type)
+        {
+            case DATAGRAM::PRESENCE:
+                break;
+            case DATAGRAM::READ_RECEIPT:
+                session->acknowledge(DATAGRAM::unpack_u64(event.payload));
+                break;
+            case DATAGRAM::TYPING:
+            {
+                const auto& user = m_users.by_socket.at(owner);
+                TopicId topic;
+                if (!m_users.topics.find(room_topic(user->room),topic)) break;
+                for (const SOCKET subscriber : m_users.topics.subscribers_of(topic))
+                {
+                    if (subscriber == owner) continue;
+                    const Session* other = m_sessions.find(subscriber);
+                    if (!other || !other->datagram_bound) continue;
+                    outgoing.push_back(DATAGRAM::Datagram{
+                        other->datagram_peer,
+                        DATAGRAM::encode(other->datagram_id,other->datagram_key,DATAGRAM::TYPING,user->username)});
+                }
+                break;
+            }
+        }
+    }
+}
+
+void ServerCore::disconnect_user(SOCKET client)
+{
+    std::stringstream announcement = get_server_stream();
+    announcement << m_users.by_socket.at(client)->username << " has disconnected from the server.";
+    announce_all_but(client,announcement.str());
+    announcement = get_server_stream();
+    announcement << "Your friend " << m_users.by_socket.at(client)->username << " has disconnected from the server.";
+    announce_all_friends(client,announcement.str());
+//    const auto& room = m_users.room(client);
+//    for (const auto& user : room.clients)
+//    {
+//        if (user.first == client) continue;
+//        deliver(user.first,MESSAGE,announcement.str());
+//    }
+    SERVER_MESSAGE("Client Has Disconnected");
+    print_clientdata(m_users.by_socket.at(client));
+    if (m_cluster) m_cluster->release(m_users.by_socket.at(client)->username);
+    stash_requests(m_users.by_socket.at(client));
+    m_users.rem(client);
+    m_sessions.close(client);
+    close_connection(client);
+}
+
+// Gone without the goodbye announcements, whoever calls this already told them why
+void ServerCore::drop_user(const ClientDataPtr& user)
+{
+    close_connection(user->socket);
+    m_sessions.close(user->socket);
+    if (m_cluster) m_cluster->release(user->username);
+    stash_requests(user);
+    m_users.rem(user);
+}
+
+// Connection was lost, hold onto everything quietly in case they reconnect
+void ServerCore::detach_user(SOCKET client)
+{
+    const std::string& username = m_users.by_socket.at(client)->username;
+    SERVER_MESSAGE(username << " lost connection, holding their session for " << SESSION_GRACE_SECONDS << " seconds");
+    close_connection(client);
+    const SOCKET parked = m_sessions.park(client,now);
+    m_users.rekey(client,parked);
+}
+
+// Handshake looks like USERNAME<SESSION_RESUME>TOKEN RECEIVED
+bool ServerCore::resume_user(SOCKET new_client, const sockaddr_in& incoming, const std::string& username, const std::string& resume)
+{
+    std::stringstream stream(resume);
+    std::string token;
+    uint64_t received = 0;
+    stream >> token >> received;
+
+    SOCKET previous;
+    if (!m_sessions.find_token(token,previous)) return false;
+    const ClientDataPtr user = m_users.by_socket.at(previous);
+    if (user->username != username) return false;
+
+    if (!m_sessions.find(previous)->covers(received))
+    {
+        SERVER_MESSAGE(username << " reconnected too far behind to resume, starting over");
+        disconnect_user(previous);
+        return false;
+    }
+    if (!SessionTable::parked(previous))
+        close_connection(previous); // We never noticed the old connection drop
+
+    m_users.rekey(previous,new_client);
+    m_sessions.attach(previous,new_client);
+    user->network = incoming;
+
+    const Session& session = *m_sessions.find(new_client);
+
+    size_t replayed = 0;
+    for (const auto& entry : session.replay)
+    {
+        if (entry.sequence <= received) continue;
+        m_transport.send(new_client,entry.frames,TRAFFIC_CLASS::CONTROL,false); // Already sequenced, ahead of anything new
+        ++replayed;
+    }
+    SERVER_MESSAGE(username << " resumed their session | Replayed " << replayed << " messages");
+    print_clientdata(user);
+
+    std::stringstream welcome_msg = get_server_stream();
+    welcome_msg << "Welcome back " << username << ". You are in room " << user->room << '.';
+    deliver(new_client,MESSAGE,welcome_msg.str());
+    return true;
+}
+
+static std::string join_names(const std::vector<std::string>& names)
+{
+    std::stringstream stream;
+    for (size_t i = 0; i < names.size(); ++i)
+        stream << (i ? ", " : "") << names[i];
+    return stream.str();
+}
+
+// Runs every operation in one request, grouping by index so each one is only walked once
+void ServerCore::run_admin_batch(SOCKET client, const std::string& payload)
+{
+    const std::vector<AdminOp> ops = parse_admin_batch(payload);
+    const std::string author = m_users.by_socket.at(client)->username;
+
+    // Inline authentication saves the separate AUTHENTICATE round trip
+    if (!ops.empty() && ops.front().type == ADMIN_OP::AUTH)
+    {
+        if (!ops.front().args.empty() && TLS::constant_time_equals(ops.front().args[0],authcode))
+        {
+            grant_admin(m_users.by_socket.at(client));
+            SERVER_MESSAGE(author << " has authenticated as Administrator through a batch");
+        }
+        else
+            SERVER_MESSAGE(author << " attempted to authenticate a batch with an invalid code");
+    }
+    if (!m_users.is_admin(client))
+    {
+        SERVER_MESSAGE(author << " issued a batch request as a normal user");
+        deliver(client, MESSAGE, "You have to be an administrator to do this action.");
+        return;
+    }
+
+    std::stringstream report = get_server_stream();
+    report << "Batch Results:" << std::endl;
+    int errors = 0;
+
+    // Gather
+    std::map<std::string,ClientDataPtr> kicks;
+    std::vector<std::string> remote_kicks; // Not on this node, the cluster finds them
+    std::map<std::string,std::pair<ClientDataPtr,std::string>> moves; // Username -> (User, Destination)
+    std::map<std::string,std::vector<std::string>> broadcasts; // Room -> Messages
+    bool stats = false;
+    for (const auto& op : ops)
+    {
+        switch (op.type)
+        {
+            case ADMIN_OP::AUTH:
+                continue;
+            case ADMIN_OP::KICK:
+            {
+                for (const auto& name : op.args)
+                {
+                    const auto user = m_users.by_name.find(name);
+                    if (user == m_users.by_name.end() && m_cluster)
+                    {
+                        remote_kicks.push_back(name);
+                        continue;
+                    }
+                    if (user == m_users.by_name.end() || user->second->socket == client)
+                    {
+                        report << "\tCannot kick " << name << std::endl;
+                        ++errors;
+                        continue;
+                    }
+                    kicks[name] = user->second;
+                }
+                continue;
+            }
+            case ADMIN_OP::MOVE:
+            {
+                if (op.args.size() < 2)
+                {
+                    report << "\tmove needs a room and at least one user" << std::endl;
+                    ++errors;
+                    continue;
+                }
+                for (size_t i = 1; i < op.args.size(); ++i)
+                {
+                    const auto user = m_users.by_name.find(op.args[i]);
+                    if (user == m_users.by_name.end())
+                    {
+                        report << "\tCannot move " << op.args[i] << std::endl;
+                        ++errors;
+                        continue;
+                    }
+                    moves[op.args[i]] = std::make_pair(user->second,op.args[0]);
+                }
+                continue;
+            }
+            case ADMIN_OP::BROADCAST:
+            {
+                if (op.args.empty() || op.text.empty())
+                {
+                    report << "\tbroadcast needs rooms and a message" << std::endl;
+                    ++errors;
+                    continue;
+                }
+                std::string text = op.text;
+                m_filter.apply(text);
+                for (const auto& room : op.args)
+                    broadcasts[room].emplace_back(text);
+                continue;
+            }
+            case ADMIN_OP::STATS:
+                stats = true;
+                continue;
+            case ADMIN_OP::FILTER:
+                if (m_filter.path.empty())
+                {
+                    report << "\tThis server has no content filter" << std::endl;
+                    ++errors;
+                    continue;
+                }
+                reload_filter();
+                report << "\tReloading the content filter" << std::endl;
+                continue;
+            case ADMIN_OP::UNKNOWN:
+                report << "\tUnknown operation " << op.verb << std::endl;
+                ++errors;
+                continue;
+        }
+    }
+
+    // Kicks go first so nobody gets moved or messaged on the way out
+    std::vector<std::string> kicked;
+    for (const auto& k : kicks)
+    {
+        const ClientDataPtr& user = k.second;
+        moves.erase(k.first);
+        deliver(user->socket,MESSAGE,"You have been kicked by an administrator.");
+        SERVER_MESSAGE(author << " kicked " << user->username);
+        drop_user(user);
+        kicked.emplace_back(k.first);
+    }
+    for (const auto& name : remote_kicks)
+    {
+        m_cluster->route(name,author,PACMAN::encode_message(MESSAGE,"You have been kicked by an administrator."),0,true);
+        report << "\tAsked the cluster to kick " << name << std::endl;
+    }
+    if (!kicked.empty())
+    {
+        std::stringstream announcement = get_server_stream();
+        announcement << "Removed from the server: " << join_names(kicked);
+        announce_all(announcement.str());
+    }
+
+    // Moves are announced once per room instead of once per user
+    std::map<std::string,std::vector<std::string>> joined;
+    std::map<std::string,std::vector<std::string>> left;
+    size_t moved = 0;
+    for (const auto& m : moves)
+    {
+        const ClientDataPtr& user = m.second.first;
+        const std::string& destination = m.second.second;
+        if (user->room == destination) continue;
+        // Same rules as JOIN_ROOM, a batch doesn't get to make rooms the cap would turn away
+        if (!m_users.room_available(destination))
+        {
+            report << "\tCould not move " << m.first << ", rooms need a name of up to " << DATABASE_MAX_ROOM_NAME
+                   << " characters and the server has to have space for another" << std::endl;
+            ++errors;
+            continue;
+        }
+        ++moved;
+        left[user->room].emplace_back(m.first);
+        m_users.move(user->socket,destination);
+        joined[destination].emplace_back(m.first);
+    }
+    for (const auto& room : left)
+    {
+        std::stringstream leaveMessage = get_server_stream();
+        leaveMessage << join_names(room.second) << " left " << room.first;
+        announce_room(room.first,leaveMessage.str());
+    }
+    for (const auto& room : joined)
+    {
+        std::stringstream joinMessage = get_server_stream();
+        joinMessage << join_names(room.second) << " joined " << room.first;
+        announce_room(room.first,joinMessage.str());
+    }
+
+    // One walk over each room's members for all of its messages
+    for (const auto& b : broadcasts)
+    {
+        const auto room = m_users.rooms.find(b.first);
+        if (room == m_users.rooms.end())
+        {
+            report << "\tRoom " << b.first << " does not exist" << std::endl;
+            ++errors;
+            continue;
+        }
+        for (const auto& text : b.second)
+        {
+            std::stringstream stream = get_server_stream();
+            stream << text;
+            announce_room(b.first,stream.str());
+        }
+    }
+
+    report << "\tKicked " << kicked.size()
+           << " | Moved " << moved
+           << " | Broadcast to " << broadcasts.size() << " rooms"
+           << " | Errors " << errors << std::endl;
+
+    if (stats)
+    {
+        size_t occupied = 0;
+        for (const auto& room : m_users.rooms)
+            occupied += !room.second.clients.empty();
+        size_t administrators = 0;
+        for (const auto& user : m_users.by_socket)
+            administrators += user.second->role == ROLE::ADMIN;
+        report << "Stats:" << std::endl;
+        report << "\tUsers " << m_users.by_socket.size() << std::endl;
+        report << "\tAdministrators " << administrators << std::endl;
+        report << "\tAccounts " << m_accounts.size() << std::endl;
+        report << "\tSearchable Messages " << m_search.messages() << " (" << m_search.memory() / 1024 << " KiB)" << std::endl;
+        report << "\tSessions " << m_sessions.sessions.size() << " (" << m_sessions.parked_count() << " parked)" << std::endl;
+        report << "\tMemory " << pressure_name(m_memory.pressure) << ", " << m_memory.accounted / 1024 << " KiB accounted, " << m_memory.resident / 1024 << " KiB resident";
+        if (m_memory.limit) report << ", limit " << m_memory.limit / 1024 << " KiB";
+        report << std::endl;
+        report << "\tShedding " << m_memory.refused << " refused, " << m_memory.shed << " broadcasts shed, " << m_memory.evicted << " evicted" << std::endl;
+        if (m_inbox.enabled())
+            report << "\tInbox " << m_inbox.items() << " waiting for " << m_inbox.boxes() << " users, " << m_inbox.file_bytes() / 1024 << " KiB on disk" << std::endl;
+        if (m_filter.current)
+            report << "\tContent Filter " << m_filter.current->patterns << " patterns, " << m_filter.filtered.load() << " messages masked" << std::endl;
+        report << "\tRooms " << m_users.rooms.size() << " (" << occupied << " occupied)" << std::endl;
+        report << "\tTopics " << m_users.topics.count() << std::endl;
+        for (const auto& room : m_users.rooms)
+        {
+            if (room.second.clients.empty()) continue;
+            report << "\t\t" << room.first << ' ' << room.second.clients.size() << std::endl;
+        }
+    }
+
+    deliver(client,MESSAGE,report.str());
+}
+
+ServerCore::ServerCore(Transport& transport) : m_transport(transport)
+{
+    m_transport.on_wire = [this](SOCKET socket, const std::string& frames)
+    {
+        Session* session = m_sessions.find(socket);
+        if (session) session->record(frames);
+    };
+    m_users.rooms.insert(std::make_pair(std::string{STARTING_ROOM_NAME}, ChatRoom{})); // Default Room
+}
+
+// Registered users keep it, the account file is written from the loop thread since it's one record
+void ServerCore::grant_admin(const ClientDataPtr& user)
+{
+    m_users.promote(user->socket);
+    if (user->registered && !m_accounts.set_role(user->username,ROLE::ADMIN))
+        LOG_WARNING("Could not save the administrator role for " << user->username);
+}
+
+bool ServerCore::still_here(const ClientDataPtr& user) const
+{
+    const auto found = m_users.by_name.find(user->username);
+    return found != m_users.by_name.end() && found->second == user;
+}
+
+Task ServerCore::join_room(ClientDataPtr user, std::string roomname)
+{
+    // Every hop announces in two rooms, rapid hops wait their turn instead of spamming both
+    const auto at = std::max(m_loop.now,user->next_join);
+    user->next_join = at + std::chrono::milliseconds(JOIN_COOLDOWN_MS);
+    if (at > m_loop.now)
+    {
+        co_await m_loop.sleep_until(at);
+        if (!still_here(user)) co_return;
+    }
+
+    const std::string& username = user->username;
+    const std::string beforeRoom = user->room;
+    if (!m_users.room_available(roomname))
+    {
+        std::stringstream stream = get_server_stream();
+        stream << "Rooms need a name of up to " << DATABASE_MAX_ROOM_NAME << " characters, and the server has to have space for another";
+        deliver(user->socket,MESSAGE,stream.str());
+        co_return;
+    }
+    m_users.move(user->socket,roomname);
+
+    std::stringstream joinMessage = get_server_stream();
+    joinMessage << username << " has joined " << roomname;
+    announce_room_but(user->socket,roomname,joinMessage.str());
+    std::stringstream leaveMessage = get_server_stream();
+    leaveMessage << username << " has left " << beforeRoom;
+    announce_room(beforeRoom,leaveMessage.str());
+
+    SERVER_MESSAGE(username << " Has Moved To " << roomname);
+}
+
+Task ServerCore::authenticate(ClientDataPtr user, std::string provided_code)
+{
+    co_await m_workers.schedule();
+    const bool valid = TLS::constant_time_equals(provided_code,authcode);
+    co_await m_loop.schedule();
+
+    // Wrong codes are answered late, only the one guessing waits
+    if (!valid) co_await m_loop.sleep_for(std::chrono::milliseconds(AUTHENTICATION_FAILURE_DELAY_MS));
+    if (!still_here(user)) co_return;
+
+    const std::string& author = user->username;
+    if (valid)
+    {
+        grant_admin(user);
+        SERVER_MESSAGE(author << " has authenticated as Administrator");
+        deliver(user->socket,MESSAGE, "You are now an administrator.");
+        co_return;
+    }
+
+    SERVER_MESSAGE(author << " attempted to authenticate as Administrator with code " << provided_code);
+    deliver(user->socket,MESSAGE, "You have entered an invalid code.");
+}
+
+Task ServerCore::friend_request(ClientDataPtr senderData, std::string userToFriend)
+{
+    const std::string& sender = senderData->username;
+    if (userToFriend == sender) // Self send
+    {
+        std::stringstream warn = get_server_stream();
+        warn << "You cannot send a friend request to yourself.";
+        SERVER_MESSAGE(sender << " tried to befriend himself");
+        deliver(senderData->socket, MESSAGE, warn.str());
+        co_return;
+    }
+    if (!m_users.by_name.count(userToFriend)) // Possible Send
+    {
+        // They might be on another node, ask its directory before calling them unknown
+        bool elsewhere = false;
+        if (m_cluster)
+        {
+            const uint64_t request = m_next_request++;
+            m_cluster->lookup(userToFriend,request);
+            if (co_await m_loop.wait(request,m_loop.now + std::chrono::milliseconds(CLUSTER_LOOKUP_TIMEOUT_MS)))
+                elsewhere = m_located.at(request).on;
+            if (!still_here(senderData)) co_return;
+        }
+
+        if (!elsewhere && m_inbox.enabled() && m_accounts.exists(userToFriend))
+        {
+            std::stringstream stream = get_server_stream();
+            if (m_inbox.append(userToFriend,INBOX_KIND::FRIEND_REQUEST,sender,{}))
+                stream << userToFriend << " is offline, they will get your friend request when they log in.";
+            else
+                stream << userToFriend << "'s inbox is full.";
+            deliver(senderData->socket,MESSAGE,stream.str());
+            co_return;
+        }
+
+        std::stringstream errormsg = get_server_stream();
+        if (elsewhere)
+            errormsg << userToFriend << " is connected to another server node, friend requests only work within a node.";
+        else
+            errormsg << userToFriend << " does not exist.";
+        SERVER_MESSAGE(sender << " tried to send a friend request to unknown user " << userToFriend);
+        deliver(senderData->socket,MESSAGE,errormsg.str());
+        co_return;
+    }
+    const SOCKET client = senderData->socket;
+    const auto& userToFriendData = m_users.by_name.at(userToFriend);
+    if (userToFriendData->pending.count(client))
+    {
+        std::stringstream errormsg = get_server_stream();
+        errormsg << "You have already sent a friend request to this person";
+        SERVER_MESSAGE(sender << " sent a duplicate friend request to " << userToFriend);
+        deliver(client,MESSAGE,errormsg.str());
+        co_return;
+    }
+    if (senderData->friends.count(userToFriendData->socket))
+    {
+        std::stringstream errormsg = get_server_stream();
+        errormsg << "You are already friends with " << userToFriend;
+        SERVER_MESSAGE(sender << " tried to befriend " << userToFriend << " again");
+        deliver(client,MESSAGE,errormsg.str());
+        co_return;
+    }
+    // Accepting is always fine, new requests pile up on both sides
+    const bool accepting = senderData->pending.count(userToFriendData->socket) != 0;
+    if (!accepting && (userToFriendData->pending.size() >= DATABASE_MAX_PENDING || senderData->requested.size() >= DATABASE_MAX_PENDING))
+    {
+        std::stringstream errormsg = get_server_stream();
+        errormsg << "Too many friend requests are waiting, either yours or " << userToFriend << "'s";
+        SERVER_MESSAGE(sender << " hit the pending friend request limit with " << userToFriend);
+        deliver(client,MESSAGE,errormsg.str());
+        co_return;
+    }
+    bool friendStatus = m_users.befriend(client,userToFriend);
+    if (friendStatus)
+    {
+        std::stringstream updateThem = get_server_stream();
+        updateThem << sender << " has accepted your friend request.";
+        std::stringstream updateClient = get_server_stream();
+        updateClient << "You are now friends with " << userToFriend << '.';
+        SERVER_MESSAGE(sender << " is now friends with " << userToFriend);
+        deliver(m_users.by_name.at(userToFriend)->socket,MESSAGE,updateThem.str());
+        deliver(client,MESSAGE,updateClient.str());
+        co_return;
+    }
+
+    std::stringstream noticeThem = get_server_stream();
+    noticeThem << sender << " has sent you a friend request.";
+    std::stringstream noticeMe = get_server_stream();
+    noticeMe << "You have sent a friend request to " << userToFriend << '.';
+
+    deliver(m_users.by_name.at(userToFriend)->socket,MESSAGE,noticeThem.str());
+    deliver(client,MESSAGE,noticeMe.str());
+}
+
+// The socket isn't watched yet, anything the client sends meanwhile waits in the kernel
+Task ServerCore::login(SOCKET new_client, sockaddr_in incoming, std::string username, std::string password, size_t frame)
+{
+    ROLE role = ROLE::GUEST;
+    co_await m_workers.schedule();
+    const bool valid = m_accounts.verify(username,password,role);
+    co_await m_loop.schedule();
+
+    if (!valid)
+    {
+        co_await m_loop.sleep_for(std::chrono::milliseconds(AUTHENTICATION_FAILURE_DELAY_MS));
+        SERVER_MESSAGE("Failed login | NAME: " << username);
+        refuse(new_client,"Wrong username or password");
+        co_return;
+    }
+    if (admit(new_client,incoming,username,role,frame))
+        m_transport.watch(new_client);
+}
+
+Task ServerCore::register_account(ClientDataPtr user, std::string password)
+{
+    if (!m_accounts.enabled())
+    {
+        deliver(user->socket,MESSAGE,"This server does not keep accounts.");
+        co_return;
+    }
+    if (user->registered)
+    {
+        deliver(user->socket,MESSAGE,"You are already registered.");
+        co_return;
+    }
+    if (password.size() < ACCOUNT_MIN_PASSWORD || password.size() > ACCOUNT_MAX_PASSWORD)
+    {
+        std::stringstream stream = get_server_stream();
+        stream << "Passwords need " << ACCOUNT_MIN_PASSWORD << " to " << ACCOUNT_MAX_PASSWORD << " characters.";
+        deliver(user->socket,MESSAGE,stream.str());
+        co_return;
+    }
+
+    const std::string username = user->username;
+    const ROLE role = user->role == ROLE::ADMIN ? ROLE::ADMIN : ROLE::USER;
+    co_await m_workers.schedule();
+    const bool created = m_accounts.create(username,password,role);
+    co_await m_loop.schedule();
+    if (!still_here(user)) co_return;
+
+    if (!created)
+    {
+        SERVER_MESSAGE(username << " could not register");
+        deliver(user->socket,MESSAGE,"That name can't be registered, it is taken or too long.");
+        co_return;
+    }
+    user->registered = true;
+    if (user->role == ROLE::GUEST) user->role = ROLE::USER;
+    SERVER_MESSAGE(username << " registered an account");
+    deliver(user->socket,MESSAGE,"You are registered, log in with your password from now on.");
+}
+
+Task ServerCore::search(ClientDataPtr user, std::string text)
+{
+    const SearchQuery query = SearchIndex::parse(text);
+    if (query.terms.empty() && query.author.empty() && query.room.empty())
+    {
+        deliver(user->socket,MESSAGE,"You need to give something to search for, words, from:NAME or in:ROOM.");
+        co_return;
+    }
+
+    const std::string viewer = user->username;
+    co_await m_workers.schedule();
+    const std::vector<SearchMessage> found = m_search.query(query,viewer,SEARCH_MAX_RESULTS);
+    co_await m_loop.schedule();
+    if (!still_here(user)) co_return;
+
+    std::stringstream results = get_server_stream();
+    results << "Search Results for " << text << ':' << std::endl;
+    for (const auto& message : found)
+    {
+        if (message.room.empty())
+            results << "\t[WHISPER " << message.author << " -> " << message.recipient << "] |" << message.text << std::endl;
+        else
+            results << "\t[#" << message.room << "] [" << message.author << "] | " << message.text << std::endl;
+    }
+    if (found.empty()) results << "\tNothing found" << std::endl;
+    deliver(user->socket,MESSAGE,results.str());
+}
+
+Task ServerCore::trace(ClientDataPtr user, std::string setting)
+{
+    std::stringstream reply = get_server_stream();
+    if (!setting.empty() && setting != "dump")
+    {
+        uint32_t every = 0;
+        try
+        {
+            every = static_cast<uint32_t>(std::stoul(setting));
+        } catch (const std::exception&)
+        {
+            deliver(user->socket,MESSAGE,"Tracing takes how many requests to skip between samples, 0 turns it off.");
+            co_return;
+        }
+        TRACE::set_rate(every);
+        SERVER_MESSAGE(user->username << " set trace sampling to " << every);
+        if (every) reply << "Tracing one request in " << every;
+        else reply << "Tracing is off";
+        deliver(user->socket,MESSAGE,reply.str());
+        co_return;
+    }
+
+    co_await m_workers.schedule();
+    const std::string path = dump_trace();
+    co_await m_loop.schedule();
+    if (!still_here(user)) co_return;
+    if (path.empty()) reply << "Could not write the trace";
+    else reply << "Trace written to " << path;
+    deliver(user->socket,MESSAGE,reply.str());
+}
+
+Task ServerCore::reload_filter()
+{
+    const std::string path = m_filter.path;
+    co_await m_workers.schedule();
+    const auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const FilterAutomaton> compiled = ContentFilter::compile(path);
+    const auto took = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    co_await m_loop.schedule();
+
+    std::stringstream stream = get_server_stream();
+    if (!compiled)
+    {
+        LOG_ERROR("Could not read the filter word list | " << path);
+        stream << "Could not reload the content filter, the old word list stays";
+        announce_admins(stream.str());
+        co_return;
+    }
+    m_filter.current = std::move(compiled); // Messages from here on see the new list
+    LOG_INFO("Content filter reloaded | " << m_filter.current->patterns << " patterns | " << m_filter.current->memory() / 1024 << " KiB | " << took << "ms");
+    stream << "Content filter reloaded with " << m_filter.current->patterns << " patterns";
+    announce_admins(stream.str());
+}
+
+// Requests waiting on a registered user would go with their socket, they keep in the inbox instead
+void ServerCore::stash_requests(const ClientDataPtr& user)
+{
+    if (!user->registered || !m_inbox.enabled()) return;
+    for (const auto& p : user->pending)
+    {
+        const auto sender = m_users.by_socket.find(p.first);
+        if (sender == m_users.by_socket.end()) continue;
+        m_inbox.append(user->username,INBOX_KIND::FRIEND_REQUEST,sender->second->username,{});
+    }
+}
+
+// What one inbox item looks like on the wire, a friend request is sent again if whoever sent it is around
+std::string ServerCore::inbox_frames(const ClientDataPtr& user, const InboxItem& item)
+{
+    if (item.kind == INBOX_KIND::WHISPER)
+    {
+        std::stringstream whisper;
+        whisper << "[WHISPER FROM " << item.sender << "] | " << item.text;
+        return PACMAN::encode_message(MESSAGE,whisper.str());
+    }
+
+    std::stringstream stream = get_server_stream();
+    const auto sender = m_users.by_name.find(item.sender);
+    if (sender == m_users.by_name.end() || SessionTable::parked(sender->second->socket))
+        stream << item.sender << " sent you a friend request while you were away, send one back to be friends.";
+    else if (user->friends.count(sender->second->socket) || user->pending.count(sender->second->socket))
+        return {};
+    else if (user->pending.size() >= DATABASE_MAX_PENDING || sender->second->requested.size() >= DATABASE_MAX_PENDING)
+        stream << item.sender << " sent you a friend request while you were away, send one back to be friends.";
+    else if (m_users.befriend(sender->second->socket,user->username))
+    {
+        // They had asked us in the meantime
+        std::stringstream accepted = get_server_stream();
+        accepted << user->username << " has accepted your friend request.";
+        deliver(sender->second->socket,MESSAGE,accepted.str());
+        stream << "You are now friends with " << item.sender << '.';
+    }
+    else
+        stream << item.sender << " sent you a friend request while you were away.";
+    return PACMAN::encode_message(MESSAGE,stream.str());
+}
+
+// Paced across ticks so coming back to thousands of items doesn't hold up the loop
+// Each batch is read on a worker and leaves as one write, it's retired on the way back for the next one
+Task ServerCore::deliver_inbox(std::string username)
+{
+    if (!m_draining.insert(username).second) co_return; // Already on its way
+    size_t delivered = 0;
+    bool announced = false;
+    for (;;)
+    {
+        co_await m_workers.schedule();
+        m_inbox.consume(username,delivered);
+        const std::vector<InboxItem> batch = m_inbox.peek(username,INBOX_BATCH_ITEMS,INBOX_BATCH_BYTES);
+        const size_t waiting = m_inbox.waiting(username);
+        co_await m_loop.schedule();
+
+        delivered = 0;
+        // Whoever has the name now, a relog while this slept picks up where it left off
+        const auto found = m_users.by_name.find(username);
+        if (batch.empty() || found == m_users.by_name.end()) break;
+        const ClientDataPtr user = found->second;
+        if (SessionTable::parked(user->socket) || m_transport.queued(user->socket) > INBOX_BACKLOG_BYTES)
+        {
+            co_await m_loop.sleep_for(std::chrono::milliseconds(INBOX_PACE_MS));
+            continue;
+        }
+
+        std::string frames;
+        if (!announced)
+        {
+            std::stringstream stream = get_server_stream();
+            stream << "You have " << waiting << (waiting == 1 ? " message" : " messages") << " from while you were away.";
+            frames += PACMAN::encode_message(MESSAGE,stream.str());
+            announced = true;
+        }
+        for (const InboxItem& item : batch)
+            frames += inbox_frames(user,item);
+        if (!frames.empty()) deliver_encoded(user->socket,frames,TRAFFIC_CLASS::DIRECT);
+        delivered = batch.size();
+        if (waiting > batch.size()) co_await m_loop.sleep_for(std::chrono::milliseconds(INBOX_PACE_MS));
+    }
+    SERVER_MESSAGE(username << "'s inbox is " << (m_inbox.waiting(username) ? "paused until they come back" : "delivered"));
+    m_draining.erase(username);
+}
+
+std::string ServerCore::dump_trace()
+{
+    static std::atomic<uint32_t> dumps{0};
+    const auto stamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+#ifdef _WIN32
+    const int process = _getpid();
+#else
+    const int process = getpid();
+#endif
+    const std::string path = TRACE_DUMP_PREFIX + std::to_string(process) + '-' + std::to_string(stamp) + '-' + std::to_string(dumps++) + ".json";
+    size_t written = 0;
+    if (!TRACE::dump(path,written))
+    {
+        LOG_ERROR("Could not write the trace | " << path);
+        return {};
+    }
+    LOG_INFO("Trace written | " << path << " | " << written << " spans");
+    return path;
+}
+
+void ServerCore::seed(uint64_t value)
+{
+    m_sessions.generator.seed(value);
+    m_sessions.seeded = true;
+}
+
+void ServerCore::attach(ClusterNode& cluster)
+{
+    m_cluster = &cluster;
+    m_users.topics.on_interest = [&cluster](const std::string& topic, bool on) { cluster.set_interest(topic,on); };
+}
+
+// Handshake is USERNAME, USERNAME<LOGIN>PASSWORD or USERNAME<SESSION_RESUME>TOKEN RECEIVED, the TAIL_CODE_END after it is already gone
+// <FRAME_SIZE>BYTES can follow the name in any of them
+void ServerCore::connect(SOCKET new_client, const sockaddr_in& incoming, const std::string& handshake)
+{
+    const size_t resume_at = handshake.find(static_cast<char>(SESSION_RESUME));
+    const size_t login_at = handshake.find(static_cast<char>(LOGIN));
+    const size_t frame_at = handshake.find(static_cast<char>(FRAME_SIZE));
+    const std::string username = handshake.substr(0,std::min({resume_at,login_at,frame_at}));
+    // Older clients don't ask and keep getting packet_size frames, a resumed session keeps what it had
+    size_t frame = PACMAN::packet_size;
+    if (frame_at != std::string::npos && frame_at < std::min(resume_at,login_at))
+        frame = PACMAN::negotiate_frame(std::strtoul(handshake.c_str() + frame_at + 1,nullptr,10));
+    if (resume_at != std::string::npos && resume_user(new_client,incoming,username,handshake.substr(resume_at + 1)))
+    {
+        m_transport.watch(new_client);
+        return;
+    }
+
+    // A resume only reattaches what's already held, anyone new waits until memory is back to normal
+    // Logins included, each one would also queue a PBKDF2 run on the workers
+    if (m_memory.pressure != PRESSURE::NORMAL)
+    {
+        ++m_memory.refused;
+        refuse(new_client,"The server is too busy right now, try again later");
+        return;
+    }
+    if (login_at != std::string::npos)
+    {
+        if (!m_accounts.enabled())
+        {
+            refuse(new_client,"This server has no accounts, connect without logging in");
+            return;
+        }
+        login(new_client,incoming,username,handshake.substr(login_at + 1),frame);
+        return;
+    }
+    if (m_accounts.exists(username))
+    {
+        SERVER_MESSAGE("Attempted join as a registered user without a password | NAME: " << username);
+        refuse(new_client,"This username is registered, log in to use it");
+        return;
+    }
+    if (admit(new_client,incoming,username,ROLE::GUEST,frame))
+        m_transport.watch(new_client);
+}
+
+void ServerCore::refuse(SOCKET new_client, const std::string& reason)
+{
+    deliver(new_client,REFUSE_CONNECTION,reason);
+    m_transport.disconnect(new_client);
+}
+
+bool ServerCore::admit(SOCKET new_client, const sockaddr_in& incoming, const std::string& username, ROLE role, size_t frame)
+{
+    // Add Client to Database
+    SERVER_MESSAGE("Client Has Connected");
+    ClientDataPtr new_client_data = std::make_shared<ClientData>(username,STARTING_ROOM_NAME,new_client,incoming);
+    new_client_data->registered = role != ROLE::GUEST;
+    bool exist = m_users.add(new_client_data);
+    if (!exist)
+    {
+        SERVER_MESSAGE("Attempted join from User with conflicting names | NAME: " << new_client_data->username);
+        refuse(new_client,"This username is taken");
+        return false;
+    }
+    if (role == ROLE::ADMIN) m_users.promote(new_client);
+    else new_client_data->role = role;
+    print_clientdata(new_client_data);
+    if (m_cluster) m_cluster->claim(username); // Another node might have them already, that comes back as a CONFLICT
+    deliver(new_client,SESSION_TOKEN,m_sessions.open(new_client));
+    if (frame != PACMAN::packet_size)
+    {
+        Session& session = *m_sessions.find(new_client);
+        session.frame_limit = session.frame = frame;
+        deliver(new_client,FRAME_SIZE,std::to_string(frame));
+    }
+    if (datagrams_enabled)
+        deliver(new_client,DATAGRAM_SESSION,std::to_string(m_sessions.find(new_client)->datagram_id));
+
+    // Hard Coding Tags ([TAG]), no time for rewrite
+    std::stringstream welcome_msg = get_server_stream();
+    welcome_msg << "Welcome " << new_client_data->username << ". You are in room HOMEROOM.";
+    deliver(new_client,MESSAGE,welcome_msg.str());
+
+    std::stringstream announcement_msg = get_server_stream();
+    announcement_msg << new_client_data->username << " has joined the server.";
+    announce_all_but(new_client, announcement_msg.str());
+    if (new_client_data->registered && m_inbox.enabled() && m_inbox.waiting(username))
+        deliver_inbox(username);
+    return true;
+}
+
+bool ServerCore::read_only(const std::string& from_client)
+{
+    switch (from_client[0])
+    {
+        case MESSAGE:
+        case ECHO:
+        case FRIENDS_LIST:
+        case ROOM_LIST:
+        case WHISPER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Lookups, filtering, formatting and encoding happen here, anything that sends or writes goes in the returned half
+// Logging waits for that half too so the lines come out in order
+std::function<void()> ServerCore::prepare(SOCKET client, const std::string& from_client)
+{
+    TRACE_SPAN_ARG("prepare",static_cast<unsigned char>(from_client[0]));
+    const ClientDataPtr& user = m_users.by_socket.at(client);
+    // Everything past the header ends up on somebody else's screen
+    if (!SCAN::valid_utf8(from_client.data()+1,from_client.size()-1))
+    {
+        return [this,client,user]()
+        {
+            LOG_WARNING(user->username << " sent a message that isn't UTF-8");
+            std::stringstream stream = get_server_stream();
+            stream << "Messages have to be valid UTF-8";
+            deliver(client,MESSAGE,stream.str());
+        };
+    }
+
+    switch (from_client[0])
+    {
+        case ECHO:
+        {
+            return [this,client,echoed = std::string(from_client.c_str()+2)]() { deliver(client,ECHO,echoed); };
+        }
+        case MESSAGE:
+        {
+            // Print out what the client sent over
+            std::stringstream formatted_message;
+            std::string text = from_client.c_str()+1;
+            m_filter.apply(text); // Before the encode, every copy and the index get the masked text
+            formatted_message << '[' << user->username << "] | " << text;
+            std::string formatted = formatted_message.str();
+            std::string frames = PACMAN::encode_message(MESSAGE,formatted); // Once for the whole room
+            return [this,client,user,text = std::move(text),formatted = std::move(formatted),frames = std::move(frames)]() mutable
+            {
+                publish_frames(client,room_topic(user->room),frames);
+                m_search.add(SearchMessage{user->room,user->username,{},std::move(text)});
+                SERVER_MESSAGE(formatted);
+            };
+        }
+        case FRIENDS_LIST:
+        {
+            std::stringstream flist = get_server_stream();
+            flist << "Friends:" << std::endl;
+            for (const auto& f : user->friends)
+            {
+                flist << '\t' <<  f.second->username;
+                flist << std::endl;
+            }
+            flist << "Pending:";
+            for (const auto& p : user->pending)
+            {
+                flist << std::endl;
+                flist << '\t' << m_users.by_socket.at(p.first)->username;
+            }
+            flist << std::endl;
+            return [this,client,list = flist.str()]() { deliver(client,MESSAGE,list); };
+        }
+        case ROOM_LIST:
+        {
+            std::stringstream list = get_server_stream();
+            list << "Room List:" << std::endl;
+
+            const auto& room = m_users.room(client);
+            for (const auto& member : room.clients)
+            {
+                list << '\t' <<  member.second->username;
+                list << std::endl;
+            }
+
+            return [this,client,list = list.str()]() { deliver(client,MESSAGE,list); };
+        }
+        case WHISPER:
+        {
+            std::string rest_of_the_message = from_client.c_str()+2;
+            const size_t iter = std::min(rest_of_the_message.find(' '),rest_of_the_message.size());
+            std::string target = rest_of_the_message.substr(0,iter);
+            std::string message = rest_of_the_message.substr(iter);
+            m_filter.apply(message);
+            std::stringstream whisper;
+            whisper << "[WHISPER FROM " << user->username << "] | " << message;
+            return [this,client,user,target = std::move(target),message = std::move(message),whisper = whisper.str()]() mutable
+            {
+                if (target == user->username)
+                {
+                    std::stringstream stream = get_server_stream();
+                    stream << "You cannot whisper to yourself.";
+                    SERVER_MESSAGE(user->username << " attempted to whisper to himself");
+                    deliver(client,MESSAGE,stream.str());
+                    return;
+                }
+
+                // Only indexed once it's certain to land, here or in the inbox
+                if (!m_users.by_name.count(target) && m_cluster)
+                {
+                    // The directory bounces a "does not exist" back if they aren't on any node, so this node can't index it
+                    m_cluster->route(target,user->username,PACMAN::encode_message(MESSAGE,whisper),0);
+                    return;
+                }
+                if (!m_users.by_name.count(target) && m_inbox.enabled() && m_accounts.exists(target))
+                {
+                    std::stringstream stream = get_server_stream();
+                    if (m_inbox.append(target,INBOX_KIND::WHISPER,user->username,message))
+                    {
+                        stream << target << " is offline, they will get your whisper when they log in.";
+                        m_search.add(SearchMessage{{},user->username,target,message});
+                    }
+                    else
+                        stream << target << "'s inbox is full.";
+                    deliver(client,MESSAGE,stream.str());
+                    return;
+                }
+                if (!m_users.by_name.count(target))
+                {
+                    std::stringstream stream = get_server_stream();
+                    stream << target << " does not exist.";
+                    SERVER_MESSAGE(user->username << " attempted to whisper to someone who doesn't exist");
+                    deliver(client,MESSAGE,stream.str());
+                    return;
+                }
+                const auto& targetData = m_users.by_name.at(target);
+                deliver(targetData->socket,MESSAGE,whisper);
+                m_search.add(SearchMessage{{},user->username,target,std::move(message)});
+            };
+        }
+        default:
+            return {};
+    }
+}
+
+// Runs of read-only messages are split across the fan-out threads and prepared against a Database
+// that holds still until the run is over, then finished here in the order they arrived
+// Anything that writes goes through receive() between runs, so every message sees what it would have one at a time
+void ServerCore::receive_all(const std::vector<Received>& batch)
+{
+    std::vector<std::function<void()>> prepared;
+    size_t start = 0;
+    while (start < batch.size())
+    {
+        size_t end = start;
+        while (end < batch.size() && read_only(batch[end].message)) ++end;
+        if (!m_fanout.size() || end - start < RECEIVE_PARALLEL_MIN)
+        {
+            // Not worth waking anyone, or the next one writes
+            const size_t stop = std::max(end,start + 1);
+            for (; start < stop; ++start)
+            {
+                const TRACE::Request traced("request",batch[start].client);
+                if (connected(batch[start].client)) receive(batch[start].client,batch[start].message);
+            }
+            continue;
+        }
+
+        const size_t count = end - start;
+        prepared.assign(count,{});
+        {
+            TRACE_SPAN_ARG("prepare.run",count);
+            const bool traced = TRACE::t_active;
+            m_fanout.run(TRANSPORT_SHARDS,[&](size_t shard)
+            {
+                const TRACE::Inherit inherit(traced);
+                for (size_t i = count * shard / TRANSPORT_SHARDS; i < count * (shard + 1) / TRANSPORT_SHARDS; ++i)
+                {
+                    const Received& received = batch[start + i];
+                    if (connected(received.client)) prepared[i] = prepare(received.client,received.message);
+                }
+            });
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            const TRACE::Request traced("request",batch[start + i].client);
+            if (prepared[i]) prepared[i]();
+        }
+        start = end;
+    }
+}
+
+void ServerCore::receive(SOCKET client, const std::string& from_client)
+{
+    TRACE_SPAN_ARG("dispatch",static_cast<unsigned char>(from_client[0]));
+    if (const std::function<void()> rest = prepare(client,from_client))
+    {
+        rest();
+        return;
+    }
+
+    // Parse Incoming Messages
+    switch (from_client[0])
+    {
+        case DISCONNECT:
+        {
+            disconnect_user(client);
+            return;
+        }
+        case JOIN_ROOM:
+        {
+            if (from_client.size() <= 1)
+            {
+                LOG_WARNING(m_users.by_socket.at(client)->username << " asked to join with no room name.");
+                std::stringstream stream = get_server_stream();
+                stream << "You need to give a room name";
+                deliver(client,MESSAGE,stream.str());
+                return;
+            }
+            join_room(m_users.by_socket.at(client),from_client.c_str()+2);
+            return;
+        }
+        case AUTHENTICATE:
+        {
+            authenticate(m_users.by_socket.at(client),from_client.c_str()+2);
+            return;
+        }
+        case FRIEND_REQUEST:
+        {
+            friend_request(m_users.by_socket.at(client),from_client.c_str()+2);
+            return;
+        }
+        case ADMIN_SHUTOFF:
+        {
+            if (!m_users.is_admin(client))
+            {
+                SERVER_MESSAGE(m_users.by_socket.at(client)->username << " issued a shutdown request as a normal user");
+                deliver(client, MESSAGE, "You have to be an administrator to do this action.");
+                return;
+            }
+            std::stringstream msg = get_server_stream();
+            msg << "Server shutdown has been issued";
+            announce_all(msg.str());
+            isRunning = false;
+            return;
+        }
+        case ADMIN_ANNOUNCE:
+        {
+            if (!m_users.is_admin(client))
+            {
+                SERVER_MESSAGE(m_users.by_socket.at(client)->username << " issued an announcement request as a normal user");
+                deliver(client, MESSAGE, "You have to be an administrator to do this action.");
+                return;
+            }
+            std::string msg = from_client.c_str() + 2;
+            m_filter.apply(msg);
+            std::stringstream announcement = get_server_stream();
+            announcement << msg;
+            announce_all(announcement.str());
+            return;
+        }
+        case ADMIN_BATCH:
+        {
+            run_admin_batch(client,from_client.c_str() + 2);
+            return;
+        }
+        case ADMIN_TRACE:
+        {
+            if (!m_users.is_admin(client))
+            {
+                SERVER_MESSAGE(m_users.by_socket.at(client)->username << " asked for a trace as a normal user");
+                deliver(client, MESSAGE, "You have to be an administrator to do this action.");
+                return;
+            }
+            trace(m_users.by_socket.at(client),from_client.size() > 2 ? from_client.c_str()+2 : "");
+            return;
+        }
+        case SEARCH:
+        {
+            search(m_users.by_socket.at(client),from_client.size() > 2 ? from_client.c_str()+2 : "");
+            return;
+        }
+        case REGISTER:
+        {
+            register_account(m_users.by_socket.at(client),from_client.size() > 2 ? from_client.c_str()+2 : "");
+            return;
+        }
+        case SUBSCRIBE:
+        {
+            std::string roomname = from_client.c_str()+2;
+            std::stringstream stream = get_server_stream();
+            size_t rooms = 0;
+            for (const TopicId topic : m_users.topics.subscriptions_of(client))
+                rooms += m_users.topics.names[topic].compare(0,5,"room:") == 0;
+            if (roomname.empty())
+                stream << "You need to give a room name";
+            else if (!m_users.room_available(roomname))
+                stream << "Rooms need a name of up to " << DATABASE_MAX_ROOM_NAME << " characters, and the server has to have space for another";
+            else if (rooms > DATABASE_MAX_SUBSCRIPTIONS) // Counting the room they are in
+                stream << "You can listen to at most " << DATABASE_MAX_SUBSCRIPTIONS << " other rooms, unsubscribe from one first";
+            else if (m_users.topics.subscribe(client,m_users.topics.intern(room_topic(roomname))))
+                stream << "You are now subscribed to " << roomname;
+            else
+                stream << "You are already receiving " << roomname;
+            deliver(client,MESSAGE,stream.str());
+            return;
+        }
+        case UNSUBSCRIBE:
+        {
+            std::string roomname = from_client.c_str()+2;
+            std::stringstream stream = get_server_stream();
+            TopicId topic;
+            if (roomname == m_users.by_socket.at(client)->room)
+                stream << "You cannot unsubscribe from the room you are in. Use /join instead.";
+            else if (m_users.topics.find(room_topic(roomname),topic) && m_users.topics.unsubscribe(client,topic))
+                stream << "You are no longer subscribed to " << roomname;
+            else
+                stream << "You are not subscribed to " << roomname;
+            deliver(client,MESSAGE,stream.str());
+            return;
+        }
+        case PUBLISH:
+        {
+            std::string rest_of_the_message = from_client.c_str()+2;
+            const auto iter = rest_of_the_message.find(' ');
+            if (iter == std::string::npos)
+            {
+                std::stringstream stream = get_server_stream();
+                stream << "You need to give a room name and a message";
+                deliver(client,MESSAGE,stream.str());
+                return;
+            }
+            std::string roomname = rest_of_the_message.substr(0,iter);
+            TopicId topic;
+            if (!m_users.topics.find(room_topic(roomname),topic) || !m_users.topics.subscribed(client,topic))
+            {
+                std::stringstream stream = get_server_stream();
+                stream << "You have to subscribe to " << roomname << " before publishing to it";
+                deliver(client,MESSAGE,stream.str());
+                return;
+            }
+            std::stringstream formatted_message;
+            formatted_message << "[#" << roomname << "] [" << m_users.by_socket.at(client)->username << "] |" << rest_of_the_message.substr(iter);
+            publish_but(client,room_topic(roomname),formatted_message.str());
+            SERVER_MESSAGE(formatted_message.str());
+            return;
+        }
+        default:
+            LOG_WARNING("Received Unrecognised Code | " << from_client[0]);
+            break;
+    }
+}
+
+void ServerCore::lost(SOCKET client)
+{
+    if (!connected(client)) return;
+    detach_user(client);
+}
+
+void ServerCore::tick(std::chrono::steady_clock::time_point time)
+{
+    now = time;
+    for (const SOCKET expired : m_sessions.expired(now))
+    {
+        SERVER_MESSAGE(m_users.by_socket.at(expired)->username << " did not come back in time");
+        disconnect_user(expired);
+    }
+    m_loop.run_due(time);
+    if (m_memory.due(now)) check_memory();
+}
+
+// Close enough to pick who goes, not a byte count
+size_t ServerCore::footprint(const ClientData& user)
+{
+    size_t bytes = sizeof(ClientData) + user.username.size() + user.room.size();
+    bytes += (user.friends.size() + user.pending.size() + user.requested.size()) * MEMORY_MAP_NODE;
+    bytes += m_users.topics.subscriptions_of(user.socket).size() * MEMORY_TOPIC_BYTES;
+    bytes += PACMAN::buffered(user.socket) + m_transport.queued(user.socket);
+    if (const Session* session = m_sessions.find(user.socket))
+        bytes += sizeof(Session) + session->replay_bytes;
+    return bytes;
+}
+
+void ServerCore::check_memory()
+{
+    std::vector<MemoryUsage> usage;
+    usage.reserve(m_users.by_socket.size());
+    size_t total = m_users.rooms.size() * MEMORY_ROOM_BYTES;
+    for (const auto& user : m_users.by_socket)
+    {
+        usage.push_back(MemoryUsage{user.first,footprint(*user.second)});
+        total += usage.back().bytes;
+    }
+
+    const PRESSURE before = m_memory.pressure;
+    for (const SOCKET socket : m_memory.assess(usage,total))
+    {
+        const auto found = m_users.by_socket.find(socket);
+        if (found == m_users.by_socket.end()) continue;
+        const ClientDataPtr user = found->second; // Copy, dropping erases the entry
+        SERVER_MESSAGE("Evicting " << user->username << " | " << footprint(*user) / 1024 << " KiB");
+        if (!SessionTable::parked(socket)) deliver(socket,REFUSE_CONNECTION,"You were using too much of the server's memory");
+        drop_user(user);
+    }
+    if (m_memory.pressure != before)
+        LOG_WARNING("Memory pressure " << pressure_name(before) << " -> " << pressure_name(m_memory.pressure) << " | " << m_memory.accounted / 1024 << " KiB accounted");
+}
+
+// Traffic from the other nodes in the cluster
+void ServerCore::remote(const BusMessage& message)
+{
+    switch (message.type)
+    {
+        case BUS_CODE::PUBLISH:
+        {
+            publish_local(INVALID_SOCKET,message.key,message.frames);
+            return;
+        }
+        case BUS_CODE::USER:
+        {
+            const auto user = m_users.by_name.find(message.key);
+            if (user == m_users.by_name.end())
+            {
+                // Directory was stale, ask again a limited number of times
+                if (m_cluster && message.hops < CLUSTER_MAX_HOPS)
+                    m_cluster->route(message.key,message.origin,message.frames,message.hops + 1,message.on);
+                return;
+            }
+            const ClientDataPtr target = user->second;
+            deliver_encoded(target->socket,message.frames,TRAFFIC_CLASS::DIRECT);
+            if (message.on)
+            {
+                SERVER_MESSAGE(message.origin << " kicked " << target->username << " from another node");
+                drop_user(target);
+            }
+            return;
+        }
+        case BUS_CODE::CONFLICT:
+        {
+            const auto user = m_users.by_name.find(message.key);
+            if (user == m_users.by_name.end()) return;
+            const ClientDataPtr target = user->second;
+            SERVER_MESSAGE(target->username << " is already connected to another node");
+            deliver(target->socket,REFUSE_CONNECTION,"This username is taken");
+            drop_user(target);
+            return;
+        }
+        case BUS_CODE::LOCATED:
+        {
+            // Nobody is waiting anymore if the lookup already timed out
+            const uint64_t request = std::strtoull(message.origin.c_str(),nullptr,10);
+            m_located[request] = message;
+            m_loop.notify(request);
+            m_located.erase(request);
+            return;
+        }
+        case BUS_CODE::RING_CHANGED:
+        {
+            // Directory entries may live somewhere else now
+            for (const auto& user : m_users.by_name)
+                m_cluster->claim(user.first);
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+void ServerCore::shutdown()
+{
+    std::vector<SOCKET> everyone;
+    for (const auto& user : m_users.by_socket)
+        everyone.push_back(user.first);
+    for (const SOCKET client : everyone)
+    {
+        if (!connected(client)) continue;
+        disconnect_user(client);
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef NETWORK_SERVER_CORE_HPP
+#define NETWORK_SERVER_CORE_HPP
+
+#include "os_diff.hpp"
+#include "NETWORK_CODES.hpp"
+#include "packet_sender.hpp"
+#include "datagram.hpp"
+#include "database.hpp"
+#include "session.hpp"
+#include "transport.hpp"
+#include "cluster.hpp"
+#include "coroutine.hpp"
+#include "fanout.hpp"
+#include "search.hpp"
+#include "memory.hpp"
+#include "filter.hpp"
+#include "inbox.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#define DEFAULT_AUTHENTICATION_CODE "secure_code"
+#define JOIN_COOLDOWN_MS 250
+#define AUTHENTICATION_FAILURE_DELAY_MS 1000 // Guessing codes gets slow without slowing anyone else down
+#define CLUSTER_LOOKUP_TIMEOUT_MS 500
+#define FANOUT_PARALLEL_MIN 512 // Smaller topics aren't worth waking the fan-out threads for
+#define RECEIVE_PARALLEL_MIN 64 // Read-only messages in a row before their handlers are spread over the fan-out threads
+#define TRACE_DUMP_PREFIX "netserver-trace-" // Dumps land in the working directory
+#define INBOX_BATCH_ITEMS 256 // Inbox items per write on login
+#define INBOX_BATCH_BYTES (32 * 1024)
+#define INBOX_PACE_MS 10 // Between batches, the loop gets to everyone else in the gaps
+#define INBOX_BACKLOG_BYTES (128 * 1024) // Queued for them already, the next batch waits until it drains
+#define FRAME_REFRESH_MS 1000 // A connection's window is measured again for its frame size at most this often
+
+// One message as it came off a socket, a pass hands them over in arrival order
+struct Received
+{
+    SOCKET client;
+    std::string message;
+};
+
+/*
+ * Everything the server does short of owning sockets
+ * Whoever owns them feeds events in and replies leave through the Transport
+ */
+struct ServerCore
+{
+    Database m_users{};
+    AccountStore m_accounts{}; // Disabled unless the owner opens a file
+    SessionTable m_sessions{};
+    Transport& m_transport;
+    ClusterNode* m_cluster = nullptr; // Only set when running as part of a cluster
+    bool isRunning = true;
+    bool datagrams_enabled = false;
+    std::string authcode = DEFAULT_AUTHENTICATION_CODE;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    Scheduler m_loop{};
+    WorkerPool m_workers{}; // Empty unless the owner starts it, handlers then stay on the loop thread
+    FanoutPool m_fanout{}; // Same, big topics then go out on one thread
+    SearchIndex m_search{}; // Indexes inline until the owner starts its thread
+    MemoryGuard m_memory{};
+    ContentFilter m_filter{}; // Passes everything until the owner loads a word list
+    InboxStore m_inbox{}; // Disabled unless the owner opens a file, needs accounts to know who can get mail
+    std::set<std::string> m_draining; // Whose inbox is being delivered right now
+    uint64_t m_next_request = 1;
+    std::map<uint64_t,BusMessage> m_located; // Answers to cluster lookups waiting to be picked up
+
+    explicit ServerCore(Transport& transport);
+
+    // Makes session tokens repeatable
+    void seed(uint64_t value);
+    // Topic interest and directory claims start flowing to the other nodes
+    void attach(ClusterNode& cluster);
+    // What the trace rings hold into a new file, returns its name or nothing if it couldn't be written
+    static std::string dump_trace();
+
+    // Events
+    void connect(SOCKET new_client, const sockaddr_in& incoming, const std::string& handshake);
+    void receive(SOCKET client, const std::string& from_client);
+    // receive() on each in turn, runs of read-only messages are prepared on the fan-out threads first
+    void receive_all(const std::vector<Received>& batch);
+    void lost(SOCKET client);
+    void tick(std::chrono::steady_clock::time_point time);
+    void datagrams(const std::vector<DATAGRAM::Datagram>& incoming, std::vector<DATAGRAM::Datagram>& outgoing);
+    void remote(const BusMessage& message);
+    void shutdown();
+    void check_memory(); // Sets the pressure and evicts whoever is over their share
+
+    bool connected(SOCKET client) const { return m_users.by_socket.count(client) != 0; }
+    // After a co_await the user may have left, or left and come back as somebody new
+    bool still_here(const ClientDataPtr& user) const;
+    size_t footprint(const ClientData& user);
+
+    // Outbound
+    bool deliver_encoded(SOCKET socket, const std::string& frames, TRAFFIC_CLASS type);
+    bool deliver(SOCKET socket, NETWORK_CODE header, const std::string& message);
+    size_t frame_for(SOCKET socket, size_t size);
+    void close_connection(SOCKET socket);
+    void publish_local(SOCKET socket, const std::string& topic, const std::string& frames);
+    void publish_but(SOCKET socket, const std::string& topic, const std::string& message);
+    void publish_frames(SOCKET socket, const std::string& topic, const std::string& frames); // Already encoded
+    void publish(const std::string& topic, const std::string& message);
+    void announce_all(const std::string& message);
+    void announce_all_but(SOCKET socket, const std::string& message);
+    void announce_room(const std::string& room, const std::string& message);
+    void announce_room_but(SOCKET socket, const std::string& room, const std::string& message);
+    void announce_all_friends(SOCKET socket, const std::string& message);
+    void announce_admins(const std::string& message);
+
+    // Handlers
+    // The first half of a handler that only reads, safe on any thread while nothing changes the Database
+    // Returns the rest for the loop thread, nothing when the message needs a handler that writes
+    std::function<void()> prepare(SOCKET client, const std::string& from_client);
+    static bool read_only(const std::string& from_client); // prepare() takes it whatever the Database holds
+    void disconnect_user(SOCKET client);
+    void drop_user(const ClientDataPtr& user);
+    void detach_user(SOCKET client);
+    bool resume_user(SOCKET new_client, const sockaddr_in& incoming, const std::string& username, const std::string& resume);
+    bool admit(SOCKET new_client, const sockaddr_in& incoming, const std::string& username, ROLE role, size_t frame);
+    void refuse(SOCKET new_client, const std::string& reason);
+    void grant_admin(const ClientDataPtr& user);
+    void stash_requests(const ClientDataPtr& user);
+    std::string inbox_frames(const ClientDataPtr& user, const InboxItem& item);
+    void run_admin_batch(SOCKET client, const std::string& payload);
+
+    // Handlers that wait on something, they carry the user instead of the socket since that can change
+    Task join_room(ClientDataPtr user, std::string roomname);
+    Task authenticate(ClientDataPtr user, std::string provided_code);
+    Task friend_request(ClientDataPtr sender, std::string userToFriend);
+    Task login(SOCKET new_client, sockaddr_in incoming, std::string username, std::string password, size_t frame);
+    Task register_account(ClientDataPtr user, std::string password);
+    Task search(ClientDataPtr user, std::string query);
+    Task trace(ClientDataPtr user, std::string setting);
+    Task reload_filter(); // Compiles on a worker, the loop swaps it in between messages
+    Task deliver_inbox(std::string username);
+};
+
+#endif //NETWORK_SERVER_CORE_HPP
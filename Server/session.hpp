@@ -0,0 +1,204 @@
+#ifndef NETWORK_SESSION_HPP
+#define NETWORK_SESSION_HPP
+
+#include "packet_sender.hpp"
+#include "os_diff.hpp"
+#include "datagram.hpp"
+#include "hash.hpp"
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdint>
+
+#define SESSION_REPLAY_MESSAGES 512
+#define SESSION_REPLAY_BYTES (1024 * 1024)
+#define SESSION_GRACE_SECONDS 60
+
+// Parked sessions are keyed above any real socket so they can never collide
+#define PARKED_SOCKET_BASE (1ull << 62)
+
+/*
+ * Every message sent to a session gets the next sequence number
+ * The client counts what it received and hands that back when it reconnects
+ * Anything after that count is replayed from the buffer
+ */
+
+struct ReplayEntry
+{
+    uint64_t sequence;
+    std::string frames; // Already encoded, replayed as is
+};
+
+struct Session
+{
+    std::string token;
+    uint64_t sequence = 0; // Last sequence number handed out
+    std::deque<ReplayEntry> replay;
+    size_t replay_bytes = 0;
+    bool detached = false;
+    std::chrono::steady_clock::time_point detached_at;
+
+    // Datagram side channel, the peer is learnt from the first valid datagram
+    uint32_t datagram_id = 0;
+    DATAGRAM::Key datagram_key{};
+    sockaddr_in datagram_peer{};
+    bool datagram_bound = false;
+
+    // Largest frame the client agreed to, and the one replies go out in while the connection keeps up
+    size_t frame_limit = PACMAN::packet_size;
+    size_t frame = PACMAN::packet_size;
+    std::chrono::steady_clock::time_point frame_checked{};
+
+    void record(const std::string& frames)
+    {
+        replay.push_back(ReplayEntry{++sequence,frames});
+        replay_bytes += frames.size();
+        while (replay.size() > SESSION_REPLAY_MESSAGES || replay_bytes > SESSION_REPLAY_BYTES)
+        {
+            replay_bytes -= replay.front().frames.size();
+            replay.pop_front();
+        }
+    }
+
+    // The client confirmed it has these, no need to hold them for a replay
+    void acknowledge(uint64_t received)
+    {
+        while (!replay.empty() && replay.front().sequence <= received)
+        {
+            replay_bytes -= replay.front().frames.size();
+            replay.pop_front();
+        }
+    }
+
+    // Whether everything after the client's last received message is still buffered
+    bool covers(uint64_t received) const
+    {
+        if (received > sequence) return false;
+        if (replay.empty()) return received == sequence;
+        return received + 1 >= replay.front().sequence;
+    }
+};
+
+struct SessionTable
+{
+    std::map<SOCKET,Session> sessions;
+    std::map<std::string,SOCKET> tokens;
+    std::map<uint32_t,SOCKET> datagram_ids;
+    SOCKET next_parked = PARKED_SOCKET_BASE;
+    uint32_t next_datagram = 1;
+    // Tokens are secrets, they come from the OS unless a replay seeded this to get the same ones every run
+    std::mt19937_64 generator{};
+    bool seeded = false;
+
+    static bool parked(SOCKET socket) { return socket >= PARKED_SOCKET_BASE; }
+
+    Session* find(SOCKET socket)
+    {
+        const auto found = sessions.find(socket);
+        return found == sessions.end() ? nullptr : &found->second;
+    }
+
+    Session* find_datagram(uint32_t id, SOCKET& socket)
+    {
+        const auto found = datagram_ids.find(id);
+        if (found == datagram_ids.end()) return nullptr;
+        socket = found->second;
+        return find(socket);
+    }
+
+    bool find_token(const std::string& token, SOCKET& socket) const
+    {
+        const auto found = tokens.find(token);
+        if (found == tokens.end()) return false;
+        socket = found->second;
+        return true;
+    }
+
+    const std::string& open(SOCKET socket)
+    {
+        Session& session = sessions[socket];
+        do session.token = make_token(); while (tokens.count(session.token));
+        tokens[session.token] = socket;
+        session.datagram_id = next_datagram++;
+        session.datagram_key = DATAGRAM::derive_key(session.token);
+        datagram_ids[session.datagram_id] = socket;
+        return session.token;
+    }
+
+    void close(SOCKET socket)
+    {
+        const auto found = sessions.find(socket);
+        if (found == sessions.end()) return;
+        tokens.erase(found->second.token);
+        datagram_ids.erase(found->second.datagram_id);
+        sessions.erase(found);
+    }
+
+    void rekey(SOCKET from, SOCKET to)
+    {
+        const auto found = sessions.find(from);
+        if (found == sessions.end()) return;
+        Session session = std::move(found->second);
+        sessions.erase(found);
+        tokens[session.token] = to;
+        datagram_ids[session.datagram_id] = to;
+        sessions[to] = std::move(session);
+    }
+
+    // Moves a session onto a parked key and starts the grace period
+    SOCKET park(SOCKET socket, std::chrono::steady_clock::time_point now)
+    {
+        const SOCKET key = next_parked++;
+        rekey(socket,key);
+        Session& session = sessions.at(key);
+        session.detached = true;
+        session.detached_at = now;
+        session.datagram_bound = false;
+        return key;
+    }
+
+    void attach(SOCKET parked_key, SOCKET socket)
+    {
+        rekey(parked_key,socket);
+        sessions.at(socket).detached = false;
+    }
+
+    std::vector<SOCKET> expired(std::chrono::steady_clock::time_point now) const
+    {
+        std::vector<SOCKET> output;
+        for (auto it = sessions.lower_bound(PARKED_SOCKET_BASE); it != sessions.end(); ++it)
+        {
+            if (now - it->second.detached_at >= std::chrono::seconds(SESSION_GRACE_SECONDS))
+                output.push_back(it->first);
+        }
+        return output;
+    }
+
+    size_t parked_count() const
+    {
+        return std::distance(sessions.lower_bound(PARKED_SOCKET_BASE),sessions.end());
+    }
+
+private:
+    std::string make_token()
+    {
+        static const char hex[] = "0123456789abcdef";
+        uint64_t words[2];
+        if (seeded) for (uint64_t& word : words) word = generator();
+        else HASH::random_bytes(words,sizeof(words));
+        std::string token;
+        for (int i = 0; i < 2; ++i)
+        {
+            uint64_t bits = words[i];
+            for (int j = 0; j < 16; ++j, bits >>= 4)
+                token.push_back(hex[bits & 0xF]);
+        }
+        return token;
+    }
+};
+
+#endif //NETWORK_SESSION_HPP
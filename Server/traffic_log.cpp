@@ -0,0 +1,101 @@
+#include "traffic_log.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+
+template <typename T>
+static void write_value(std::ofstream& file, T value)
+{
+    file.write(reinterpret_cast<const char*>(&value),sizeof(value));
+}
+
+template <typename T>
+static bool read_value(std::ifstream& file, T& value)
+{
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(&value),sizeof(value)));
+}
+
+bool TrafficRecorder::open(const std::string& path)
+{
+    file.open(path,std::ios::binary | std::ios::trunc);
+    start = std::chrono::steady_clock::now();
+    return file.is_open();
+}
+
+void TrafficRecorder::record(TRAFFIC_EVENT type, SOCKET socket, const sockaddr_in& address, const std::string& payload)
+{
+    if (!file.is_open()) return;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    write_value<unsigned char>(file,static_cast<unsigned char>(type));
+    write_value<uint64_t>(file,std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    write_value<uint64_t>(file,socket);
+    write_value<uint32_t>(file,address.sin_addr.s_addr);
+    write_value<uint16_t>(file,address.sin_port);
+    write_value<uint32_t>(file,static_cast<uint32_t>(payload.size()));
+    file.write(payload.c_str(),payload.size());
+}
+
+bool load_traffic(const std::string& path, std::vector<TrafficEvent>& events)
+{
+    std::ifstream file(path,std::ios::binary);
+    if (!file.is_open()) return false;
+
+    unsigned char type;
+    while (read_value(file,type))
+    {
+        TrafficEvent event{};
+        uint64_t socket;
+        uint32_t address;
+        uint16_t port;
+        uint32_t length;
+        if (!read_value(file,event.micros) || !read_value(file,socket) || !read_value(file,address) ||
+            !read_value(file,port) || !read_value(file,length))
+        {
+            LOG_WARNING("Traffic log ends in the middle of a record");
+            break;
+        }
+        event.type = static_cast<TRAFFIC_EVENT>(type);
+        event.socket = socket;
+        event.address.sin_family = AF_INET;
+        event.address.sin_addr.s_addr = address;
+        event.address.sin_port = port;
+        event.payload.resize(length);
+        if (!file.read(&event.payload[0],length) && length)
+        {
+            LOG_WARNING("Traffic log ends in the middle of a record");
+            break;
+        }
+        events.emplace_back(std::move(event));
+    }
+    return true;
+}
+
+ReplayStats replay_traffic(const std::vector<TrafficEvent>& events, ServerCore& core, LoopbackTransport& transport)
+{
+    const std::chrono::steady_clock::time_point base{};
+    const auto started = std::chrono::steady_clock::now();
+    ReplayStats stats;
+    for (const TrafficEvent& event : events)
+    {
+        core.tick(base + std::chrono::microseconds(event.micros));
+        switch (event.type)
+        {
+            case TRAFFIC_EVENT::CONNECT:
+                core.connect(event.socket,event.address,event.payload);
+                break;
+            case TRAFFIC_EVENT::MESSAGE:
+                if (core.connected(event.socket))
+                    core.receive(event.socket,event.payload);
+                break;
+            case TRAFFIC_EVENT::LOST:
+                core.lost(event.socket);
+                break;
+        }
+        ++stats.events;
+        if (!core.isRunning) break;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    stats.messages_sent = transport.messages_sent;
+    stats.bytes_sent = transport.bytes_sent;
+    return stats;
+}
@@ -0,0 +1,58 @@
+#ifndef NETWORK_TRAFFIC_LOG_HPP
+#define NETWORK_TRAFFIC_LOG_HPP
+
+#include "os_diff.hpp"
+#include "server_core.hpp"
+#include "transport.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Captures what the server core was fed so it can be fed again without sockets
+ * Record Format | TYPE(1) MICROSECONDS(8) SOCKET(8) ADDRESS(4) PORT(2) LENGTH(4) PAYLOAD(LENGTH)
+ */
+
+enum class TRAFFIC_EVENT : unsigned char
+{
+    CONNECT,
+    MESSAGE,
+    LOST
+};
+
+struct TrafficEvent
+{
+    TRAFFIC_EVENT type;
+    uint64_t micros; // Since recording started
+    SOCKET socket;
+    sockaddr_in address;
+    std::string payload; // Handshake for CONNECT, the received message for MESSAGE
+};
+
+struct TrafficRecorder
+{
+    std::ofstream file;
+    std::chrono::steady_clock::time_point start;
+
+    bool open(const std::string& path);
+    void record(TRAFFIC_EVENT type, SOCKET socket, const sockaddr_in& address, const std::string& payload);
+    void flush() { if (file.is_open()) file.flush(); }
+};
+
+struct ReplayStats
+{
+    size_t events = 0;
+    size_t messages_sent = 0;
+    size_t bytes_sent = 0;
+    double seconds = 0;
+};
+
+bool load_traffic(const std::string& path, std::vector<TrafficEvent>& events);
+
+// Replays against a fresh core, timestamps drive the core's clock so session expiry lines up too
+ReplayStats replay_traffic(const std::vector<TrafficEvent>& events, ServerCore& core, LoopbackTransport& transport);
+
+#endif //NETWORK_TRAFFIC_LOG_HPP
@@ -0,0 +1,243 @@
+#ifndef NETWORK_TRANSPORT_HPP
+#define NETWORK_TRANSPORT_HPP
+
+#include "os_diff.hpp"
+#include "packet_sender.hpp"
+#include "tls.hpp"
+#include "outbound.hpp"
+#include "trace.hpp"
+
+#include <string>
+#include <map>
+#include <set>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#define TRANSPORT_SHARDS 16
+
+/*
+ * Where the server core's outbound frames go
+ * SocketTransport is the real thing, LoopbackTransport keeps everything in memory
+ * Per connection state is split into shards by socket, sends for sockets in different shards
+ * can run on different threads at the same time
+ */
+
+inline size_t transport_shard(SOCKET socket) { return static_cast<size_t>(socket % TRANSPORT_SHARDS); }
+
+struct Transport
+{
+    // Tracked messages pass through here in the order the peer will see them
+    // Whatever is still queued when a connection closes comes through too, as if it had gone out
+    std::function<void(SOCKET,const std::string&)> on_wire;
+
+    virtual ~Transport() = default;
+    virtual void watch(SOCKET) {} // Connection is in, its messages can start arriving
+    virtual bool sharded() const { return false; } // send() is safe from one thread per shard
+    virtual size_t queued(SOCKET) const { return 0; } // Bytes accepted but not on the wire yet
+    // Bytes the connection can have in flight per round trip and its segment size, 0 when there's no telling
+    virtual size_t window(SOCKET, size_t& segment) const { segment = 0; return 0; }
+    virtual bool send(SOCKET socket, const std::string& frames, TRAFFIC_CLASS type, bool tracked) = 0;
+    virtual void disconnect(SOCKET socket) = 0;
+};
+
+// Owns the select() set so closing a connection also stops watching it
+struct SocketTransport : Transport
+{
+    fd_set watched;
+    std::set<SOCKET> open;
+    std::map<SOCKET,OutboundQueue> outbound[TRANSPORT_SHARDS]; // Only connections that are backed up
+
+    SocketTransport() { FD_ZERO(&watched); }
+
+    bool sharded() const override { return true; }
+
+    void watch(SOCKET socket) override
+    {
+        FD_SET(socket,&watched);
+        open.insert(socket);
+    }
+
+    SOCKET highest() const { return open.empty() ? 0 : *open.rbegin(); }
+
+    size_t queued(SOCKET socket) const override
+    {
+        const auto& backed_up = outbound[transport_shard(socket)];
+        const auto found = backed_up.find(socket);
+        if (found == backed_up.end()) return 0;
+        return found->second.queued + found->second.current.size() - found->second.offset;
+    }
+
+    size_t window(SOCKET socket, size_t& segment) const override
+    {
+        segment = 0;
+#ifdef __linux__
+        tcp_info info{};
+        socklen_t length = sizeof(info);
+        if (getsockopt(socket,IPPROTO_TCP,TCP_INFO,&info,&length) != 0 || !info.tcpi_snd_mss) return 0;
+        segment = info.tcpi_snd_mss;
+        return static_cast<size_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+#else
+        return 0;
+#endif
+    }
+
+    // Goes straight out when the socket has room, the queue only exists while it doesn't
+    bool send(SOCKET socket, const std::string& frames, TRAFFIC_CLASS type, bool tracked) override
+    {
+        TRACE_SPAN_ARG("send",socket);
+        auto& backed_up = outbound[transport_shard(socket)];
+        auto found = backed_up.find(socket);
+        if (found != backed_up.end())
+        {
+            OutboundQueue& queue = found->second;
+            if (!queue.push(type,frames,tracked)) return false;
+            pump(socket,queue);
+            return !queue.broken;
+        }
+
+        if (tracked && on_wire) on_wire(socket,frames);
+        size_t sent = 0;
+        while (sent < frames.size())
+        {
+            const int result = TLS::try_send(socket,frames.data() + sent,static_cast<int>(frames.size() - sent));
+            if (result > 0)
+            {
+                sent += result;
+                continue;
+            }
+            OutboundQueue& queue = backed_up[socket];
+            queue.current = frames;
+            queue.offset = sent;
+            queue.broken = !(result < 0 && SOCKET_WOULD_BLOCK);
+            return !queue.broken;
+        }
+        return true;
+    }
+
+    // Connections with something left to write, false if there are none
+    bool fill_writes(fd_set& set, SOCKET& highest) const
+    {
+        bool any = false;
+        for (const auto& shard : outbound)
+        {
+            for (const auto& entry : shard)
+            {
+                if (entry.second.broken) continue;
+                FD_SET(entry.first,&set);
+                highest = std::max(highest,entry.first);
+                any = true;
+            }
+        }
+        return any;
+    }
+
+    void flush(const fd_set& set)
+    {
+        for (auto& shard : outbound)
+        {
+            for (auto entry = shard.begin(); entry != shard.end();)
+            {
+                if (FD_ISSET(entry->first,&set)) pump(entry->first,entry->second);
+                if (entry->second.idle()) entry = shard.erase(entry);
+                else ++entry;
+            }
+        }
+    }
+
+    void disconnect(SOCKET socket) override
+    {
+        auto& backed_up = outbound[transport_shard(socket)];
+        const auto found = backed_up.find(socket);
+        if (found != backed_up.end())
+        {
+            pump(socket,found->second); // Last chance for whatever fits
+            OutboundQueue::Pending left;
+            while (found->second.next(left))
+                if (left.tracked && on_wire) on_wire(socket,left.frames);
+            backed_up.erase(found);
+        }
+        FD_CLR(socket,&watched);
+        open.erase(socket);
+        PACMAN::forget(socket);
+        TLS::release(socket);
+        CLOSE_SOCKET(socket);
+    }
+
+private:
+    void pump(SOCKET socket, OutboundQueue& queue)
+    {
+        TRACE_SPAN_ARG("pump",socket);
+        while (!queue.broken)
+        {
+            if (!queue.writing())
+            {
+                OutboundQueue::Pending next;
+                if (!queue.next(next)) return;
+                if (next.tracked && on_wire) on_wire(socket,next.frames);
+                queue.current = std::move(next.frames);
+                queue.offset = 0;
+            }
+            const int result = TLS::try_send(socket,queue.current.data() + queue.offset,static_cast<int>(queue.current.size() - queue.offset));
+            if (result > 0)
+            {
+                queue.offset += result;
+                continue;
+            }
+            if (result < 0 && SOCKET_WOULD_BLOCK) return;
+            queue.broken = true;
+        }
+    }
+};
+
+// No kernel involved, frames pile up per socket until somebody takes them
+struct LoopbackTransport : Transport
+{
+    std::map<SOCKET,std::string> outbox[TRANSPORT_SHARDS];
+    std::set<SOCKET> closed;
+    std::atomic<size_t> messages_sent{0};
+    std::atomic<size_t> bytes_sent{0};
+    bool keep_frames = true; // Benchmarks only want the counters
+
+    bool sharded() const override { return true; }
+
+    bool send(SOCKET socket, const std::string& frames, TRAFFIC_CLASS, bool tracked) override
+    {
+        if (tracked && on_wire) on_wire(socket,frames);
+        messages_sent.fetch_add(1,std::memory_order_relaxed);
+        bytes_sent.fetch_add(frames.size(),std::memory_order_relaxed);
+        if (keep_frames) outbox[transport_shard(socket)][socket] += frames;
+        return true;
+    }
+
+    void disconnect(SOCKET socket) override
+    {
+        closed.insert(socket);
+    }
+
+    std::string take(SOCKET socket)
+    {
+        auto& shard = outbox[transport_shard(socket)];
+        const auto found = shard.find(socket);
+        if (found == shard.end()) return {};
+        std::string frames = std::move(found->second);
+        shard.erase(found);
+        return frames;
+    }
+
+    void reset()
+    {
+        for (auto& shard : outbox)
+            shard.clear();
+        closed.clear();
+        messages_sent = 0;
+        bytes_sent = 0;
+    }
+};
+
+#endif //NETWORK_TRANSPORT_HPP
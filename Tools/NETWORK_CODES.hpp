@@ -15,7 +15,20 @@ enum NETWORK_CODE : unsigned char
     ADMIN_ANNOUNCE,
     TAIL_CODE_END,
     TAIL_CODE_CONTINUE,
-    REFUSE_CONNECTION
+    REFUSE_CONNECTION,
+    ADMIN_BATCH,
+    SUBSCRIBE,
+    UNSUBSCRIBE,
+    PUBLISH,
+    SESSION_TOKEN,
+    SESSION_RESUME,
+    DATAGRAM_SESSION,
+    REGISTER,
+    LOGIN, // Only in the handshake, USERNAME<LOGIN>PASSWORD
+    SEARCH,
+    ADMIN_TRACE, // "dump" writes the trace rings to a file, a number samples one request in that many
+    ECHO, // Sent straight back, scripts use it to tell when the server got to their line
+    FRAME_SIZE // USERNAME<FRAME_SIZE>BYTES in the handshake asks for bigger frames, the server answers with what it will send
 };
 
 #endif //NETWORK_NETWORK_CODES_HPP
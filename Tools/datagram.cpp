@@ -0,0 +1,231 @@
+#include "datagram.hpp"
+#include "hash.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+namespace DATAGRAM
+{
+    const static int tag_offset = 4;
+    const static int tag_size = 8;
+
+    void put_u32(char* output, uint32_t value)
+    {
+        for (int i = 3; i >= 0; --i, value >>= 8)
+            output[i] = static_cast<char>(value & 0xFF);
+    }
+
+    uint32_t get_u32(const char* input)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i)
+            value = (value << 8) | static_cast<unsigned char>(input[i]);
+        return value;
+    }
+
+    // SipHash reads its words little endian
+    uint64_t get_u64_le(const char* input)
+    {
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; --i)
+            value = (value << 8) | static_cast<unsigned char>(input[i]);
+        return value;
+    }
+
+    uint64_t rotate(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    void sip_round(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+    {
+        v0 += v1; v1 = rotate(v1,13); v1 ^= v0; v0 = rotate(v0,32);
+        v2 += v3; v3 = rotate(v3,16); v3 ^= v2;
+        v0 += v3; v3 = rotate(v3,21); v3 ^= v0;
+        v2 += v1; v1 = rotate(v1,17); v1 ^= v2; v2 = rotate(v2,32);
+    }
+
+    // SipHash-2-4, a MAC built for short inputs like these
+    uint64_t siphash(const Key& key, const char* data, size_t size)
+    {
+        uint64_t v0 = 0x736f6d6570736575ull ^ key.k0;
+        uint64_t v1 = 0x646f72616e646f6dull ^ key.k1;
+        uint64_t v2 = 0x6c7967656e657261ull ^ key.k0;
+        uint64_t v3 = 0x7465646279746573ull ^ key.k1;
+
+        const size_t whole = size - size % 8;
+        for (size_t i = 0; i < whole; i += 8)
+        {
+            const uint64_t word = get_u64_le(data + i);
+            v3 ^= word;
+            sip_round(v0,v1,v2,v3);
+            sip_round(v0,v1,v2,v3);
+            v0 ^= word;
+        }
+        uint64_t last = static_cast<uint64_t>(size) << 56;
+        for (size_t i = whole; i < size; ++i)
+            last |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << ((i - whole) * 8);
+        v3 ^= last;
+        sip_round(v0,v1,v2,v3);
+        sip_round(v0,v1,v2,v3);
+        v0 ^= last;
+
+        v2 ^= 0xFF;
+        for (int i = 0; i < 4; ++i)
+            sip_round(v0,v1,v2,v3);
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    // Everything but the tag itself goes into the tag
+    void make_tag(const Key& key, const char* packet, size_t size, char* output)
+    {
+        char covered[max_datagram];
+        memcpy(covered,packet,tag_offset);
+        memcpy(covered + tag_offset,packet + tag_offset + tag_size,size - tag_offset - tag_size);
+        uint64_t tag = siphash(key,covered,size - tag_size);
+        for (int i = 0; i < tag_size; ++i, tag >>= 8)
+            output[i] = static_cast<char>(tag & 0xFF);
+    }
+
+    Key derive_key(const std::string& secret)
+    {
+        const HASH::Digest derived = HASH::hkdf_sha256(secret,"PACMAN DATAGRAM","siphash-2-4 tag key");
+        const char* bytes = reinterpret_cast<const char*>(derived.data());
+        return Key{get_u64_le(bytes),get_u64_le(bytes + 8)};
+    }
+
+    std::string encode(uint32_t session, const Key& key, EVENT type, const std::string& payload)
+    {
+        const size_t length = payload.size() > max_payload ? max_payload : payload.size();
+        std::string packet(header_size + length,'\0');
+        put_u32(&packet[0],session);
+        packet[12] = static_cast<char>(type);
+        packet[13] = static_cast<char>(length);
+        memcpy(&packet[header_size],payload.c_str(),length);
+        make_tag(key,packet.c_str(),packet.size(),&packet[tag_offset]);
+        return packet;
+    }
+
+    bool peek_session(const std::string& bytes, uint32_t& session)
+    {
+        if (bytes.size() < header_size) return false;
+        session = get_u32(bytes.c_str());
+        return true;
+    }
+
+    bool decode(const std::string& bytes, const Key& key, Event& output)
+    {
+        if (bytes.size() < header_size) return false;
+        const size_t length = static_cast<unsigned char>(bytes[13]);
+        if (bytes.size() != header_size + length) return false;
+        char expected[tag_size];
+        make_tag(key,bytes.c_str(),bytes.size(),expected);
+        if (!HASH::equal(reinterpret_cast<const uint8_t*>(expected),reinterpret_cast<const uint8_t*>(bytes.c_str() + tag_offset),tag_size)) return false;
+
+        output.session = get_u32(bytes.c_str());
+        output.type = static_cast<EVENT>(bytes[12]);
+        output.payload.assign(bytes,header_size,length);
+        return true;
+    }
+
+    std::string pack_u64(uint64_t value)
+    {
+        std::string output(8,'\0');
+        for (int i = 7; i >= 0; --i, value >>= 8)
+            output[i] = static_cast<char>(value & 0xFF);
+        return output;
+    }
+
+    uint64_t unpack_u64(const std::string& bytes)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8 && i < bytes.size(); ++i)
+            value = (value << 8) | static_cast<unsigned char>(bytes[i]);
+        return value;
+    }
+
+#ifdef __linux__
+    size_t receive_batch(SOCKET socket, std::vector<Datagram>& output)
+    {
+        static thread_local char buffers[batch_size][max_datagram];
+        mmsghdr headers[batch_size]{};
+        iovec vectors[batch_size]{};
+        sockaddr_in peers[batch_size]{};
+        for (int i = 0; i < batch_size; ++i)
+        {
+            vectors[i].iov_base = buffers[i];
+            vectors[i].iov_len = max_datagram;
+            headers[i].msg_hdr.msg_iov = &vectors[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+            headers[i].msg_hdr.msg_name = &peers[i];
+            headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+
+        const int received = recvmmsg(static_cast<int>(socket),headers,batch_size,MSG_DONTWAIT,nullptr);
+        if (received <= 0) return 0;
+        for (int i = 0; i < received; ++i)
+            output.push_back(Datagram{peers[i],std::string(buffers[i],headers[i].msg_len)});
+        return received;
+    }
+
+    size_t send_batch(SOCKET socket, const std::vector<Datagram>& datagrams)
+    {
+        size_t sent = 0;
+        while (sent < datagrams.size())
+        {
+            const size_t count = std::min<size_t>(batch_size,datagrams.size() - sent);
+            mmsghdr headers[batch_size]{};
+            iovec vectors[batch_size]{};
+            for (size_t i = 0; i < count; ++i)
+            {
+                const Datagram& datagram = datagrams[sent + i];
+                vectors[i].iov_base = const_cast<char*>(datagram.bytes.c_str());
+                vectors[i].iov_len = datagram.bytes.size();
+                headers[i].msg_hdr.msg_iov = &vectors[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+                headers[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&datagram.peer);
+                headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+            const int result = sendmmsg(static_cast<int>(socket),headers,count,MSG_DONTWAIT);
+            if (result <= 0)
+            {
+                LOG_WARNING("sendmmsg() dropped " << datagrams.size() - sent << " datagrams");
+                break;
+            }
+            sent += result;
+        }
+        return sent;
+    }
+#else
+    size_t receive_batch(SOCKET socket, std::vector<Datagram>& output)
+    {
+        size_t received = 0;
+        char buffer[max_datagram];
+        while (received < batch_size)
+        {
+            sockaddr_in peer{};
+            sockaddr_length peer_size = sizeof(peer);
+            const int result = recvfrom(socket,buffer,max_datagram,0,reinterpret_cast<sockaddr*>(&peer),&peer_size);
+            if (result <= 0) break; // Would block
+            output.push_back(Datagram{peer,std::string(buffer,result)});
+            ++received;
+        }
+        return received;
+    }
+
+    size_t send_batch(SOCKET socket, const std::vector<Datagram>& datagrams)
+    {
+        size_t sent = 0;
+        for (const Datagram& datagram : datagrams)
+        {
+            const int result = sendto(socket,datagram.bytes.c_str(),static_cast<int>(datagram.bytes.size()),0,
+                                      reinterpret_cast<const sockaddr*>(&datagram.peer),sizeof(datagram.peer));
+            if (result < 0) continue;
+            ++sent;
+        }
+        return sent;
+    }
+#endif
+}
@@ -0,0 +1,63 @@
+#ifndef NETWORK_DATAGRAM_HPP
+#define NETWORK_DATAGRAM_HPP
+
+#include "os_diff.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Unreliable side channel for events that are fine to lose
+ * Wire Format | SESSION(4) TAG(8) TYPE(1) LENGTH(1) PAYLOAD(LENGTH)
+ * The tag is SipHash-2-4 under a key both sides run the session token through HKDF for
+ */
+
+namespace DATAGRAM
+{
+    const static int header_size = 14;
+    const static int max_payload = 255;
+    const static int max_datagram = header_size + max_payload;
+    const static int batch_size = 64;
+
+    enum EVENT : unsigned char
+    {
+        PRESENCE = 1,
+        TYPING,
+        READ_RECEIPT
+    };
+
+    struct Event
+    {
+        uint32_t session;
+        EVENT type;
+        std::string payload;
+    };
+
+    struct Datagram
+    {
+        sockaddr_in peer;
+        std::string bytes;
+    };
+
+    struct Key
+    {
+        uint64_t k0 = 0;
+        uint64_t k1 = 0;
+    };
+
+    Key derive_key(const std::string& secret);
+
+    std::string encode(uint32_t session, const Key& key, EVENT type, const std::string& payload);
+    bool peek_session(const std::string& bytes, uint32_t& session);
+    bool decode(const std::string& bytes, const Key& key, Event& output);
+
+    std::string pack_u64(uint64_t value);
+    uint64_t unpack_u64(const std::string& bytes);
+
+    // Uses recvmmsg/sendmmsg where available, the socket must be non-blocking
+    size_t receive_batch(SOCKET socket, std::vector<Datagram>& output);
+    size_t send_batch(SOCKET socket, const std::vector<Datagram>& datagrams);
+}
+
+#endif //NETWORK_DATAGRAM_HPP
@@ -0,0 +1,270 @@
+#include "hash.hpp"
+#include "logging.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <bcrypt.h>
+#pragma comment(lib,"bcrypt.lib")
+#elif __linux__
+#include <sys/random.h>
+#include <cerrno>
+#include <cstdio>
+#endif
+
+bool HASH::equal(const uint8_t* a, const uint8_t* b, size_t size)
+{
+    uint8_t difference = 0;
+    for (size_t i = 0; i < size; ++i)
+        difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+HASH::Digest HASH::hkdf_sha256(const std::string& secret, const std::string& salt, const std::string& info)
+{
+    const Digest extracted = hmac_sha256(salt,secret.data(),secret.size());
+    const std::string pseudo_random(reinterpret_cast<const char*>(extracted.data()),extracted.size());
+    const std::string first = info + '\1';
+    return hmac_sha256(pseudo_random,first.data(),first.size());
+}
+
+#ifdef NETWORK_WITH_TLS
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+
+namespace HASH
+{
+    Digest sha256(const void* data, size_t size)
+    {
+        Digest digest;
+        SHA256(static_cast<const unsigned char*>(data),size,digest.data());
+        return digest;
+    }
+
+    Digest hmac_sha256(const std::string& key, const void* data, size_t size)
+    {
+        Digest digest;
+        unsigned int length = static_cast<unsigned int>(digest.size());
+        HMAC(EVP_sha256(),key.data(),static_cast<int>(key.size()),static_cast<const unsigned char*>(data),size,digest.data(),&length);
+        return digest;
+    }
+
+    Digest pbkdf2_sha256(const std::string& password, const uint8_t* salt, size_t salt_size, uint32_t iterations)
+    {
+        Digest digest;
+        PKCS5_PBKDF2_HMAC(password.data(),static_cast<int>(password.size()),salt,static_cast<int>(salt_size),
+                          static_cast<int>(iterations),EVP_sha256(),static_cast<int>(digest.size()),digest.data());
+        return digest;
+    }
+
+    void random_bytes(void* output, size_t size)
+    {
+        if (RAND_bytes(static_cast<unsigned char*>(output),static_cast<int>(size)) == 1) return;
+        LOG_ERROR("No randomness to be had from OpenSSL");
+        std::abort();
+    }
+
+    const char* backend() { return "openssl"; }
+}
+
+#else
+
+// The OS generator, OpenSSL builds use RAND_bytes instead
+static bool system_random(void* output, size_t size)
+{
+#ifdef _WIN32
+    return BCRYPT_SUCCESS(BCryptGenRandom(nullptr,static_cast<PUCHAR>(output),static_cast<ULONG>(size),BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+#elif __linux__
+    uint8_t* at = static_cast<uint8_t*>(output);
+    while (size)
+    {
+        const ssize_t got = getrandom(at,size,0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0)
+        {
+            // Kernels older than getrandom() still have the device
+            std::FILE* device = std::fopen("/dev/urandom","rb");
+            if (!device) return false;
+            const bool read = std::fread(at,1,size,device) == size;
+            std::fclose(device);
+            return read;
+        }
+        at += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+namespace HASH
+{
+    static const uint32_t m_round_constants[64] = {
+        0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+        0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+        0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+        0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+        0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+        0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+        0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+        0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+    };
+
+    struct State
+    {
+        uint32_t h[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+        uint8_t block[64]{};
+        size_t filled = 0;
+        uint64_t total = 0;
+    };
+
+    static inline uint32_t rotate(uint32_t value, int bits) { return (value >> bits) | (value << (32 - bits)); }
+
+    static void compress(uint32_t h[8], const uint8_t* block)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = uint32_t(block[i * 4]) << 24 | uint32_t(block[i * 4 + 1]) << 16 | uint32_t(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+        for (int i = 16; i < 64; ++i)
+        {
+            const uint32_t s0 = rotate(w[i - 15],7) ^ rotate(w[i - 15],18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotate(w[i - 2],17) ^ rotate(w[i - 2],19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            const uint32_t t1 = k + (rotate(e,6) ^ rotate(e,11) ^ rotate(e,25)) + ((e & f) ^ (~e & g)) + m_round_constants[i] + w[i];
+            const uint32_t t2 = (rotate(a,2) ^ rotate(a,13) ^ rotate(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+
+    static void update(State& state, const uint8_t* data, size_t size)
+    {
+        state.total += size;
+        while (size)
+        {
+            const size_t take = std::min(size,64 - state.filled);
+            std::memcpy(state.block + state.filled,data,take);
+            state.filled += take;
+            data += take;
+            size -= take;
+            if (state.filled == 64)
+            {
+                compress(state.h,state.block);
+                state.filled = 0;
+            }
+        }
+    }
+
+    static Digest finish(State state)
+    {
+        const uint64_t bits = state.total * 8;
+        const uint8_t pad = 0x80;
+        const uint8_t zero = 0;
+        update(state,&pad,1);
+        while (state.filled != 56)
+            update(state,&zero,1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i)
+            length[i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+        update(state,length,8);
+
+        Digest digest;
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 4; ++j)
+                digest[i * 4 + j] = static_cast<uint8_t>(state.h[i] >> (24 - j * 8));
+        return digest;
+    }
+
+    Digest sha256(const void* data, size_t size)
+    {
+        State state;
+        update(state,static_cast<const uint8_t*>(data),size);
+        return finish(state);
+    }
+
+    // Key padding hashed once, every HMAC after that starts from these
+    struct Keyed
+    {
+        State inner;
+        State outer;
+
+        explicit Keyed(const std::string& key)
+        {
+            uint8_t block[64]{};
+            if (key.size() > 64)
+            {
+                const Digest folded = sha256(key.data(),key.size());
+                std::memcpy(block,folded.data(),folded.size());
+            }
+            else
+                std::memcpy(block,key.data(),key.size());
+
+            uint8_t pad[64];
+            for (int i = 0; i < 64; ++i) pad[i] = block[i] ^ 0x36;
+            update(inner,pad,64);
+            for (int i = 0; i < 64; ++i) pad[i] = block[i] ^ 0x5c;
+            update(outer,pad,64);
+        }
+
+        Digest mac(const uint8_t* data, size_t size) const
+        {
+            State state = inner;
+            update(state,data,size);
+            const Digest first = finish(state);
+            state = outer;
+            update(state,first.data(),first.size());
+            return finish(state);
+        }
+    };
+
+    Digest hmac_sha256(const std::string& key, const void* data, size_t size)
+    {
+        return Keyed(key).mac(static_cast<const uint8_t*>(data),size);
+    }
+
+    // One output block is all the store needs
+    Digest pbkdf2_sha256(const std::string& password, const uint8_t* salt, size_t salt_size, uint32_t iterations)
+    {
+        const Keyed keyed(password);
+        std::string first(reinterpret_cast<const char*>(salt),salt_size);
+        first += std::string("\0\0\0\1",4);
+
+        Digest block = keyed.mac(reinterpret_cast<const uint8_t*>(first.data()),first.size());
+        Digest result = block;
+        for (uint32_t i = 1; i < iterations; ++i)
+        {
+            block = keyed.mac(block.data(),block.size());
+            for (size_t j = 0; j < result.size(); ++j)
+                result[j] ^= block[j];
+        }
+        return result;
+    }
+
+    void random_bytes(void* output, size_t size)
+    {
+        if (system_random(output,size)) return;
+        LOG_ERROR("No randomness to be had from the OS");
+        std::abort();
+    }
+
+    const char* backend() { return "portable"; }
+}
+
+#endif
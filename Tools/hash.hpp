@@ -0,0 +1,34 @@
+#ifndef NETWORK_HASH_HPP
+#define NETWORK_HASH_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+/*
+ * SHA-256 and the PBKDF2 and HKDF built on it, for the account store and datagram keys
+ * Builds with OpenSSL use its implementation, it has the CPU's SHA extensions behind it
+ * Secrets come from the OS generator, never from a seeded one
+ */
+
+namespace HASH
+{
+    typedef std::array<uint8_t,32> Digest;
+
+    Digest sha256(const void* data, size_t size);
+    Digest hmac_sha256(const std::string& key, const void* data, size_t size);
+    Digest pbkdf2_sha256(const std::string& password, const uint8_t* salt, size_t salt_size, uint32_t iterations);
+    // RFC 5869 extract then expand, one block of output is as much as any key here needs
+    Digest hkdf_sha256(const std::string& secret, const std::string& salt, const std::string& info);
+
+    // From the kernel's CSPRNG, or OpenSSL's when it's built in, the process stops rather than hand out guessable bytes
+    void random_bytes(void* output, size_t size);
+
+    // Same walk no matter where they differ
+    bool equal(const uint8_t* a, const uint8_t* b, size_t size);
+
+    const char* backend();
+}
+
+#endif //NETWORK_HASH_HPP
@@ -27,6 +27,13 @@ if (result != 0)\
 }
 
 #define GET_LAST_ERROR WSAGetLastError()
+#define SET_NONBLOCKING(socket) { u_long mode = 1; ioctlsocket(socket,FIONBIO,&mode); }
+#define SET_BLOCKING(socket) { u_long mode = 0; ioctlsocket(socket,FIONBIO,&mode); }
+#define SOCKET_WOULD_BLOCK (WSAGetLastError() == WSAEWOULDBLOCK)
+#define SET_WOULD_BLOCK WSASetLastError(WSAEWOULDBLOCK) // For wrappers reporting their own waits like a socket would
+#define SEND_NO_SIGNAL 0
+#define SEND_DONT_WAIT 0 // Winsock has no per call flag, sends on blocking sockets still block
+#define SOCKET_SELECTABLE(socket) true // fd_set is a list here, FD_SET ignores sockets past FD_SETSIZE instead of overrunning
 
 typedef int sockaddr_length;
 
@@ -38,15 +45,25 @@ typedef int sockaddr_length;
 #include <unistd.h>
 #include <string.h> // memset
 #include <errno.h>
+#include <fcntl.h>
 
 #define CLOSE_SOCKET(socket) close(socket)
 #define WINSOCK_CLEANUP
 #define WINSOCK_LINK
 #define GET_LAST_ERROR strerror(errno)
+#define SET_NONBLOCKING(socket) fcntl(socket,F_SETFL,fcntl(socket,F_GETFL,0) | O_NONBLOCK)
+#define SET_BLOCKING(socket) fcntl(socket,F_SETFL,fcntl(socket,F_GETFL,0) & ~O_NONBLOCK)
+#define SOCKET_WOULD_BLOCK (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINPROGRESS)
+#define SET_WOULD_BLOCK (errno = EWOULDBLOCK) // For wrappers reporting their own waits like a socket would
+#define SEND_NO_SIGNAL MSG_NOSIGNAL // A dead peer shouldn't take the process down with SIGPIPE
+#define SEND_DONT_WAIT MSG_DONTWAIT
+#define SOCKET_SELECTABLE(socket) ((socket) < FD_SETSIZE) // fd_set is a bitmap, FD_SET past it writes over whatever follows
 
 typedef unsigned long long SOCKET;
 typedef socklen_t sockaddr_length;
 
+#define INVALID_SOCKET static_cast<SOCKET>(~0ull)
+
 #endif
 
 #endif
@@ -1,82 +1,246 @@
 #include "packet_sender.hpp"
 #include "os_diff.hpp"
 #include "logging.hpp"
+#include "simd_scan.hpp"
+#include "tls.hpp"
+#include "trace.hpp"
 
-#include <sstream>
 #include <iostream>
+#include <map>
 #include <algorithm>
 
 namespace PACMAN
 {
-    const int packet_message_size = packet_size - 2;
+    const int receive_chunk = 64 * 1024;
+
+    // Read so far from one socket, the scan picks up where the last recv() left it
+    struct Inbound
+    {
+        std::string bytes;
+        size_t frame = 0; // Header of the first frame whose tail hasn't arrived
+        size_t scanned = 0; // Searched up to here without finding that tail
+    };
+
+    // Bytes read past the end of a message, keyed by socket
+    static std::map<SOCKET,Inbound> m_leftovers;
+    // Filled by preallocate(), a socket takes one on its first read and keeps it until it's forgotten
+    static std::vector<std::string> m_spare;
+    static bool m_pooled = false;
+
+    static Inbound& buffer_for(SOCKET sender)
+    {
+        const auto found = m_leftovers.find(sender);
+        if (found != m_leftovers.end()) return found->second;
+        Inbound buffer;
+        if (!m_spare.empty())
+        {
+            buffer.bytes = std::move(m_spare.back());
+            m_spare.pop_back();
+        }
+        return m_leftovers.emplace(sender,std::move(buffer)).first->second;
+    }
+
+    static void release(SOCKET sender)
+    {
+        const auto found = m_leftovers.find(sender);
+        if (found == m_leftovers.end()) return;
+        if (m_pooled)
+        {
+            found->second.bytes.clear(); // Keeps its capacity
+            m_spare.push_back(std::move(found->second.bytes));
+        }
+        m_leftovers.erase(found);
+    }
 
     void clean_string(std::string& input)
     {
+        TRACE_SPAN("clean_string");
         // Erase all codes
-        input.erase(std::remove(input.begin(),input.end(),TAIL_CODE_END), input.end());
-        input.erase(std::remove(input.begin(),input.end(),TAIL_CODE_CONTINUE), input.end());
-        input.erase(std::remove(input.begin(),input.end(),DISCONNECT), input.end());
-        input.erase(std::remove(input.begin(),input.end(),MESSAGE), input.end());
-        input.erase(std::remove(input.begin(),input.end(),REFUSE_CONNECTION), input.end());
+        input.resize(SCAN::strip_reserved(&input[0],input.size()));
     }
 
-    bool send_message(SOCKET receipient, NETWORK_CODE header, const std::string &message)
+    std::string encode_message(NETWORK_CODE header, const std::string& input, size_t frame)
     {
+        // Reserved bytes would be stripped on the other side anyway, and a stray '\n' would end the frame early
+        std::string message = input;
+        clean_string(message);
+
+        const size_t packet_message_size = negotiate_frame(frame) - 2;
         const size_t packets =
                 (message.size() / packet_message_size) +
                 ((message.size() % packet_message_size) != 0);
-        for (int i = 0; i < packets; ++i)
+        std::string frames;
+        frames.reserve(message.size() + packets * 2);
+        for (size_t i = 0; i < packets; ++i)
         {
-            std::stringstream final;
-            final << header; // Insert Header Code
-            final << message.substr( i*packet_message_size,
-                                     (i+1) == packets-1 ? message.npos : (i+1) * packet_message_size );
-            final << ((i == packets - 1) ? TAIL_CODE_END : TAIL_CODE_CONTINUE);
-            std::string final_message = final.str();
-            int result = send(receipient, final_message.c_str(), final_message.size(),0);
+            frames.push_back(static_cast<char>(header)); // Insert Header Code
+            frames.append(message, i * packet_message_size, packet_message_size);
+            frames.push_back(static_cast<char>((i == packets - 1) ? TAIL_CODE_END : TAIL_CODE_CONTINUE));
+        }
+        return frames;
+    }
+
+    bool send_encoded(SOCKET receipient, const std::string& frames)
+    {
+        size_t sent = 0;
+        while (sent < frames.size())
+        {
+            int result = TLS::send(receipient, frames.c_str() + sent, static_cast<int>(frames.size() - sent));
             if (result < 0)
             {
-                LOG_ERROR("send_message() failed on packet " << i+1 << " Out Of " << packets);
+                LOG_ERROR("send_encoded() failed after " << sent << " Out Of " << frames.size() << " bytes");
                 return false;
             }
+            sent += result;
         }
-
         return true;
     }
 
+    bool send_message(SOCKET receipient, NETWORK_CODE header, const std::string &message, size_t frame)
+    {
+        return send_encoded(receipient, encode_message(header, message, frame));
+    }
+
+    size_t negotiate_frame(size_t requested)
+    {
+        return std::min<size_t>(std::max<size_t>(requested,packet_size),max_packet_size);
+    }
+
+    size_t adapt_frame(size_t limit, size_t window, size_t segment)
+    {
+        if (!window) return limit;
+        size_t frame = std::min(limit,window);
+        if (segment && frame > segment) frame -= frame % segment;
+        return std::max<size_t>(frame,packet_size);
+    }
+
+    void size_buffers(SOCKET socket, LINK link)
+    {
+        // 0 leaves that side to the kernel, Linux grows it with the connection unless it's set by hand
+        int send_size = 0, receive_size = 0;
+        switch (link)
+        {
+            case LINK::INTERACTIVE: receive_size = 32 * 1024; break; // Typed lines, a big buffer would just sit there
+            case LINK::BULK: receive_size = 1024 * 1024; break;
+            case LINK::PEER: send_size = receive_size = 4 * 1024 * 1024; break;
+        }
+        if (send_size && setsockopt(socket,SOL_SOCKET,SO_SNDBUF,reinterpret_cast<const char*>(&send_size),sizeof(send_size)) < 0)
+            LOG_WARNING("Could not size the send buffer | " << socket << " | " << GET_LAST_ERROR);
+        if (receive_size && setsockopt(socket,SOL_SOCKET,SO_RCVBUF,reinterpret_cast<const char*>(&receive_size),sizeof(receive_size)) < 0)
+            LOG_WARNING("Could not size the receive buffer | " << socket << " | " << GET_LAST_ERROR);
+    }
+
+    // Index of the TAIL_CODE_END closing the first whole message, npos while it's still incomplete
+    // Frames already passed and bytes already searched aren't looked at again, a big frame arriving
+    // over many reads is scanned once
+    static size_t message_end(Inbound& buffer)
+    {
+        const std::string& bytes = buffer.bytes;
+        while (buffer.frame + 1 < bytes.size())
+        {
+            const size_t from = std::max(buffer.frame + 1,buffer.scanned);
+            const size_t tail = from + SCAN::find_tail(bytes.data() + from, bytes.size() - from);
+            if (tail >= bytes.size())
+            {
+                buffer.scanned = bytes.size();
+                break;
+            }
+            if (bytes[tail] == TAIL_CODE_END) return tail;
+            buffer.frame = tail + 1; // Next frame's header
+            buffer.scanned = 0;
+        }
+        return std::string::npos;
+    }
+
     RECV_RETURN_CODE receive_message(SOCKET sender, std::string& output)
     {
-        std::stringstream msg_stream;
-        std::stringstream final;
+        TRACE_SPAN_ARG("recv",sender);
+        Inbound& inbound = buffer_for(sender);
+        std::string& buffer = inbound.bytes;
 
-        bool all_messages_received = false;
-        do
+        size_t end = message_end(inbound);
+        while (end == std::string::npos)
         {
-            char buffer[packet_size+1]{'\0'};
-            int result = recv(sender,buffer,packet_size,0);
+            const size_t filled = buffer.size();
+            buffer.resize(filled + receive_chunk);
+            int result = TLS::recv(sender,&buffer[filled],receive_chunk);
+            buffer.resize(filled + (result > 0 ? result : 0));
+            if (result < 0 && SOCKET_WOULD_BLOCK) return RECV_RETURN_CODE::RECV_WOULD_BLOCK;
             if (result < 0)
             {
                 LOG_ERROR("Failure in recv()");
+                release(sender);
                 return RECV_RETURN_CODE::RECV_ERROR;
             }
-            if (result == 0) return RECV_RETURN_CODE::RECV_ZERO_LEN;
-
-            if (buffer[result-1] == TAIL_CODE_END)
+            if (result == 0)
             {
-                all_messages_received = true;
-                buffer[result-1] = '\0';
+                release(sender);
+                return RECV_RETURN_CODE::RECV_ZERO_LEN;
+            }
+            end = message_end(inbound);
+            if (end == std::string::npos && buffer.size() > max_message)
+            {
+                LOG_WARNING("Message over " << max_message << " bytes, dropping the sender | " << sender);
+                release(sender);
+                return RECV_RETURN_CODE::RECV_ERROR;
             }
-            msg_stream << buffer;
         }
-        while (!all_messages_received);
 
-        std::string unclean = msg_stream.str();
-        final << unclean[0]; // Store header
-        clean_string(unclean);
-        final << unclean;
+        // Header followed by every frame's payload, continuation headers and tails dropped
+        const char header = buffer[0];
+        static thread_local std::string unclean; // Keeps its capacity, one less allocation per message
+        unclean.assign(1,header);
+        size_t position = 0;
+        while (position < end)
+        {
+            const size_t tail = position + 1 + SCAN::find_tail(buffer.data() + position + 1, end - position);
+            unclean.append(buffer, position + 1, tail - position - 1);
+            position = tail + 1;
+        }
+        buffer.erase(0,end + 1);
+        inbound.frame = inbound.scanned = 0;
+        if (buffer.empty() && !m_pooled) m_leftovers.erase(sender);
 
-        output = final.str();
+        clean_string(unclean);
+        output.clear();
+        output.reserve(unclean.size() + 1);
+        output.push_back(header); // Store header
+        output += unclean;
 
         return RECV_RETURN_CODE::RECV_GOOD;
     }
+
+    size_t buffered(SOCKET sender)
+    {
+        const auto found = m_leftovers.find(sender);
+        return found == m_leftovers.end() ? 0 : found->second.bytes.size();
+    }
+
+    bool has_buffered_message(SOCKET sender)
+    {
+        const auto found = m_leftovers.find(sender);
+        if (found != m_leftovers.end() && message_end(found->second) != std::string::npos) return true;
+        return TLS::pending(sender);
+    }
+
+    void prime(SOCKET sender, const std::string& bytes)
+    {
+        buffer_for(sender).bytes.append(bytes);
+    }
+
+    void forget(SOCKET sender)
+    {
+        release(sender);
+    }
+
+    void preallocate(size_t connections)
+    {
+        m_pooled = true;
+        m_spare.reserve(m_spare.size() + connections);
+        for (size_t i = 0; i < connections; ++i)
+        {
+            m_spare.emplace_back();
+            m_spare.back().reserve(receive_chunk + packet_size);
+        }
+    }
 }
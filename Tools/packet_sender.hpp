@@ -5,23 +5,62 @@
 
 #include <string>
 #include <vector>
+#include <cstddef>
 
 // To get the word SOCKET
 typedef unsigned long long SOCKET;
 
 namespace PACMAN
 {
-    const static int packet_size = 1024; // 1022 + HEADER_CODE + TAIL_CODE
+    const static int packet_size = 1024; // 1022 + HEADER_CODE + TAIL_CODE, every peer takes these without asking
+    const static int max_packet_size = 64 * 1024; // Most a peer can ask for in the handshake
+    const static size_t max_message = 256 * 1024; // Buffered past this without an end and the sender is cut off
 
     enum class RECV_RETURN_CODE
     {
         RECV_ERROR,
         RECV_ZERO_LEN,
-        RECV_GOOD
+        RECV_GOOD,
+        RECV_WOULD_BLOCK // Non-blocking socket ran dry partway through, what came in so far stays buffered
     };
 
-    bool send_message(SOCKET receipient, NETWORK_CODE header, const std::string &message);
+    // Strips every reserved NETWORK_CODE byte out of a received message
+    void clean_string(std::string& input);
+
+    // Frames a message once so it can be sent to many sockets, bigger frames only to peers that agreed to them
+    std::string encode_message(NETWORK_CODE header, const std::string& message, size_t frame = packet_size);
+    bool send_encoded(SOCKET receipient, const std::string& frames);
+
+    bool send_message(SOCKET receipient, NETWORK_CODE header, const std::string &message, size_t frame = packet_size);
+
+    // What a peer asked for in the handshake, held between packet_size and max_packet_size
+    size_t negotiate_frame(size_t requested);
+    // Frame size for a connection moving window bytes per round trip, 0 when it isn't known
+    // Whole segments no bigger than the window, so a frame isn't held back waiting on more round trips
+    size_t adapt_frame(size_t limit, size_t window, size_t segment);
+
+    enum class LINK
+    {
+        INTERACTIVE, // A chat client as the server sees it, typed lines coming in
+        BULK,        // A scripted client, the server's answers pile up faster than it reads them
+        PEER         // Server to server, everything for a whole node goes through one of these
+    };
+    // Kernel buffers to match how a connection is used, call before it carries anything
+    void size_buffers(SOCKET socket, LINK link);
+
+    // Reads whole messages, bytes past the first TAIL_CODE_END stay buffered for the next call
+    // On a blocking socket it waits for the tail, a non-blocking one gets RECV_WOULD_BLOCK instead
     RECV_RETURN_CODE receive_message(SOCKET sender, std::string& output);
+    // select() won't fire for these so callers have to drain them after a read
+    bool has_buffered_message(SOCKET sender);
+    // Bytes read from a socket that aren't a whole message yet
+    size_t buffered(SOCKET sender);
+    // Bytes that arrived before PACMAN was reading the socket, they come out ahead of anything recv() gets
+    void prime(SOCKET sender, const std::string& bytes);
+    // Drops anything buffered for a socket that is about to be closed
+    void forget(SOCKET sender);
+    // Receive buffers for this many connections up front, reused from then on instead of freed
+    void preallocate(size_t connections);
 }
 
 #endif //NETWORK_PACKET_SENDER_HPP
@@ -0,0 +1,288 @@
+#include "simd_scan.hpp"
+#include "NETWORK_CODES.hpp"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SCAN_SSE2
+#define SCAN_AVX2
+#else
+#define SCAN_SSE2 __attribute__((target("sse2"))) // Only a given on x86-64, 32 bit builds may run without it
+#define SCAN_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// The vector kernels test ranges instead of each code
+static_assert(DISCONNECT == 0 && MESSAGE == 1, "Reserved header codes moved");
+static_assert(TAIL_CODE_END == 10 && TAIL_CODE_CONTINUE == 11 && REFUSE_CONNECTION == 12, "Reserved tail codes moved");
+
+namespace SCAN
+{
+    static bool is_reserved(unsigned char c)
+    {
+        return c <= MESSAGE || (c >= TAIL_CODE_END && c <= REFUSE_CONNECTION);
+    }
+
+    static bool is_tail(unsigned char c)
+    {
+        return c == TAIL_CODE_END || c == TAIL_CODE_CONTINUE;
+    }
+
+    // Checks one code point starting at data[i], moves i past it
+    static bool utf8_step(const unsigned char* data, size_t size, size_t& i)
+    {
+        const unsigned char lead = data[i];
+        size_t length;
+        uint32_t code;
+        if (lead < 0x80) { ++i; return true; }
+        else if (lead >= 0xC2 && lead <= 0xDF) { length = 2; code = lead & 0x1F; }
+        else if (lead >= 0xE0 && lead <= 0xEF) { length = 3; code = lead & 0x0F; }
+        else if (lead >= 0xF0 && lead <= 0xF4) { length = 4; code = lead & 0x07; }
+        else return false;
+
+        if (i + length > size) return false;
+        for (size_t j = 1; j < length; ++j)
+        {
+            if ((data[i + j] & 0xC0) != 0x80) return false;
+            code = (code << 6) | (data[i + j] & 0x3F);
+        }
+        if (length == 3 && (code < 0x800 || (code >= 0xD800 && code <= 0xDFFF))) return false; // Overlong or surrogate
+        if (length == 4 && (code < 0x10000 || code > 0x10FFFF)) return false;
+        i += length;
+        return true;
+    }
+
+    // Scalar
+
+    static size_t strip_scalar(char* data, size_t size)
+    {
+        size_t write = 0;
+        for (size_t read = 0; read < size; ++read)
+        {
+            if (is_reserved(static_cast<unsigned char>(data[read]))) continue;
+            data[write++] = data[read];
+        }
+        return write;
+    }
+
+    static size_t find_tail_scalar(const char* data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            if (is_tail(static_cast<unsigned char>(data[i]))) return i;
+        return size;
+    }
+
+    static bool utf8_scalar(const char* data, size_t size)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        size_t i = 0;
+        while (i < size)
+            if (!utf8_step(bytes,size,i)) return false;
+        return true;
+    }
+
+#ifdef SCAN_X86
+    // SSE2, 16 bytes at a time
+
+    // x <= limit as unsigned bytes
+    SCAN_SSE2 static __m128i at_most(__m128i x, char limit)
+    {
+        return _mm_cmpeq_epi8(_mm_min_epu8(x,_mm_set1_epi8(limit)),x);
+    }
+
+    SCAN_SSE2 static __m128i reserved_mask(__m128i x)
+    {
+        const __m128i header = at_most(x,MESSAGE);
+        const __m128i tail = at_most(_mm_sub_epi8(x,_mm_set1_epi8(TAIL_CODE_END)),REFUSE_CONNECTION - TAIL_CODE_END);
+        return _mm_or_si128(header,tail);
+    }
+
+    SCAN_SSE2 static size_t strip_sse2(char* data, size_t size)
+    {
+        size_t read = 0;
+        size_t write = 0;
+        for (; read + 16 <= size; read += 16)
+        {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + read));
+            const int mask = _mm_movemask_epi8(reserved_mask(block));
+            if (!mask)
+            {
+                // write never passes read so this only lands on bytes already loaded
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(data + write),block);
+                write += 16;
+                continue;
+            }
+            alignas(16) char copy[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(copy),block);
+            for (int i = 0; i < 16; ++i)
+                if (!((mask >> i) & 1)) data[write++] = copy[i];
+        }
+        for (; read < size; ++read)
+            if (!is_reserved(static_cast<unsigned char>(data[read]))) data[write++] = data[read];
+        return write;
+    }
+
+    SCAN_SSE2 static size_t find_tail_sse2(const char* data, size_t size)
+    {
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            const __m128i tail = at_most(_mm_sub_epi8(block,_mm_set1_epi8(TAIL_CODE_END)),TAIL_CODE_CONTINUE - TAIL_CODE_END);
+            const int mask = _mm_movemask_epi8(tail);
+            if (mask)
+            {
+                unsigned long index = 0;
+                while (!((mask >> index) & 1)) ++index;
+                return i + index;
+            }
+        }
+        return i + find_tail_scalar(data + i,size - i);
+    }
+
+    // Skips ASCII runs a block at a time, anything else is checked one code point at a time
+    SCAN_SSE2 static bool utf8_sse2(const char* data, size_t size)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        size_t i = 0;
+        while (i < size)
+        {
+            if (i + 16 <= size && !_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))))
+            {
+                i += 16;
+                continue;
+            }
+            if (!utf8_step(bytes,size,i)) return false;
+        }
+        return true;
+    }
+
+    // AVX2, 32 bytes at a time
+
+    SCAN_AVX2 static __m256i at_most_avx2(__m256i x, char limit)
+    {
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(x,_mm256_set1_epi8(limit)),x);
+    }
+
+    SCAN_AVX2 static size_t strip_avx2(char* data, size_t size)
+    {
+        size_t read = 0;
+        size_t write = 0;
+        for (; read + 32 <= size; read += 32)
+        {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + read));
+            const __m256i header = at_most_avx2(block,MESSAGE);
+            const __m256i tail = at_most_avx2(_mm256_sub_epi8(block,_mm256_set1_epi8(TAIL_CODE_END)),REFUSE_CONNECTION - TAIL_CODE_END);
+            const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(header,tail)));
+            if (!mask)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + write),block);
+                write += 32;
+                continue;
+            }
+            alignas(32) char copy[32];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(copy),block);
+            for (int i = 0; i < 32; ++i)
+                if (!((mask >> i) & 1)) data[write++] = copy[i];
+        }
+        for (; read < size; ++read)
+            if (!is_reserved(static_cast<unsigned char>(data[read]))) data[write++] = data[read];
+        return write;
+    }
+
+    SCAN_AVX2 static size_t find_tail_avx2(const char* data, size_t size)
+    {
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            const __m256i tail = at_most_avx2(_mm256_sub_epi8(block,_mm256_set1_epi8(TAIL_CODE_END)),TAIL_CODE_CONTINUE - TAIL_CODE_END);
+            const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(tail));
+            if (mask)
+            {
+                unsigned long index = 0;
+                while (!((mask >> index) & 1)) ++index;
+                return i + index;
+            }
+        }
+        return i + find_tail_scalar(data + i,size - i);
+    }
+
+    SCAN_AVX2 static bool utf8_avx2(const char* data, size_t size)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        size_t i = 0;
+        while (i < size)
+        {
+            if (i + 32 <= size && !_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i))))
+            {
+                i += 32;
+                continue;
+            }
+            if (!utf8_step(bytes,size,i)) return false;
+        }
+        return true;
+    }
+
+    static bool has_sse2()
+    {
+#if defined(__x86_64__) || defined(_M_X64)
+        return true; // Part of the x86-64 baseline
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info,1);
+        return (info[3] & (1 << 26)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+#endif
+    }
+
+    static bool has_avx2()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info,1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false; // OS has to save the YMM registers
+        __cpuidex(info,7,0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    struct Kernels
+    {
+        size_t (*strip)(char*, size_t);
+        size_t (*find_tail)(const char*, size_t);
+        bool (*utf8)(const char*, size_t);
+        const char* name;
+    };
+
+    static Kernels pick_kernels()
+    {
+#ifdef SCAN_X86
+        if (has_avx2()) return Kernels{strip_avx2,find_tail_avx2,utf8_avx2,"avx2"};
+        if (has_sse2()) return Kernels{strip_sse2,find_tail_sse2,utf8_sse2,"sse2"};
+#endif
+        return Kernels{strip_scalar,find_tail_scalar,utf8_scalar,"scalar"};
+    }
+
+    static const Kernels& kernels()
+    {
+        static const Kernels picked = pick_kernels();
+        return picked;
+    }
+
+    size_t strip_reserved(char* data, size_t size) { return kernels().strip(data,size); }
+    size_t find_tail(const char* data, size_t size) { return kernels().find_tail(data,size); }
+    bool valid_utf8(const char* data, size_t size) { return kernels().utf8(data,size); }
+    const char* kernel_name() { return kernels().name; }
+}
@@ -0,0 +1,24 @@
+#ifndef NETWORK_SIMD_SCAN_HPP
+#define NETWORK_SIMD_SCAN_HPP
+
+#include <cstddef>
+
+/*
+ * Byte scanning kernels for the receive path
+ * AVX2 or SSE2 is picked once at startup, anything else falls back to scalar
+ */
+
+namespace SCAN
+{
+    // Removes every reserved NETWORK_CODE byte in place, returns the new size
+    size_t strip_reserved(char* data, size_t size);
+
+    // Index of the first TAIL_CODE_END or TAIL_CODE_CONTINUE, size if there is none
+    size_t find_tail(const char* data, size_t size);
+
+    bool valid_utf8(const char* data, size_t size);
+
+    const char* kernel_name();
+}
+
+#endif //NETWORK_SIMD_SCAN_HPP
@@ -0,0 +1,348 @@
+#include "tls.hpp"
+#include "os_diff.hpp"
+#include "logging.hpp"
+
+#include <iostream>
+
+bool TLS::constant_time_equals(const std::string& provided, const std::string& expected)
+{
+    // Walks the expected secret every time, a length mismatch just poisons the result
+    unsigned char difference = provided.size() != expected.size();
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        const unsigned char other = i < provided.size() ? static_cast<unsigned char>(provided[i]) : 0;
+        difference |= other ^ static_cast<unsigned char>(expected[i]);
+    }
+    return difference == 0;
+}
+
+#ifdef NETWORK_WITH_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <csignal>
+
+namespace TLS
+{
+    struct Session
+    {
+        SSL* ssl = nullptr;
+        bool kernel_send = false;
+        bool kernel_recv = false;
+        bool blocking = false; // Socket was blocking before connect(), send()/recv() wait on its behalf
+        std::mutex lock; // The client reads and writes from different threads, held for one OpenSSL call at a time
+
+        ~Session() { SSL_free(ssl); }
+    };
+    typedef std::shared_ptr<Session> SessionPtr;
+
+    static SSL_CTX* m_context = nullptr;
+    static std::map<SOCKET,SessionPtr> m_sessions;
+    static std::mutex m_sessions_lock;
+
+    static void log_errors(const char* what)
+    {
+        char reason[256];
+        unsigned long error = ERR_get_error();
+        if (!error) LOG_ERROR(what);
+        for (; error; error = ERR_get_error())
+        {
+            ERR_error_string_n(error,reason,sizeof(reason));
+            LOG_ERROR(what << " | " << reason);
+        }
+    }
+
+    static SessionPtr find(SOCKET socket)
+    {
+        std::lock_guard<std::mutex> guard(m_sessions_lock);
+        const auto found = m_sessions.find(socket);
+        return found == m_sessions.end() ? nullptr : found->second;
+    }
+
+    static SSL_CTX* make_context(const SSL_METHOD* method)
+    {
+        SSL_CTX* context = SSL_CTX_new(method);
+        if (!context) return nullptr;
+        SSL_CTX_set_min_proto_version(context,TLS1_2_VERSION);
+#ifdef SIGPIPE
+        // OpenSSL writes without MSG_NOSIGNAL, a close_notify to a peer that hung up would kill us
+        std::signal(SIGPIPE,SIG_IGN);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(context,SSL_OP_ENABLE_KTLS);
+#endif
+        // A full socket hands back what fit, and the retry may come from the outbound queue's copy
+        SSL_CTX_set_mode(context,SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        return context;
+    }
+
+    bool available() { return true; }
+
+    bool init_server(const std::string& certificate, const std::string& private_key)
+    {
+        m_context = make_context(TLS_server_method());
+        if (!m_context)
+        {
+            log_errors("Failed To Create TLS Context");
+            return false;
+        }
+        if (SSL_CTX_use_certificate_chain_file(m_context,certificate.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(m_context,private_key.c_str(),SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(m_context) != 1)
+        {
+            log_errors("Failed To Load Certificate");
+            SSL_CTX_free(m_context);
+            m_context = nullptr;
+            return false;
+        }
+        // Tickets are post handshake records a kernel receiver can't take through plain recv()
+        SSL_CTX_set_num_tickets(m_context,0);
+        return true;
+    }
+
+    bool init_client(const std::string& trusted_certificate)
+    {
+        m_context = make_context(TLS_client_method());
+        if (!m_context)
+        {
+            log_errors("Failed To Create TLS Context");
+            return false;
+        }
+        const int loaded = trusted_certificate.empty()
+                ? SSL_CTX_set_default_verify_paths(m_context)
+                : SSL_CTX_load_verify_locations(m_context,trusted_certificate.c_str(),nullptr);
+        if (loaded != 1)
+        {
+            log_errors("Failed To Load Trusted Certificates");
+            SSL_CTX_free(m_context);
+            m_context = nullptr;
+            return false;
+        }
+        SSL_CTX_set_verify(m_context,SSL_VERIFY_PEER,nullptr);
+        return true;
+    }
+
+    bool enabled() { return m_context != nullptr; }
+
+    static SessionPtr make_session(SOCKET socket)
+    {
+        SessionPtr session = std::make_shared<Session>();
+        session->ssl = SSL_new(m_context);
+        if (!session->ssl || SSL_set_fd(session->ssl,static_cast<int>(socket)) != 1)
+        {
+            log_errors("Failed To Create TLS Session");
+            return nullptr;
+        }
+        return session;
+    }
+
+    static void established(Session& session)
+    {
+        session.kernel_send = BIO_get_ktls_send(SSL_get_wbio(session.ssl)) > 0;
+        session.kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(session.ssl)) > 0;
+        LOG_INFO("TLS Established | " << SSL_get_version(session.ssl) << ' ' << SSL_get_cipher(session.ssl)
+                 << " | Kernel Send " << (session.kernel_send ? "On" : "Off")
+                 << " | Kernel Receive " << (session.kernel_recv ? "On" : "Off"));
+    }
+
+    // The session is registered up front so the next call picks up where this one stopped
+    HANDSHAKE accept(SOCKET socket)
+    {
+        SessionPtr session = find(socket);
+        if (!session)
+        {
+            session = make_session(socket);
+            if (!session) return HANDSHAKE::FAILED;
+            std::lock_guard<std::mutex> guard(m_sessions_lock);
+            m_sessions[socket] = session;
+        }
+
+        std::lock_guard<std::mutex> guard(session->lock);
+        const int result = SSL_accept(session->ssl);
+        if (result == 1)
+        {
+            established(*session);
+            return HANDSHAKE::DONE;
+        }
+        switch (SSL_get_error(session->ssl,result))
+        {
+            case SSL_ERROR_WANT_READ:
+                return HANDSHAKE::WANT_READ;
+            case SSL_ERROR_WANT_WRITE:
+                return HANDSHAKE::WANT_WRITE;
+            default:
+                log_errors("TLS Handshake Failed");
+                return HANDSHAKE::FAILED;
+        }
+    }
+
+    bool connect(SOCKET socket, const std::string& address)
+    {
+        const SessionPtr session = make_session(socket);
+        if (!session) return false;
+
+        // Servers are reached by address, so the certificate needs it as an IP or DNS name
+        if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(session->ssl),address.c_str()) != 1)
+            SSL_set1_host(session->ssl,address.c_str());
+        if (SSL_connect(session->ssl) != 1)
+        {
+            log_errors("TLS Handshake Failed");
+            return false;
+        }
+        established(*session);
+        // Blocking SSL_read would sit on the session lock until the server spoke, so the socket
+        // never blocks and send()/recv() do the waiting with the lock let go
+        SET_NONBLOCKING(socket);
+        session->blocking = true;
+
+        std::lock_guard<std::mutex> guard(m_sessions_lock);
+        m_sessions[socket] = session;
+        return true;
+    }
+
+    enum class WAIT { NONE, READ, WRITE };
+
+    // What a failed SSL_read/SSL_write needs before it can go again, NONE for a real failure
+    // Waits are reported as a would block error, the same as a plain socket
+    static WAIT waiting_on(int error)
+    {
+        switch (error)
+        {
+            case SSL_ERROR_WANT_READ:
+                SET_WOULD_BLOCK;
+                return WAIT::READ;
+            case SSL_ERROR_WANT_WRITE:
+                SET_WOULD_BLOCK;
+                return WAIT::WRITE;
+            default:
+                return WAIT::NONE;
+        }
+    }
+
+    static void wait_for(SOCKET socket, WAIT wait)
+    {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(socket,&ready);
+        select(static_cast<int>(socket + 1),wait == WAIT::READ ? &ready : nullptr,wait == WAIT::WRITE ? &ready : nullptr,nullptr,nullptr);
+    }
+
+    static int write_once(Session& session, SOCKET socket, const char* data, int size, WAIT& wait)
+    {
+        // Kernel TLS frames and encrypts whatever goes down the socket
+        if (session.kernel_send)
+        {
+            const int result = static_cast<int>(::send(socket,data,size,SEND_NO_SIGNAL | SEND_DONT_WAIT));
+            if (result < 0 && SOCKET_WOULD_BLOCK) wait = WAIT::WRITE;
+            return result;
+        }
+
+        std::lock_guard<std::mutex> guard(session.lock);
+        const int result = SSL_write(session.ssl,data,size);
+        if (result > 0) return result;
+        wait = waiting_on(SSL_get_error(session.ssl,result));
+        return -1;
+    }
+
+    int send(SOCKET socket, const char* data, int size)
+    {
+        const SessionPtr session = find(socket);
+        if (!session) return static_cast<int>(::send(socket,data,size,SEND_NO_SIGNAL));
+
+        while (true)
+        {
+            WAIT wait = WAIT::NONE;
+            const int result = write_once(*session,socket,data,size,wait);
+            if (result >= 0 || wait == WAIT::NONE || !session->blocking) return result;
+            wait_for(socket,wait);
+        }
+    }
+
+    int try_send(SOCKET socket, const char* data, int size)
+    {
+        const SessionPtr session = find(socket);
+        if (!session) return static_cast<int>(::send(socket,data,size,SEND_NO_SIGNAL | SEND_DONT_WAIT));
+        WAIT wait = WAIT::NONE;
+        return write_once(*session,socket,data,size,wait);
+    }
+
+    int recv(SOCKET socket, char* data, int size)
+    {
+        const SessionPtr session = find(socket);
+        if (!session) return static_cast<int>(::recv(socket,data,size,0));
+
+        while (true)
+        {
+            WAIT wait = WAIT::NONE;
+            {
+                // Still through OpenSSL with kernel receive, alerts and key updates arrive as control records
+                std::lock_guard<std::mutex> guard(session->lock);
+                const int result = SSL_read(session->ssl,data,size);
+                if (result > 0) return result;
+                const int error = SSL_get_error(session->ssl,result);
+                if (error == SSL_ERROR_ZERO_RETURN) return 0;
+                wait = waiting_on(error);
+            }
+            if (wait == WAIT::NONE || !session->blocking) return -1;
+            wait_for(socket,wait);
+        }
+    }
+
+    bool pending(SOCKET socket)
+    {
+        const SessionPtr session = find(socket);
+        if (!session) return false;
+        std::lock_guard<std::mutex> guard(session->lock);
+        return SSL_pending(session->ssl) > 0;
+    }
+
+    void release(SOCKET socket)
+    {
+        SessionPtr session;
+        {
+            std::lock_guard<std::mutex> guard(m_sessions_lock);
+            const auto found = m_sessions.find(socket);
+            if (found == m_sessions.end()) return;
+            session = found->second;
+            m_sessions.erase(found);
+        }
+        std::lock_guard<std::mutex> guard(session->lock);
+        SSL_shutdown(session->ssl); // Best effort close_notify, the socket is going away anyway
+    }
+}
+
+#else
+
+namespace TLS
+{
+    bool available() { return false; }
+
+    bool init_server(const std::string&, const std::string&)
+    {
+        LOG_ERROR("Built without TLS, reconfigure with -DNETWORK_TLS=ON");
+        return false;
+    }
+
+    bool init_client(const std::string&)
+    {
+        LOG_ERROR("Built without TLS, reconfigure with -DNETWORK_TLS=ON");
+        return false;
+    }
+
+    bool enabled() { return false; }
+    HANDSHAKE accept(SOCKET) { return HANDSHAKE::FAILED; }
+    bool connect(SOCKET, const std::string&) { return false; }
+
+    int send(SOCKET socket, const char* data, int size) { return static_cast<int>(::send(socket,data,size,SEND_NO_SIGNAL)); }
+    int try_send(SOCKET socket, const char* data, int size) { return static_cast<int>(::send(socket,data,size,SEND_NO_SIGNAL | SEND_DONT_WAIT)); }
+    int recv(SOCKET socket, char* data, int size) { return static_cast<int>(::recv(socket,data,size,0)); }
+    bool pending(SOCKET) { return false; }
+    void release(SOCKET) {}
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef NETWORK_TLS_HPP
+#define NETWORK_TLS_HPP
+
+#include <string>
+
+// To get the word SOCKET
+typedef unsigned long long SOCKET;
+
+/*
+ * Optional TLS for the chat connection, build with -DNETWORK_TLS=ON
+ * The handshake happens in OpenSSL, then records are handed to kernel TLS when the kernel has it
+ * so a broadcast stays one plain send() per recipient with no encrypt pass of our own
+ * Sockets without a session go straight through to send()/recv()
+ */
+
+namespace TLS
+{
+    bool available(); // Compiled in
+
+    bool init_server(const std::string& certificate, const std::string& private_key);
+    bool init_client(const std::string& trusted_certificate);
+    bool enabled(); // One of the inits succeeded
+
+    enum class HANDSHAKE { DONE, WANT_READ, WANT_WRITE, FAILED };
+
+    // Non-blocking, call again once the socket is ready for what it asked for, release() after FAILED
+    HANDSHAKE accept(SOCKET socket);
+    // Blocking, the socket is left plain when it fails
+    // On success the socket goes non-blocking underneath, send() and recv() still wait for the caller
+    bool connect(SOCKET socket, const std::string& address);
+
+    // Waits only for sockets that were blocking when connect() took them, otherwise the same as try_send()
+    int send(SOCKET socket, const char* data, int size);
+    // Gives up with a would block error instead of waiting, may write part of what it was given
+    // After a would block the retry has to offer the same bytes again, they're allowed to have moved
+    int try_send(SOCKET socket, const char* data, int size);
+    // Would block on a non-blocking socket, a blocking one waits without holding up send()
+    int recv(SOCKET socket, char* data, int size);
+    bool pending(SOCKET socket); // Decrypted bytes select() can't see
+    void release(SOCKET socket);
+
+    // Doesn't leave early on the first mismatch so the timing gives nothing away
+    bool constant_time_equals(const std::string& provided, const std::string& expected);
+}
+
+#endif //NETWORK_TLS_HPP
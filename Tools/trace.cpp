@@ -0,0 +1,130 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace TRACE
+{
+    struct Event
+    {
+        const char* name;
+        uint64_t start;
+        uint64_t duration;
+        uint64_t arg;
+    };
+
+    struct Ring
+    {
+        uint32_t thread = 0;
+        std::atomic<uint64_t> head{0}; // Events ever written, the slot is head % TRACE_RING_EVENTS
+        Event events[TRACE_RING_EVENTS];
+    };
+
+    thread_local bool t_active = false;
+    static thread_local std::shared_ptr<Ring> t_ring;
+    static thread_local uint32_t t_counter = 0;
+
+    static std::atomic<uint32_t> m_rate{0};
+    static std::mutex m_rings_lock; // Only taken when a thread records its first span and by dumps
+    static std::vector<std::shared_ptr<Ring>> m_rings; // Outlive their threads, a dump still wants them
+    static const auto m_epoch = std::chrono::steady_clock::now();
+
+    void set_rate(uint32_t every)
+    {
+        m_rate.store(every,std::memory_order_relaxed);
+    }
+
+    uint32_t rate()
+    {
+        return m_rate.load(std::memory_order_relaxed);
+    }
+
+    // Never 0, a span uses that for not sampled
+    uint64_t now()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count()) + 1;
+    }
+
+    void record(const char* name, uint64_t start, uint64_t end, uint64_t arg)
+    {
+        if (!t_ring)
+        {
+            t_ring = std::make_shared<Ring>();
+            std::lock_guard<std::mutex> guard(m_rings_lock);
+            t_ring->thread = static_cast<uint32_t>(m_rings.size() + 1);
+            m_rings.push_back(t_ring);
+        }
+        Ring& ring = *t_ring;
+        const uint64_t head = ring.head.load(std::memory_order_relaxed);
+        ring.events[head % TRACE_RING_EVENTS] = Event{name,start,end - start,arg};
+        ring.head.store(head + 1,std::memory_order_release);
+    }
+
+    Request::Request(const char* name, uint64_t arg) : m_name(name), m_arg(arg)
+    {
+        const uint32_t every = m_rate.load(std::memory_order_relaxed);
+        if (!every || t_active || ++t_counter % every != 0) return;
+        m_sampled = true;
+        t_active = true;
+        m_start = now();
+    }
+
+    Request::~Request()
+    {
+        if (!m_sampled) return;
+        record(m_name,m_start,now(),m_arg);
+        t_active = false;
+    }
+
+    // Whatever is still in the ring, less anything the writer lapped while we copied
+    static void snapshot(const Ring& ring, std::vector<Event>& output)
+    {
+        const uint64_t head = ring.head.load(std::memory_order_acquire);
+        const uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        std::vector<Event> copied;
+        copied.reserve(static_cast<size_t>(head - first));
+        for (uint64_t i = first; i < head; ++i)
+            copied.push_back(ring.events[i % TRACE_RING_EVENTS]);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t after = ring.head.load(std::memory_order_relaxed);
+        const uint64_t safe = after > TRACE_RING_EVENTS ? after - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = std::max(first,safe); i < head; ++i)
+            output.push_back(copied[static_cast<size_t>(i - first)]);
+    }
+
+    bool dump(const std::string& path, size_t& written)
+    {
+        std::vector<std::shared_ptr<Ring>> rings;
+        {
+            std::lock_guard<std::mutex> guard(m_rings_lock);
+            rings = m_rings;
+        }
+
+        std::ofstream file(path,std::ios::trunc);
+        if (!file) return false;
+        written = 0;
+        file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        std::vector<Event> events;
+        for (const auto& ring : rings)
+        {
+            events.clear();
+            snapshot(*ring,events);
+            for (const Event& event : events)
+            {
+                // Complete events, times in microseconds
+                file << (written++ ? ",\n" : "\n")
+                     << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->thread
+                     << ",\"ts\":" << event.start / 1000 << '.' << event.start % 1000 / 100 << event.start % 100 / 10 << event.start % 10
+                     << ",\"dur\":" << event.duration / 1000 << '.' << event.duration % 1000 / 100 << event.duration % 100 / 10 << event.duration % 10
+                     << ",\"args\":{\"arg\":" << event.arg << "}}";
+            }
+        }
+        file << "\n]}\n";
+        return static_cast<bool>(file);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef NETWORK_TRACE_HPP
+#define NETWORK_TRACE_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define TRACE_RING_EVENTS 16384 // Per thread, the oldest spans get overwritten
+
+#define TRACE_JOIN_INNER(a,b) a##b
+#define TRACE_JOIN(a,b) TRACE_JOIN_INNER(a,b)
+#define TRACE_SPAN(name) const TRACE::Span TRACE_JOIN(trace_span_,__LINE__)(name)
+#define TRACE_SPAN_ARG(name,arg) const TRACE::Span TRACE_JOIN(trace_span_,__LINE__)(name,static_cast<uint64_t>(arg))
+
+/*
+ * Sampled span tracing through the request path, dumped as Chrome trace JSON
+ * chrome://tracing and ui.perfetto.dev both open the dumps
+ * One request in every N is traced, spans go into a ring owned by the thread that ran them
+ * Rings have one writer and get read without stopping it, a dump drops whatever was overwritten mid read
+ * With sampling off a span is one thread local check
+ */
+
+namespace TRACE
+{
+    extern thread_local bool t_active; // Inside a sampled request
+
+    void set_rate(uint32_t every); // 0 turns sampling off
+    uint32_t rate();
+
+    uint64_t now(); // Nanoseconds
+    void record(const char* name, uint64_t start, uint64_t end, uint64_t arg);
+
+    // Root of a request, decides whether it gets sampled
+    struct Request
+    {
+        explicit Request(const char* name, uint64_t arg = 0);
+        ~Request();
+        Request(const Request&) = delete;
+        Request& operator=(const Request&) = delete;
+
+    private:
+        const char* m_name;
+        uint64_t m_arg;
+        uint64_t m_start = 0;
+        bool m_sampled = false;
+    };
+
+    // Names have to outlive the dump, string literals only
+    struct Span
+    {
+        explicit Span(const char* name, uint64_t arg = 0) : m_name(name), m_arg(arg), m_start(t_active ? now() : 0) {}
+        ~Span() { if (m_start) record(m_name,m_start,now(),m_arg); }
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* m_name;
+        uint64_t m_arg;
+        uint64_t m_start;
+    };
+
+    // Carries a request's sampling onto another thread for a while
+    struct Inherit
+    {
+        explicit Inherit(bool active) : m_previous(t_active) { t_active = active; }
+        ~Inherit() { t_active = m_previous; }
+
+    private:
+        bool m_previous;
+    };
+
+    // Every ring into one file, false if it couldn't be written
+    bool dump(const std::string& path, size_t& written);
+}
+
+#endif //NETWORK_TRACE_HPP